@@ -3,4 +3,10 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Cortex-M3 DWT cycle counter, started by cyccnt_init() in main.c */
+#define DEMCR		(*(volatile uint32_t *)0xE000EDFC)
+#define DEMCR_TRCENA	(1 << 24)
+#define DWT_CTRL	(*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT	(*(volatile uint32_t *)0xE0001004)
+
 #endif
@@ -31,5 +31,8 @@ extern unsigned char fastsource_interfaces[3];
 void fastsource_init(void);
 void fastsource_start(void);
 void fastsource_dump(void);
+void fastsource_process_cmds(void);
+int fastsource_cmds_idle(void);
+void fastsource_drop_queued(void);
 
 void usb_submit_req_ctx(struct req_ctx *rctx);
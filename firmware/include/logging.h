@@ -1,8 +1,12 @@
 #ifndef _LOGGING_H
 #define _LOGGING_H
 
+#define DMAIN	0
 #define DTUN	1
 #define DVCO	2
+#define DSSC	3
+#define DUSB	4
+#define _NUM_DSUBSYS	5
 
 /*! \brief different log levels */
 #define LOGL_DEBUG	1	/*!< \brief debugging information */
@@ -21,4 +25,9 @@ void logp2(int subsys, unsigned int level, char *file,
 	   int line, int cont, const char *format, ...)
 				__attribute__ ((format (printf, 6, 7)));
 
+/* messages are only queued by logp2(), the main loop prints them */
+int log_drain(void);
+void log_set_level(int subsys, unsigned int level);
+void log_init(void);
+
 #endif
@@ -9,4 +9,54 @@ int ssc_active(void);
 int ssc_dma_start(void);
 int ssc_dma_stop(void);
 
+/* Optional in-band header at the start of every sample buffer sent to the
+ * host.  The host uses it to find lost buffers and SSC overruns. */
+#define OSDR_FRAME_MAGIC	0x4d46	/* "FM" */
+
+#define OSDR_FRAME_F_RESTART	0x01	/* SSC was restarted, samples missing */
+#define OSDR_FRAME_F_OVERRUN	0x02	/* SSC overrun since the previous frame */
+
+struct osdr_frame_hdr {
+	uint16_t magic;
+	uint8_t hdr_len;	/* sizeof(struct osdr_frame_hdr) */
+	uint8_t flags;
+	uint16_t len;		/* total length including this header */
+	uint16_t seq;		/* incremented with every buffer */
+	uint32_t sample_ctr;	/* samples received before this buffer,
+				 * including those dropped for lack of
+				 * buffers */
+	uint32_t ovrun;		/* total number of SSC overruns */
+	uint32_t cmd_sample;	/* sample counter when the last timed
+				 * command completed */
+	uint16_t cmd_tag;	/* its tag */
+	uint16_t cmd_seq;	/* timed commands completed so far */
+} __attribute__((packed));
+
+void ssc_set_framing(int on);
+int ssc_get_framing(void);
+
+uint32_t ssc_sample_position(void);
+
+/* Called from the DMA interrupt with the samples of every completed buffer
+ * and the sample counter of the first one.  Returns 1 if it consumed the
+ * buffer, which then doesn't go to USB. */
+typedef int (*ssc_sample_hook_t)(const uint32_t *samples, unsigned int num,
+				 uint32_t first);
+
+void ssc_set_sample_hook(ssc_sample_hook_t hook);
+void ssc_report_cmd(uint16_t tag, uint32_t sample);
+
+struct ssc_stats {
+	uint32_t total_xfers;
+	uint32_t total_irqs;
+	uint32_t total_ovrun;
+	uint32_t active;
+	uint32_t hdma_chain_len;
+	uint32_t seq;
+	uint32_t sample_ctr;
+	uint32_t total_dropped;
+};
+
+void ssc_get_stats(struct ssc_stats *st);
+
 #endif
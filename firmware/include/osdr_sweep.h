@@ -0,0 +1,43 @@
+#ifndef _OSDR_SWEEP_H
+#define _OSDR_SWEEP_H
+
+#include <stdint.h>
+
+/* On-device power sweep.
+ *
+ * The tuner is stepped through a range of frequencies from the main loop.
+ * After each step has locked and settled, the mean I^2+Q^2 of a number of
+ * samples is taken right from the SSC buffers.  While a sweep is running
+ * the samples don't go to USB, and the ones still queued for the host are
+ * dropped when it starts. */
+
+#define SWEEP_MAX_STEPS		256
+#define SWEEP_POWER_UNLOCKED	0xffffffff	/* PLL didn't lock */
+
+enum sweep_state {
+	SWEEP_IDLE,
+	SWEEP_LOCK,		/* tuned, waiting for the PLL */
+	SWEEP_MEASURE,		/* waiting for the samples */
+	SWEEP_DONE,		/* results complete */
+};
+
+struct sweep_status {
+	uint32_t state;
+	uint32_t steps;
+	uint32_t done;		/* steps measured */
+	uint32_t unlocked;	/* steps the PLL didn't lock on */
+};
+
+struct e4k_state;
+
+void sweep_init(struct e4k_state *e4k);
+void sweep_configure(uint32_t settle, uint32_t samples);
+int sweep_start(uint32_t start, uint32_t step, unsigned int count);
+void sweep_abort(void);
+void sweep_process(void);
+
+void sweep_get_status(struct sweep_status *st);
+unsigned int sweep_get_power(uint32_t *power, unsigned int first,
+			     unsigned int num);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _OSDR_TWI_H
+#define _OSDR_TWI_H
+
+#include <stdint.h>
+#include <board.h>
+#include <linuxlist.h>
+
+/* Interrupt driven I2C transaction queue on top of the TWI PDC.
+ *
+ * Transfers are executed in the order of submission, one after the other,
+ * without any CPU involvement besides one interrupt per phase.  Completion
+ * callbacks are called from IRQ context. */
+
+enum twi_xfer_dir {
+	TWI_XFER_WRITE,
+	TWI_XFER_READ,
+};
+
+struct twi_batch;
+
+struct twi_xfer {
+	struct llist_head list;
+	uint8_t addr;			/* 7bit slave address */
+	uint8_t dir;			/* enum twi_xfer_dir */
+	uint8_t iaddr;			/* register address */
+	uint8_t iaddr_len;		/* 0 or 1 */
+	uint8_t *data;
+	uint16_t len;
+	volatile int status;		/* -EINPROGRESS until completed */
+	void (*cb)(struct twi_xfer *xfer);
+	void *cb_data;
+	struct twi_batch *batch;
+};
+
+/* a list of transfers which is completed as a whole.  If one of them
+ * fails, the remaining ones are not executed */
+struct twi_batch {
+	volatile unsigned int pending;
+	volatile int status;
+	void (*cb)(struct twi_batch *batch);
+	void *cb_data;
+};
+
+struct osdr_twi;
+
+struct osdr_twi *osdr_twi_init(AT91S_TWI *twi);
+
+int osdr_twi_submit(struct osdr_twi *bus, struct twi_xfer *xfer);
+int osdr_twi_wait(struct twi_xfer *xfer);
+
+int osdr_twi_submit_batch(struct osdr_twi *bus, struct twi_batch *batch,
+			  struct twi_xfer *xfers, unsigned int num);
+int osdr_twi_batch_wait(struct twi_batch *batch);
+
+/* synchronous register access with 1 byte register addresses */
+int osdr_twi_write(struct osdr_twi *bus, uint8_t addr, uint8_t reg,
+		   const uint8_t *data, unsigned int len);
+int osdr_twi_read(struct osdr_twi *bus, uint8_t addr, uint8_t reg,
+		  uint8_t *data, unsigned int len);
+
+#endif
@@ -21,6 +21,7 @@ struct req_ctx {
 	volatile uint32_t state;
 	uint16_t size;
 	uint16_t tot_len;
+	uint16_t hdr_len;
 	DmaLinkList dma_lli;
 	uint8_t *data;
 };
@@ -47,8 +48,20 @@ extern void req_ctx_set_state(struct req_ctx *ctx, unsigned long new_state);
 extern void req_ctx_put(struct req_ctx *ctx);
 extern uint8_t req_ctx_num(struct req_ctx *ctx);
 
+struct req_ctx_stats {
+	uint16_t num;
+	uint16_t num_free;
+	uint16_t low_watermark;	/* lowest num_free since req_ctx_init() */
+	uint32_t alloc_fail;	/* req_ctx_find_get() found nothing */
+};
+
+extern void req_ctx_get_stats(int large, struct req_ctx_stats *st);
+
 void req_ctx_enqueue(struct llist_head *list, struct req_ctx *rctx);
 struct req_ctx *req_ctx_dequeue(struct llist_head *list);
+struct req_ctx *req_ctx_dequeue_contig(struct llist_head *list,
+				       struct req_ctx *prev);
+unsigned int req_ctx_queue_len(struct llist_head *list);
 
 void req_ctx_dump();
 
@@ -184,12 +184,59 @@ struct e4k_pll_params {
 	uint8_t threephase;
 };
 
+#define E4K_NUM_REGS	0x100
+
+/* shadow copy of the register file, see e4k_flush() */
+struct e4k_shadow {
+	uint8_t regs[E4K_NUM_REGS];
+	uint32_t valid[E4K_NUM_REGS/32];
+	uint32_t dirty[E4K_NUM_REGS/32];
+};
+
+struct e4k_i2c_stats {
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t bytes;
+	uint32_t errors;
+};
+
+/* recently used PLL parameters, so hopping between a set of channels
+ * doesn't need any arithmetic */
+#define E4K_PLL_CACHE_SIZE	8
+
+struct e4k_pll_cache_entry {
+	struct e4k_pll_params p;
+	uint32_t last_use;		/* 0 if unused */
+};
+
+/* a tuning step with everything precomputed, see e4k_hop_prepare() */
+struct e4k_hop {
+	struct e4k_pll_params p;
+	uint8_t band;
+	uint8_t rf_filter;
+	int8_t lna_gain;		/* GAIN1 value, negative to keep it */
+};
+
+/* gain argument of e4k_hop_prepare() leaving the LNA gain untouched */
+#define E4K_HOP_GAIN_KEEP	0x7fff
+
 struct e4k_state {
 	void *i2c_dev;
 	uint8_t i2c_addr;
 	enum e4k_band band;
 	struct e4k_pll_params vco;
 	void *rtl_dev;
+	struct e4k_shadow shadow;
+	struct e4k_i2c_stats stats;
+	/* queued register writes which failed, set from IRQ context and
+	 * collected by e4k_flush() and e4k_check_errors() */
+	volatile uint32_t wr_failed[E4K_NUM_REGS/32];
+	volatile int wr_error;
+	int error;			/* collected, not reported yet */
+	struct e4k_pll_cache_entry pll_cache[E4K_PLL_CACHE_SIZE];
+	uint32_t pll_cache_clock;
+	uint32_t pll_cache_hits;
+	uint32_t pll_cache_misses;
 };
 
 int e4k_init(struct e4k_state *e4k);
@@ -199,13 +246,24 @@ int e4k_commonmode_set(struct e4k_state *e4k, int8_t value);
 int e4k_tune_freq(struct e4k_state *e4k, uint32_t freq);
 int e4k_tune_params(struct e4k_state *e4k, struct e4k_pll_params *p);
 uint32_t e4k_compute_pll_params(struct e4k_pll_params *oscp, uint32_t fosc, uint32_t intended_flo);
+int e4k_hop_prepare(struct e4k_state *e4k, struct e4k_hop *hop,
+		    uint32_t freq, int32_t gain);
+int e4k_hop_apply(struct e4k_state *e4k, const struct e4k_hop *hop);
+int e4k_pll_locked(struct e4k_state *e4k);
 int e4k_if_filter_bw_get(struct e4k_state *e4k, enum e4k_if_filter filter);
 int e4k_if_filter_bw_set(struct e4k_state *e4k, enum e4k_if_filter filter, uint32_t bandwidth);
 int e4k_if_filter_chan_enable(struct e4k_state *e4k, int on);
 int e4k_rf_filter_set(struct e4k_state *e4k);
 
 int e4k_reg_write(struct e4k_state *e4k, uint8_t reg, uint8_t val);
-uint8_t e4k_reg_read(struct e4k_state *e4k, uint8_t reg);
+int e4k_reg_write_burst(struct e4k_state *e4k, uint8_t reg,
+			const uint8_t *buf, unsigned int len);
+int e4k_reg_read(struct e4k_state *e4k, uint8_t reg);
+int e4k_reg_write_errors(struct e4k_state *e4k, uint32_t *failed);
+
+int e4k_flush(struct e4k_state *e4k);
+int e4k_check_errors(struct e4k_state *e4k);
+void e4k_cache_invalidate(struct e4k_state *e4k);
 
 int e4k_manual_dc_offset(struct e4k_state *e4k, int8_t iofs, int8_t irange, int8_t qofs, int8_t qrange);
 int e4k_dc_offset_calibrate(struct e4k_state *e4k);
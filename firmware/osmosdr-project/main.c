@@ -35,7 +35,6 @@
 #include <board_memories.h>
 #include <pio/pio.h>
 #include <irq/irq.h>
-#include <twi/twid.h>
 #include <twi/twi.h>
 #include <dbgu/dbgu.h>
 #include <ssc/ssc.h>
@@ -53,7 +52,10 @@
 #include <osdr_fpga.h>
 #include <req_ctx.h>
 #include <uart_cmd.h>
+#include <logging.h>
 #include <fast_source.h>
+#include <osdr_twi.h>
+#include <osdr_sweep.h>
 
 #define SSC_MCK    49152000
 
@@ -87,7 +89,7 @@ unsigned char USBState = STATE_IDLE;
 static const Pin pins[] = {PINS_TWI0, PIN_PCK0, PINS_LEDS, PINS_SPI0,
 			   PINS_MISC, PINS_SSC, PINS_FPGA_JTAG};
 
-static Twid twid;
+static struct osdr_twi *twi;
 struct e4k_state e4k;
 struct si570_ctx si570;
 
@@ -184,6 +186,16 @@ void USBDCallbacks_Suspended(void)
 
 static struct cmd_state cmd_state;
 
+/* cycles spent in the last tuning, see DWT_CYCCNT */
+static uint32_t tune_cycles;
+
+static void cyccnt_init(void)
+{
+	DEMCR |= DEMCR_TRCENA;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= 1;
+}
+
 static int cmd_tuner_init(struct cmd_state *cs, enum cmd_op op,
 			  const char *cmd, int argc, char **argv)
 {
@@ -212,7 +224,9 @@ static int cmd_rf_freq(struct cmd_state *cs, enum cmd_op op,
 		if (argc < 1)
 			return -EINVAL;
 		freq = strtoul(argv[0], NULL, 10);
+		tune_cycles = DWT_CYCCNT;
 		e4k_tune_freq(&e4k, freq);
+		tune_cycles = DWT_CYCCNT - tune_cycles;
 		break;
 	case CMD_OP_GET:
 		freq = e4k.vco.flo;
@@ -335,6 +349,18 @@ static int cmd_tuner_iqofs(struct cmd_state *cs, enum cmd_op op,
 	return e4k_manual_dc_offset(&e4k, iofs, irange, qofs, qrange);
 }
 
+static int cmd_tuner_stats(struct cmd_state *cs, enum cmd_op op,
+			   const char *cmd, int argc, char ** argv)
+{
+	uart_cmd_out(cs, "I2C reads=%u, writes=%u, bytes=%u, errors=%u\n\r",
+		     e4k.stats.reads, e4k.stats.writes, e4k.stats.bytes,
+		     e4k.stats.errors);
+	uart_cmd_out(cs, "PLL cache hits=%u, misses=%u\n\r",
+		     e4k.pll_cache_hits, e4k.pll_cache_misses);
+	uart_cmd_out(cs, "last tune took %u cycles\n\r", tune_cycles);
+	return 0;
+}
+
 static int cmd_tuner_dump(struct cmd_state *cs, enum cmd_op op,
 	const char *cmd, int argc, char ** argv)
 {
@@ -353,6 +379,8 @@ static struct cmd cmds[] = {
 	  "Initialize the tuner" },
 	{ "tuner.dump", CMD_OP_EXEC, cmd_tuner_dump,
 	  "Dump E4k registers" },
+	{ "tuner.stats", CMD_OP_EXEC, cmd_tuner_stats,
+	  "Tuner I2C statistics" },
 	{ "tuner.freq", CMD_OP_SET|CMD_OP_GET, cmd_rf_freq,
 	  "Tune to the specified frequency" },
 	{ "tuner.gain", CMD_OP_SET, cmd_tuner_gain,
@@ -422,27 +450,31 @@ int main(void)
     // Configure and enable the TWI (required for accessing the DAC)
     *AT91C_PMC_PCER = (1<< AT91C_ID_TWI0); 
     TWI_ConfigureMaster(AT91C_BASE_TWI0, TWI_CLOCK, SSC_MCK);
-    TWID_Initialize(&twid, AT91C_BASE_TWI0);
 
     printf("-- OsmoSDR firmware (" BOARD_NAME ") " GIT_REVISION " --\n\r");
     printf("-- Compiled: %s %s --\n\r", __DATE__, __TIME__);
 
 	req_ctx_init();
 	PIO_InitializeInterrupts(0);
+	cyccnt_init();
 
 	cmd_state.out = vprintf;
 	uart_cmd_reset(&cmd_state);
 	uart_cmds_register(cmds, sizeof(cmds)/sizeof(cmds[0]));
+	log_init();
+
+	/* needs the IRQ controller and the command parser */
+	twi = osdr_twi_init(AT91C_BASE_TWI0);
 
 	fastsource_init();
 	VBus_Configure();
 
 	power_peripherals(1);
 
-	si570_init(&si570, &twid, SI570_I2C_ADDR);
+	si570_init(&si570, twi, SI570_I2C_ADDR);
 	set_si570_freq(30000000);
 
-	sam3u_e4k_init(&e4k, &twid, E4K_I2C_ADDR);
+	sam3u_e4k_init(&e4k, twi, E4K_I2C_ADDR);
 	e4k.vco.fosc = 30000000;
 
 	osdr_fpga_init(SSC_MCK);
@@ -453,6 +485,7 @@ int main(void)
 	ssc_init();
 	e4k_init(&e4k);
 	e4k_init(&e4k);
+	sweep_init(&e4k);
 
     // Enter menu loop
     while (1) {
@@ -464,7 +497,12 @@ int main(void)
         		//ssc_stats();
         	}
     	}
+    	fastsource_process_cmds();
+    	sweep_process();
     	ssc_dma_start();
     	fastsource_start();
+    	/* a line takes milliseconds, commands go first */
+    	if (fastsource_cmds_idle())
+    		log_drain();
     }
 }
@@ -22,6 +22,7 @@
 #include <errno.h>
 
 #include <board.h>
+#include <irq/irq.h>
 #include <utility/trace.h>
 #include <utility/led.h>
 
@@ -34,6 +35,8 @@
 #include <usb/common/audio/AUDFeatureUnitRequest.h>
 #include <usb/common/audio/AUDFeatureUnitDescriptor.h>
 #include <common.h>
+#include <uart_cmd.h>
+#include <logging.h>
 
 #include <fast_source_descr.h>
 #include <fast_source.h>
@@ -41,6 +44,8 @@
 #include <tuner_e4k.h>
 #include <si570.h>
 #include <osdr_fpga.h>
+#include <osdr_ssc.h>
+#include <osdr_sweep.h>
 
 #define OSMOSDR_CTRL_WRITE 0x07
 #define OSMOSDR_CTRL_READ 0x87
@@ -61,9 +66,19 @@ struct rctx_stats {
 	uint32_t delta_other;
 };
 
+/* Filled buffers are sent in runs of up to usb_state.coalesce adjacent
+ * rctx, one USBD_Write() per run.  The rctx buffers are one array and the
+ * pool hands them out in order, so most of them follow each other. */
+#define USB_COALESCE_DEFAULT	8
+#define USB_COALESCE_MAX	16
+
 struct usb_state {
 	struct llist_head queue;
+	struct llist_head inflight;	/* rctx of the running USBD_Write() */
 	int active;
+	unsigned int coalesce;
+	uint32_t total_writes;
+	uint32_t total_rctx;
 	uint8_t muted;
 #ifdef FPGA_TEST_STATS
 	struct rctx_stats stats;
@@ -93,18 +108,6 @@ static void fastsource_set_feat_cur_val(uint8_t entity, uint8_t channel,
 		USBD_Stall(0);
 }
 
-static void handle_osmosdr_read(const USBGenericRequest* request)
-{
-	int len = USBGenericRequest_GetLength(request);
-	printf("OsmoSDR GET request: type:%d, request:%d, value:%d, index: %d, length: %d\n\r",
-		USBGenericRequest_GetType(request),
-		USBGenericRequest_GetRequest(request),
-		USBGenericRequest_GetValue(request),
-		USBGenericRequest_GetIndex(request),
-		len);
-	USBD_Stall(0);
-}
-
 static uint32_t read_bytewise32(const uint8_t* data)
 {
 	return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
@@ -115,6 +118,14 @@ static uint16_t read_bytewise16(const uint8_t* data)
 	return (data[0] << 8) | data[1];
 }
 
+static void write_bytewise32(uint8_t* data, uint32_t val)
+{
+	data[0] = val >> 24;
+	data[1] = val >> 16;
+	data[2] = val >> 8;
+	data[3] = val;
+}
+
 typedef struct Request_ {
 	uint16_t func;
 	uint16_t len;
@@ -127,11 +138,17 @@ typedef struct Request_ {
 #define GROUP_VCXO_SI570 0x02
 #define GROUP_TUNER_E4K 0x03
 
+#define SWEEP_READ_LEN	256	/* 64 steps per read */
+
 const static Request g_writeRequests[] = {
 	// general api
 	{ FUNC(GROUP_GENERAL, 0x00), 0 }, // init whatever
 	{ FUNC(GROUP_GENERAL, 0x01), 0 }, // power down
 	{ FUNC(GROUP_GENERAL, 0x02), 0 }, // power up
+	{ FUNC(GROUP_GENERAL, 0x03), 1 }, // ssc_set_framing(uint8_t on)
+	{ FUNC(GROUP_GENERAL, 0x04), 16 }, // timed_cmd_add(uint32_t at, uint16_t tag, uint16_t func, uint8_t data[8])
+	{ FUNC(GROUP_GENERAL, 0x05), 8 }, // sweep_configure(uint32_t settle, uint32_t samples)
+	{ FUNC(GROUP_GENERAL, 0x06), 10 }, // sweep_start(uint32_t start, uint32_t step, uint16_t count)
 
 	// fpga commands
 	{ FUNC(GROUP_FPGA_V2, 0x00), 0 }, // fpga init
@@ -161,153 +178,575 @@ const static Request g_writeRequests[] = {
 	{ FUNC(GROUP_TUNER_E4K, 0x0b), 4 }, // e4k_set_lna_gain(int32_t gain)
 	{ FUNC(GROUP_TUNER_E4K, 0x0c), 1 }, // e4k_enable_manual_gain(uint8_t manual)
 	{ FUNC(GROUP_TUNER_E4K, 0x0d), 4 }, // e4k_set_enh_gain(int32_t gain)
+	// FUNC(GROUP_TUNER_E4K, 0x10) is the hop table, see handle_osmosdr_write()
+	{ FUNC(GROUP_TUNER_E4K, 0x11), 2 }, // hop_to(uint16_t index)
+	{ FUNC(GROUP_TUNER_E4K, 0x12), 4 }, // hop_set_dwell(uint32_t samples)
+};
+
+// the register number of register reads is passed in wIndex
+const static Request g_readRequests[] = {
+	// general api
+	{ FUNC(GROUP_GENERAL, 0x00), 56 }, // device statistics
+	{ FUNC(GROUP_GENERAL, 0x01), 24 }, // control write completion status
+	{ FUNC(GROUP_GENERAL, 0x02), 16 }, // sweep status
+	{ FUNC(GROUP_GENERAL, 0x03), SWEEP_READ_LEN }, // sweep results, first step in wIndex
+
+	// fpga commands
+	{ FUNC(GROUP_FPGA_V2, 0x01), 4 }, // osdr_fpga_reg_read(uint8_t reg)
+
+	// e4000 tuner commands
+	{ FUNC(GROUP_TUNER_E4K, 0x01), 1 }, // e4k_reg_read(uint8_t reg)
+	{ FUNC(GROUP_TUNER_E4K, 0x10), 12 }, // hop status
 };
 
+static uint8_t g_readData[56];
+static uint8_t g_sweepData[SWEEP_READ_LEN];
+
 typedef struct WriteState_ {
 	uint8_t data[16];
 	uint16_t func;
 } WriteState;
 
 static WriteState g_writeState;
+static uint8_t g_pllLocked;
 extern struct e4k_state e4k;
 extern struct si570_ctx si570;
 
-static void finalize_write(void *pArg, unsigned char status, unsigned int transferred, unsigned int remaining)
+/* Control writes are acknowledged right away and executed from the main
+ * loop: tuning takes several I2C transactions and must not hold off the
+ * USB and SSC DMA interrupts for milliseconds.  The host polls the
+ * counters below to learn when (and how) they completed. */
+#define CMD_QUEUE_LEN	8
+
+struct cmd_queue {
+	WriteState cmds[CMD_QUEUE_LEN];
+	volatile uint32_t submitted;	/* by the USB interrupt */
+	volatile uint32_t completed;	/* by the main loop */
+	uint32_t errors;
+	uint16_t last_err_func;
+	int32_t last_err_res;
+	uint32_t last_err_seq;		/* its position in the submission order */
+};
+
+static struct cmd_queue g_cmdQueue;
+
+/* Tuner register reads go through the interrupt driven I2C queue, behind
+ * any pending register writes, and FPGA register reads would race the SPI
+ * writes of queued and timed commands, so neither can be done from the
+ * request handler.  The main loop does the read once the queued commands
+ * are through and sends the data stage, EP0 NAKs the host until then.  A
+ * new request cancels a read that hasn't been answered yet. */
+struct deferred_read {
+	volatile uint8_t pending;
+	volatile uint8_t seq;
+	uint16_t func;
+	uint16_t index;
+	uint16_t len;
+};
+
+static struct deferred_read g_deferredRead;
+
+static int cmd_queue_full(void)
+{
+	return g_cmdQueue.submitted - g_cmdQueue.completed >= CMD_QUEUE_LEN;
+}
+
+/* register reads would race with the main loop on SPI/I2C otherwise */
+static int cmd_queue_idle(void)
+{
+	return g_cmdQueue.submitted == g_cmdQueue.completed;
+}
+
+/* Frequency hop table.  The host uploads all entries in one request, the
+ * PLL parameters, band and RF filter of each entry are computed right
+ * then, so a hop only costs the tuner register writes.  Hops are either
+ * requested by the host or triggered by the dwell timer, which counts
+ * samples (in units of whole buffers). */
+#define HOP_TABLE_LEN	64
+#define HOP_ENTRY_LEN	8	/* u32 freq, s16 LNA gain, u16 reserved */
+#define HOP_NEXT	0xffff
+#define HOP_NONE	0xffff
+
+struct hop_entry {
+	struct e4k_hop hop;
+	int16_t gain;			/* as uploaded, to redo the prepare */
+};
+
+struct hop_table {
+	struct hop_entry entries[HOP_TABLE_LEN];
+	uint16_t num;
+	uint16_t cur;			/* last programmed entry */
+	uint16_t next;
+	uint32_t dwell;			/* samples per hop, 0 if host driven */
+	uint32_t last_hop;		/* sample counter at the last hop */
+	uint32_t total_hops;
+	/* the upload is received here and loaded by the main loop */
+	uint8_t upload[HOP_TABLE_LEN * HOP_ENTRY_LEN];
+	uint16_t upload_len;
+	volatile uint8_t upload_busy;
+};
+
+static struct hop_table g_hopTable = {
+	.cur = HOP_NONE,
+};
+
+static uint32_t hop_sample_ctr(void)
+{
+	struct ssc_stats st;
+
+	ssc_get_stats(&st);
+	return st.sample_ctr;
+}
+
+static int hop_table_load(void)
+{
+	struct hop_table *ht = &g_hopTable;
+	unsigned int i, num = ht->upload_len / HOP_ENTRY_LEN;
+	int res = 0;
+
+	/* a table with a bad entry is dropped as a whole */
+	ht->num = 0;
+	ht->cur = HOP_NONE;
+	ht->next = 0;
+
+	for (i = 0; i < num; i++) {
+		struct hop_entry *ent = &ht->entries[i];
+		const uint8_t *data = ht->upload + i * HOP_ENTRY_LEN;
+
+		ent->gain = read_bytewise16(data + 4);
+		res = e4k_hop_prepare(&e4k, &ent->hop, read_bytewise32(data),
+				      ent->gain);
+		if (res < 0)
+			break;
+	}
+
+	ht->upload_busy = 0;
+
+	if (res < 0)
+		return res;
+
+	ht->num = num;
+	return 0;
+}
+
+static int hop_to(uint16_t index)
+{
+	struct hop_table *ht = &g_hopTable;
+	struct hop_entry *ent;
+	int res;
+
+	if (index == HOP_NEXT)
+		index = ht->next;
+	if (index >= ht->num)
+		return -EINVAL;
+
+	ent = &ht->entries[index];
+
+	/* the reference clock has been reprogrammed since the upload */
+	if (ent->hop.p.fosc != e4k.vco.fosc) {
+		res = e4k_hop_prepare(&e4k, &ent->hop,
+				      ent->hop.p.intended_flo, ent->gain);
+		if (res < 0)
+			return res;
+	}
+
+	res = e4k_hop_apply(&e4k, &ent->hop);
+
+	ht->cur = index;
+	ht->next = (index + 1) % ht->num;
+	ht->last_hop = hop_sample_ctr();
+	ht->total_hops++;
+
+	return res;
+}
+
+static void hop_set_dwell(uint32_t samples)
 {
+	g_hopTable.dwell = samples;
+	g_hopTable.last_hop = hop_sample_ctr();
+}
+
+/* advance the hop table once the dwell time is over */
+static void hop_process(void)
+{
+	struct hop_table *ht = &g_hopTable;
 	int res;
 
-	if((status != 0) ||(remaining != 0)) {
+	if (!ht->dwell || !ht->num || !ssc_active())
+		return;
+
+	if (hop_sample_ctr() - ht->last_hop < ht->dwell)
+		return;
+
+	/* nobody waits for the writes of a timed hop, report the errors of
+	 * the previous ones once instead of failing every hop after them */
+	res = e4k_check_errors(&e4k);
+	if (res < 0)
+		LOGP(DTUN, LOGL_ERROR, "Hop before %u failed: %d\n", ht->cur, res);
+
+	res = hop_to(HOP_NEXT);
+	if (res < 0)
+		LOGP(DTUN, LOGL_ERROR, "Hop to %u failed: %d\n", ht->next, res);
+}
+
+static void handle_osmosdr_read(const USBGenericRequest* request)
+{
+	uint16_t func = USBGenericRequest_GetValue(request);
+	uint16_t index = USBGenericRequest_GetIndex(request);
+	int len = USBGenericRequest_GetLength(request);
+	struct ssc_stats st;
+	struct req_ctx_stats small, large;
+	struct sweep_status sw;
+	uint32_t power[SWEEP_READ_LEN / 4];
+	const uint8_t *out = g_readData;
+	int i, n, res;
+
+	for(i = 0; i < ARRAY_SIZE(g_readRequests); i++) {
+		if(g_readRequests[i].func == func)
+			break;
+	}
+	if(i == ARRAY_SIZE(g_readRequests)) {
+		USBD_Stall(0);
+		return;
+	}
+	// shorter reads get the leading part, for older hosts
+	if(len > g_readRequests[i].len) {
 		USBD_Stall(0);
 		return;
 	}
 
-	printf("Func: %04x ...", g_writeState.func);
+	switch(func) {
+		// general api
+		case FUNC(GROUP_GENERAL, 0x00): // device statistics
+			ssc_get_stats(&st);
+			req_ctx_get_stats(0, &small);
+			req_ctx_get_stats(1, &large);
+			write_bytewise32(g_readData + 0, st.total_xfers);
+			write_bytewise32(g_readData + 4, st.total_irqs);
+			write_bytewise32(g_readData + 8, st.total_ovrun);
+			write_bytewise32(g_readData + 12, st.active);
+			write_bytewise32(g_readData + 16, st.hdma_chain_len);
+			write_bytewise32(g_readData + 20, req_ctx_queue_len(&usb_state.queue));
+			write_bytewise32(g_readData + 24, small.num_free + large.num_free);
+			write_bytewise32(g_readData + 28, small.num + large.num);
+			write_bytewise32(g_readData + 32, st.seq);
+			write_bytewise32(g_readData + 36, st.sample_ctr);
+			write_bytewise32(g_readData + 40, g_pllLocked);
+			write_bytewise32(g_readData + 44,
+				small.low_watermark + large.low_watermark);
+			write_bytewise32(g_readData + 48,
+				small.alloc_fail + large.alloc_fail);
+			write_bytewise32(g_readData + 52, st.total_dropped);
+			res = 0;
+			break;
+		case FUNC(GROUP_GENERAL, 0x01): // control write completion status
+			write_bytewise32(g_readData + 0, g_cmdQueue.submitted);
+			write_bytewise32(g_readData + 4, g_cmdQueue.completed);
+			write_bytewise32(g_readData + 8, g_cmdQueue.errors);
+			write_bytewise32(g_readData + 12, g_cmdQueue.last_err_func);
+			write_bytewise32(g_readData + 16, g_cmdQueue.last_err_res);
+			write_bytewise32(g_readData + 20, g_cmdQueue.last_err_seq);
+			res = 0;
+			break;
+		case FUNC(GROUP_GENERAL, 0x02): // sweep status
+			sweep_get_status(&sw);
+			write_bytewise32(g_readData + 0, sw.state);
+			write_bytewise32(g_readData + 4, sw.steps);
+			write_bytewise32(g_readData + 8, sw.done);
+			write_bytewise32(g_readData + 12, sw.unlocked);
+			res = 0;
+			break;
+		case FUNC(GROUP_GENERAL, 0x03): // sweep results
+			n = sweep_get_power(power, index, len / 4);
+			for (i = 0; i < n; i++)
+				write_bytewise32(g_sweepData + i * 4, power[i]);
+			/* only what has been measured so far */
+			len = n * 4;
+			out = g_sweepData;
+			res = 0;
+			break;
+
+		// fpga commands
+		case FUNC(GROUP_FPGA_V2, 0x01):
+		// e4000 tuner commands
+		case FUNC(GROUP_TUNER_E4K, 0x01):
+			g_deferredRead.func = func;
+			g_deferredRead.index = index;
+			g_deferredRead.len = len;
+			g_deferredRead.pending = 1;
+			return;
+		case FUNC(GROUP_TUNER_E4K, 0x10): // hop status
+			write_bytewise32(g_readData + 0, g_hopTable.cur);
+			write_bytewise32(g_readData + 4, g_hopTable.num);
+			write_bytewise32(g_readData + 8, g_hopTable.total_hops);
+			res = 0;
+			break;
 
-	switch(g_writeState.func) {
+		default:
+			res = -1;
+			break;
+	}
+
+	if(res == 0)
+		USBD_Write(0, out, len, 0, 0);
+	else USBD_Stall(0);
+}
+
+/* Timed commands: control writes wrapped with the sample counter value at
+ * which they are to be executed.  They wait here until the stream gets
+ * there, the sample counter at their completion is reported in the frame
+ * headers, so the host knows exactly which samples were affected. */
+#define TIMED_CMD_LEN	8
+#define TIMED_DATA_LEN	8
+
+struct timed_cmd {
+	WriteState ws;
+	uint32_t seq;	/* of the request that added it */
+	uint32_t at;
+	uint16_t tag;
+	uint8_t used;
+};
+
+static struct timed_cmd g_timedCmds[TIMED_CMD_LEN];
+
+static int execute_write(const WriteState *ws);
+
+/* seq tells the host which of its writes failed */
+static void cmd_account(const WriteState *ws, uint32_t seq, int res)
+{
+	if (res != 0) {
+		g_cmdQueue.errors++;
+		g_cmdQueue.last_err_func = ws->func;
+		g_cmdQueue.last_err_res = res;
+		g_cmdQueue.last_err_seq = seq;
+	}
+}
+
+static int timed_cmd_add(const uint8_t *data)
+{
+	uint16_t func = read_bytewise16(data + 6);
+	struct timed_cmd *tc = NULL;
+	int i;
+
+	for(i = 0; i < ARRAY_SIZE(g_writeRequests); i++) {
+		if(g_writeRequests[i].func == func)
+			break;
+	}
+	/* no nesting, and the arguments have to fit */
+	if(i == ARRAY_SIZE(g_writeRequests) ||
+	   func == FUNC(GROUP_GENERAL, 0x04) ||
+	   g_writeRequests[i].len > TIMED_DATA_LEN)
+		return -EINVAL;
+
+	for(i = 0; i < TIMED_CMD_LEN; i++) {
+		if(!g_timedCmds[i].used) {
+			tc = &g_timedCmds[i];
+			break;
+		}
+	}
+	if(!tc)
+		return -ENOSPC;
+
+	/* only added from the queue, see fastsource_process_cmds() */
+	tc->seq = g_cmdQueue.completed;
+	tc->at = read_bytewise32(data);
+	tc->tag = read_bytewise16(data + 4);
+	tc->ws.func = func;
+	memcpy(tc->ws.data, data + 8, TIMED_DATA_LEN);
+	tc->used = 1;
+
+	return 0;
+}
+
+/* execute the timed commands that are due, earliest first */
+static void timed_cmd_process(void)
+{
+	struct timed_cmd *tc, *due;
+	uint32_t pos;
+	int i;
+
+	for (;;) {
+		pos = ssc_sample_position();
+		due = NULL;
+
+		for (i = 0; i < TIMED_CMD_LEN; i++) {
+			tc = &g_timedCmds[i];
+			if (!tc->used || (int32_t)(pos - tc->at) < 0)
+				continue;
+			if (!due || (int32_t)(tc->at - due->at) < 0)
+				due = tc;
+		}
+		if (!due)
+			break;
+
+		cmd_account(&due->ws, due->seq, execute_write(&due->ws));
+		ssc_report_cmd(due->tag, ssc_sample_position());
+		due->used = 0;
+	}
+}
+
+static int execute_write(const WriteState *ws)
+{
+	const char *name = "unknown";
+	int res, rc;
+
+	switch(ws->func) {
 		// general api
 		case FUNC(GROUP_GENERAL, 0x00): // init all
-			printf("general_init()");
+			name = "general_init()";
 			res = 0; // no op so far
 			break;
 		case FUNC(GROUP_GENERAL, 0x01): // power down
-			printf("general_power_down()");
+			name = "general_power_down()";
 			osdr_fpga_power(0);
 			sam3u_e4k_stby(&e4k, 1);
 			sam3u_e4k_power(&e4k, 0);
 			res = 0;
 			break;
 		case FUNC(GROUP_GENERAL, 0x02): // power up
-			printf("general_power_up()");
+			name = "general_power_up()";
 			osdr_fpga_power(1);
 			sam3u_e4k_power(&e4k, 1);
 			sam3u_e4k_stby(&e4k, 0);
 			res = 0;
 			break;
+		case FUNC(GROUP_GENERAL, 0x03):
+			name = "ssc_set_framing()";
+			ssc_set_framing(ws->data[0]);
+			res = 0;
+			break;
+		case FUNC(GROUP_GENERAL, 0x04):
+			name = "timed_cmd_add()";
+			res = timed_cmd_add(ws->data);
+			break;
+		case FUNC(GROUP_GENERAL, 0x05):
+			name = "sweep_configure()";
+			sweep_configure(read_bytewise32(ws->data), read_bytewise32(ws->data + 4));
+			res = 0;
+			break;
+		case FUNC(GROUP_GENERAL, 0x06):
+			name = "sweep_start()";
+			res = sweep_start(read_bytewise32(ws->data), read_bytewise32(ws->data + 4),
+					  read_bytewise16(ws->data + 8));
+			break;
 
 		// fpga commands
 		case FUNC(GROUP_FPGA_V2, 0x00): // fpga init
-			printf("fpga_v2_init()");
+			name = "fpga_v2_init()";
 			res = 0; // no op so far
 			break;
 		case FUNC(GROUP_FPGA_V2, 0x01):
-			printf("fpga_v2_reg_write()");
-			osdr_fpga_reg_write(g_writeState.data[0], read_bytewise32(g_writeState.data + 1));
+			name = "fpga_v2_reg_write()";
+			osdr_fpga_reg_write(ws->data[0], read_bytewise32(ws->data + 1));
 			res = 0;
 			break;
 		case FUNC(GROUP_FPGA_V2, 0x02):
-			printf("osdr_fpga_set_decimation()");
-			osdr_fpga_set_decimation(g_writeState.data[0]);
+			name = "osdr_fpga_set_decimation()";
+			osdr_fpga_set_decimation(ws->data[0]);
 			res = 0;
 			break;
 		case FUNC(GROUP_FPGA_V2, 0x03):
-			printf("osdr_fpga_set_iq_swap()");
-			osdr_fpga_set_iq_swap(g_writeState.data[0]);
+			name = "osdr_fpga_set_iq_swap()";
+			osdr_fpga_set_iq_swap(ws->data[0]);
 			res = 0;
 			break;
 		case FUNC(GROUP_FPGA_V2, 0x04):
-			printf("osdr_fpga_set_iq_gain()");
-			osdr_fpga_set_iq_gain(read_bytewise16(g_writeState.data), read_bytewise16(g_writeState.data + 2));
+			name = "osdr_fpga_set_iq_gain()";
+			osdr_fpga_set_iq_gain(read_bytewise16(ws->data), read_bytewise16(ws->data + 2));
 			res = 0;
 			break;
 		case FUNC(GROUP_FPGA_V2, 0x05):
-			printf("osdr_fpga_set_iq_ofs()");
-			osdr_fpga_set_iq_ofs(read_bytewise16(g_writeState.data), read_bytewise16(g_writeState.data + 2));
+			name = "osdr_fpga_set_iq_ofs()";
+			osdr_fpga_set_iq_ofs(read_bytewise16(ws->data), read_bytewise16(ws->data + 2));
 			res = 0;
 			break;
 
 		// si570 vcxo commands
 		case FUNC(GROUP_VCXO_SI570, 0x00): // si570_init()
-			printf("si570_init()");
+			name = "si570_init()";
 			res = si570_reinit(&si570);
 			break;
 		case FUNC(GROUP_VCXO_SI570, 0x01):
-			printf("si570_reg_write()");
-			res = si570_reg_write(&si570, g_writeState.data[0], g_writeState.data[1], g_writeState.data + 2);
+			name = "si570_reg_write()";
+			res = si570_reg_write(&si570, ws->data[0], ws->data[1], ws->data + 2);
 			break;
 		case FUNC(GROUP_VCXO_SI570, 0x02):
-			printf("si570_set_freq()");
-			res = si570_set_freq(&si570, read_bytewise32(g_writeState.data), read_bytewise32(g_writeState.data + 4));
+			name = "si570_set_freq()";
+			res = si570_set_freq(&si570, read_bytewise32(ws->data), read_bytewise32(ws->data + 4));
 			break;
 
 		// e4000 tuner commands
 		case FUNC(GROUP_TUNER_E4K, 0x00):
-			printf("e4k_init()");
+			name = "e4k_init()";
 			res = e4k_init(&e4k);
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x01): // reg write
-			printf("e4k_reg_write()");
+			name = "e4k_reg_write()";
 			res = -1;
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x02):
-			printf("e4k_if_gain_set()");
-			res = e4k_if_gain_set(&e4k, g_writeState.data[0], read_bytewise32(g_writeState.data + 1));
+			name = "e4k_if_gain_set()";
+			res = e4k_if_gain_set(&e4k, ws->data[0], read_bytewise32(ws->data + 1));
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x03):
-			printf("e4k_mixer_gain_set()");
-			res = e4k_mixer_gain_set(&e4k, g_writeState.data[0]);
+			name = "e4k_mixer_gain_set()";
+			res = e4k_mixer_gain_set(&e4k, ws->data[0]);
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x04):
-			printf("e4K_commonmode_set()");
-			res = e4k_commonmode_set(&e4k, g_writeState.data[0]);
+			name = "e4K_commonmode_set()";
+			res = e4k_commonmode_set(&e4k, ws->data[0]);
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x05):
-			printf("e4k_tune_freq()");
-			res = e4k_tune_freq(&e4k, read_bytewise32(g_writeState.data));
+			name = "e4k_tune_freq()";
+			res = e4k_tune_freq(&e4k, read_bytewise32(ws->data));
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x06):
-			printf("e4k_if_filter_bw_set()");
-			res = e4k_if_filter_bw_set(&e4k, g_writeState.data[0], read_bytewise32(g_writeState.data + 1));
+			name = "e4k_if_filter_bw_set()";
+			res = e4k_if_filter_bw_set(&e4k, ws->data[0], read_bytewise32(ws->data + 1));
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x07):
-			printf("e4k_if_filter_chan_enable()");
-			res = e4k_if_filter_chan_enable(&e4k, g_writeState.data[0]);
+			name = "e4k_if_filter_chan_enable()";
+			res = e4k_if_filter_chan_enable(&e4k, ws->data[0]);
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x08):
-			printf("e4k_manual_dc_offset()");
-			res = e4k_manual_dc_offset(&e4k, g_writeState.data[0], g_writeState.data[1], g_writeState.data[2], g_writeState.data[3]);
+			name = "e4k_manual_dc_offset()";
+			res = e4k_manual_dc_offset(&e4k, ws->data[0], ws->data[1], ws->data[2], ws->data[3]);
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x09):
-			printf("e4k_dc_offset_calibrate()");
+			name = "e4k_dc_offset_calibrate()";
 			res = e4k_dc_offset_calibrate(&e4k);
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x0a):
-			printf("e4k_dc_offset_gen_table()");
+			name = "e4k_dc_offset_gen_table()";
 			res = e4k_dc_offset_gen_table(&e4k);
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x0b):
-			printf("e4k_set_lna_gain()");
-			res = e4k_set_lna_gain(&e4k, read_bytewise32(g_writeState.data));
+			name = "e4k_set_lna_gain()";
+			res = e4k_set_lna_gain(&e4k, read_bytewise32(ws->data));
 			if(res == -EINVAL)
 				res = -1;
 			else res = 0;
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x0c):
-			printf("e4k_enable_manual_gain()");
-			res = e4k_enable_manual_gain(&e4k, g_writeState.data[0]);
+			name = "e4k_enable_manual_gain()";
+			res = e4k_enable_manual_gain(&e4k, ws->data[0]);
 			break;
 		case FUNC(GROUP_TUNER_E4K, 0x0d):
-			printf("e4k_set_enh_gain()");
-			res = e4k_set_enh_gain(&e4k, read_bytewise32(g_writeState.data));
+			name = "e4k_set_enh_gain()";
+			res = e4k_set_enh_gain(&e4k, read_bytewise32(ws->data));
+			break;
+		case FUNC(GROUP_TUNER_E4K, 0x10):
+			name = "hop_table_load()";
+			res = hop_table_load();
+			break;
+		case FUNC(GROUP_TUNER_E4K, 0x11):
+			name = "hop_to()";
+			res = hop_to(read_bytewise16(ws->data));
+			break;
+		case FUNC(GROUP_TUNER_E4K, 0x12):
+			name = "hop_set_dwell()";
+			hop_set_dwell(read_bytewise32(ws->data));
+			res = 0;
 			break;
 
 		default:
@@ -315,11 +754,131 @@ static void finalize_write(void *pArg, unsigned char status, unsigned int transf
 			break;
 	}
 
-	printf(" res: %d\n\r", res);
+	/* keep the lock state for the statistics, reading it from the
+	 * request handler would mean I2C traffic in interrupt context.  The
+	 * read waits for the queued register writes, so whether they made it
+	 * is known afterwards */
+	if ((ws->func >> 8) == GROUP_TUNER_E4K) {
+		g_pllLocked = e4k_pll_locked(&e4k) > 0;
+		rc = e4k_check_errors(&e4k);
+		if (res == 0)
+			res = rc;
+	}
 
-	if(res == 0)
-		USBD_Write(0, 0, 0, 0, 0);
-	else USBD_Stall(0);
+	LOGP(DUSB, LOGL_DEBUG, "Func: %04x %s res: %d\n", ws->func, name, res);
+
+	return res;
+}
+
+static void finalize_write(void *pArg, unsigned char status, unsigned int transferred, unsigned int remaining)
+{
+	if((status != 0) ||(remaining != 0) || cmd_queue_full()) {
+		USBD_Stall(0);
+		return;
+	}
+
+	memcpy(&g_cmdQueue.cmds[g_cmdQueue.submitted % CMD_QUEUE_LEN],
+	       &g_writeState, sizeof(g_writeState));
+	g_cmdQueue.submitted++;
+
+	USBD_Write(0, 0, 0, 0, 0);
+}
+
+/* answer a deferred register read, see struct deferred_read */
+static void deferred_read_process(void)
+{
+	uint8_t seq;
+	int val;
+
+	if (!g_deferredRead.pending)
+		return;
+
+	seq = g_deferredRead.seq;
+	if (g_deferredRead.func == FUNC(GROUP_FPGA_V2, 0x01)) {
+		write_bytewise32(g_readData, osdr_fpga_reg_read(g_deferredRead.index));
+		val = 0;
+	} else {
+		val = e4k_reg_read(&e4k, g_deferredRead.index);
+		g_readData[0] = val;
+	}
+
+	IRQ_DisableIT(AT91C_ID_UDPHS);
+	/* the host may have given up and sent another request meanwhile */
+	if (g_deferredRead.pending && g_deferredRead.seq == seq) {
+		g_deferredRead.pending = 0;
+		if (val < 0)
+			USBD_Stall(0);
+		else
+			USBD_Write(0, g_readData, g_deferredRead.len, 0, 0);
+	}
+	IRQ_EnableIT(AT91C_ID_UDPHS);
+}
+
+/* user API: whether no control write or register read is waiting.  Only
+ * then the main loop prints the log, a line busy-waits on the UART for
+ * milliseconds */
+int fastsource_cmds_idle(void)
+{
+	int i;
+
+	if (!cmd_queue_idle() || g_deferredRead.pending)
+		return 0;
+
+	for (i = 0; i < TIMED_CMD_LEN; i++) {
+		if (g_timedCmds[i].used)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* user API: execute the queued control writes, called from the main loop */
+void fastsource_process_cmds(void)
+{
+	const WriteState *ws;
+
+	while (g_cmdQueue.completed != g_cmdQueue.submitted) {
+		ws = &g_cmdQueue.cmds[g_cmdQueue.completed % CMD_QUEUE_LEN];
+
+		cmd_account(ws, g_cmdQueue.completed, execute_write(ws));
+		g_cmdQueue.completed++;
+	}
+
+	/* reads see the result of all writes submitted before them */
+	deferred_read_process();
+
+	timed_cmd_process();
+	hop_process();
+}
+
+static void finalize_hop_table(void *pArg, unsigned char status, unsigned int transferred, unsigned int remaining)
+{
+	if((status != 0) || (remaining != 0)) {
+		g_hopTable.upload_busy = 0;
+		USBD_Stall(0);
+		return;
+	}
+
+	finalize_write(pArg, status, transferred, remaining);
+}
+
+/* the hop table doesn't fit into a WriteState, it is received into its
+ * own buffer which stays busy until the main loop has loaded it */
+static void handle_hop_table_write(uint16_t func, int len)
+{
+	if(len > (int)sizeof(g_hopTable.upload) || (len % HOP_ENTRY_LEN) ||
+	   g_hopTable.upload_busy || cmd_queue_full()) {
+		USBD_Stall(0);
+		return;
+	}
+
+	g_hopTable.upload_busy = 1;
+	g_hopTable.upload_len = len;
+	g_writeState.func = func;
+
+	if(len > 0)
+		USBD_Read(0, g_hopTable.upload, len, finalize_hop_table, 0);
+	else finalize_write(NULL, 0, 0, 0);
 }
 
 static void handle_osmosdr_write(const USBGenericRequest* request)
@@ -335,6 +894,11 @@ static void handle_osmosdr_write(const USBGenericRequest* request)
 		USBGenericRequest_GetIndex(request),
 		len);
 */
+	if(func == FUNC(GROUP_TUNER_E4K, 0x10)) {
+		handle_hop_table_write(func, len);
+		return;
+	}
+
 	for(i = 0; i < ARRAY_SIZE(g_writeRequests); i++) {
 		if(g_writeRequests[i].func == func)
 			break;
@@ -343,7 +907,7 @@ static void handle_osmosdr_write(const USBGenericRequest* request)
 		USBD_Stall(0);
 		return;
 	}
-	if(len != g_writeRequests[i].len) {
+	if(len != g_writeRequests[i].len || cmd_queue_full()) {
 		USBD_Stall(0);
 		return;
 	}
@@ -369,6 +933,9 @@ void fastsource_req_hdlr(const USBGenericRequest *request)
 		/* continue below */
 		break;
 	case USBGenericRequest_VENDOR:
+		/* a new SETUP ends any control transfer still in progress */
+		g_deferredRead.pending = 0;
+		g_deferredRead.seq++;
 		if(USBGenericRequest_GetRequest(request) == OSMOSDR_CTRL_WRITE)
 			handle_osmosdr_write(request);
 		else if(USBGenericRequest_GetRequest(request) == OSMOSDR_CTRL_READ)
@@ -424,6 +991,62 @@ void fastsource_req_hdlr(const USBGenericRequest *request)
 	}
 }
 
+/* more than half of the pool would starve the SSC DMA */
+static void fastsource_set_coalesce(unsigned int num)
+{
+	struct req_ctx_stats small, large;
+	unsigned int max;
+
+	req_ctx_get_stats(0, &small);
+	req_ctx_get_stats(1, &large);
+	max = (small.num + large.num) / 2;
+	if (max > USB_COALESCE_MAX)
+		max = USB_COALESCE_MAX;
+
+	if (num > max)
+		num = max;
+	if (num < 1)
+		num = 1;
+
+	usb_state.coalesce = num;
+}
+
+/***********************************************************************
+ * command integration
+ ***********************************************************************/
+
+static int cmd_usb_coalesce(struct cmd_state *cs, enum cmd_op op,
+			    const char *cmd, int argc, char **argv)
+{
+	switch (op) {
+	case CMD_OP_SET:
+		if (argc < 1)
+			return -EINVAL;
+		fastsource_set_coalesce(atoi(argv[0]));
+		break;
+	case CMD_OP_GET:
+		uart_cmd_out(cs, "USB coalescing %u buffers per transfer\n\r",
+			     usb_state.coalesce);
+		break;
+	}
+	return 0;
+}
+
+static int cmd_usb_stats(struct cmd_state *cs, enum cmd_op op,
+			 const char *cmd, int argc, char **argv)
+{
+	uart_cmd_out(cs, "USB writes=%u, rctx=%u\n\r",
+		     usb_state.total_writes, usb_state.total_rctx);
+	return 0;
+}
+
+static struct cmd cmds[] = {
+	{ "usb.coalesce", CMD_OP_SET|CMD_OP_GET, cmd_usb_coalesce,
+	  "Number of sample buffers sent in one USB transfer" },
+	{ "usb.stats", CMD_OP_EXEC, cmd_usb_stats,
+	  "Statistics about the USB transfers" },
+};
+
 /* Initialize the driver */
 void fastsource_init(void)
 {
@@ -431,6 +1054,10 @@ void fastsource_init(void)
 	memset(fastsource_interfaces, 0x00, sizeof(fastsource_interfaces));
 
 	INIT_LLIST_HEAD(&usb_state.queue);
+	INIT_LLIST_HEAD(&usb_state.inflight);
+	fastsource_set_coalesce(USB_COALESCE_DEFAULT);
+
+	uart_cmds_register(cmds, ARRAY_SIZE(cmds));
 
 	USBDDriver_Initialize(&fast_source_driver, &auddFastSourceDriverDescriptors,
 				fastsource_interfaces);
@@ -438,31 +1065,47 @@ void fastsource_init(void)
 	USBD_Init();
 }
 
-static int refill_dma(void);
+static int refill_dma(int flush);
+
+static void release_inflight(void)
+{
+	struct req_ctx *rctx;
+
+	while ((rctx = req_ctx_dequeue(&usb_state.inflight)))
+		req_ctx_set_state(rctx, RCTX_STATE_FREE);
+}
 
 /* completion callback: USBD_Write() has completed an IN transfer */
 static void wr_compl_cb(void *arg, unsigned char status, unsigned int transferred,
 			unsigned int remain)
 {
-	struct req_ctx *rctx = arg;
-
 	usb_state.active = 0;
 
-	req_ctx_set_state(rctx, RCTX_STATE_FREE);
+	release_inflight();
 
 	if (status == 0 && remain == 0) {
-		refill_dma();
+		refill_dma(!ssc_active());
 	} else {
 		TRACE_WARNING("Err: EP%u wr_compl, status 0x%02u, xfr %u, remain %u\r\n",
 				EP_NR, status, transferred, remain);
 	}
 }
 
-static int refill_dma(void)
+/* Start the next USB transfer.  Unless flush is set, wait until enough
+ * buffers are queued to fill a whole run. */
+static int refill_dma(int flush)
 {
-	struct req_ctx *rctx;
+	struct req_ctx *rctx, *next;
+	LLIST_HEAD(run);
+	unsigned int num = 1;
+	uint32_t len;
 	int res;
 
+	if (!flush && req_ctx_queue_len(&usb_state.queue) < usb_state.coalesce) {
+		usb_state.active = 0;
+		return -EAGAIN;
+	}
+
 	rctx = req_ctx_dequeue(&usb_state.queue);
 	if (!rctx) {
 		//TRACE_WARNING("No rctx for re-filling USB DMA\n\r");
@@ -470,27 +1113,71 @@ static int refill_dma(void)
 		return -ENOENT;
 	}
 
-	req_ctx_set_state(rctx, RCTX_STATE_UDP_EP2_BUSY);
+	llist_add_tail(&rctx->list, &run);
+	len = rctx->tot_len;
+
+	/* append the following buffers as long as they are adjacent */
+	for (next = rctx; num < usb_state.coalesce; num++) {
+		next = req_ctx_dequeue_contig(&usb_state.queue, next);
+		if (!next)
+			break;
+		llist_add_tail(&next->list, &run);
+		len += next->tot_len;
+	}
 
-	if ((res = USBD_Write(EP_NR, rctx->data, rctx->tot_len, wr_compl_cb, rctx)) != USBD_STATUS_SUCCESS) {
+	if ((res = USBD_Write(EP_NR, rctx->data, len, wr_compl_cb, NULL)) != USBD_STATUS_SUCCESS) {
 		TRACE_WARNING("USB EP busy while re-filling USB DMA: %d\n\r", res);
-		req_ctx_set_state(rctx, RCTX_STATE_FREE);
-		usb_state.active = 0;
+		/* only this run, a write still in progress owns the inflight
+		 * ones.  Back to the front of the queue to keep the order */
+		llist_splice(&run, &usb_state.queue);
 		return -EBUSY;
 	}
 
+	llist_for_each_entry(next, &run, list)
+		req_ctx_set_state(next, RCTX_STATE_UDP_EP2_BUSY);
+	llist_splice(&run, usb_state.inflight.prev);
+
+	usb_state.total_writes++;
+	usb_state.total_rctx += num;
 	usb_state.active = 1;
 	return 0;
 }
 
-/* user API: requests us to start transmitting data via USB IN EP */
-void fastsource_start(void)
+/* start a USB transfer unless one is running.  Must not be interrupted by
+ * wr_compl_cb() or usb_submit_req_ctx() */
+static void __fastsource_start(void)
 {
 	if(USBD_GetState() != USBD_STATE_CONFIGURED)
 		return;
 
+	/* don't hold back the last buffers once the receiver stopped */
 	if (!usb_state.active)
-		refill_dma();
+		refill_dma(!ssc_active());
+}
+
+/* user API: requests us to start transmitting data via USB IN EP */
+void fastsource_start(void)
+{
+	IRQ_DisableIT(AT91C_ID_UDPHS);
+	IRQ_DisableIT(AT91C_ID_HDMA);
+	__fastsource_start();
+	IRQ_EnableIT(AT91C_ID_HDMA);
+	IRQ_EnableIT(AT91C_ID_UDPHS);
+}
+
+/* user API: return the buffers waiting for the host to the pool, for when
+ * nobody reads them and the SSC DMA needs them.  The run already handed
+ * to the USB controller stays there, it is at most half of the pool */
+void fastsource_drop_queued(void)
+{
+	struct req_ctx *rctx;
+
+	IRQ_DisableIT(AT91C_ID_UDPHS);
+	IRQ_DisableIT(AT91C_ID_HDMA);
+	while ((rctx = req_ctx_dequeue(&usb_state.queue)))
+		req_ctx_set_state(rctx, RCTX_STATE_FREE);
+	IRQ_EnableIT(AT91C_ID_HDMA);
+	IRQ_EnableIT(AT91C_ID_UDPHS);
 }
 
 /* Use every Nth sample for computing statistics.  At fpga.adc_clkdiv=2 we can
@@ -566,7 +1253,10 @@ void usb_submit_req_ctx(struct req_ctx *rctx)
 	//TRACE_INFO("USB rctx enqueue (%08x, %u/%u)\n\r", rctx, rctx->size, rctx->tot_len);
 	req_ctx_enqueue(&usb_state.queue, rctx);
 
-	fastsource_start();
+	/* called from the HDMA interrupt, the UDPHS one has the same
+	 * priority and can't preempt it.  Toggling them here could unmask
+	 * the UDPHS interrupt in the middle of a section that masked it */
+	__fastsource_start();
 }
 
 /* callback */
@@ -595,4 +1285,7 @@ void fastsource_dump(void)
 	llist_for_each_entry_safe(rctx, rctx2, &usb_state.queue, list)
 		printf(" %02d", req_ctx_num(rctx));
 	printf("\n\r");
+	printf("usb writes=%u, rctx=%u, coalesce=%u\n\r",
+		usb_state.total_writes, usb_state.total_rctx,
+		usb_state.coalesce);
 }
@@ -25,15 +25,218 @@
 #include <string.h>
 #include <stdarg.h>
 
+#include <board.h>
+#define __INLINE inline
+#define IRQn_Type int
+#include <cmsis/core_cm3.h>
+
+#include <common.h>
+#include <uart_cmd.h>
+#include <logging.h>
+
+#define local_irq_save(x)	do { __disable_fault_irq(); __disable_irq(); } while(0)
+#define local_irq_restore(x)	do { __enable_fault_irq(); __enable_irq(); } while(0)
+
+/* Log messages are not printed from the caller's context: at 115200 baud a
+ * single line keeps the CPU busy for several milliseconds, which is far too
+ * long for the tuning path or for an interrupt handler.  Instead the format
+ * string and its arguments are recorded in a ring and formatted later from
+ * the main loop by log_drain().
+ *
+ * As a consequence, the format string and all %s arguments must point to
+ * constant storage, and at most LOG_MAX_ARGS integer sized arguments are
+ * recorded. */
+
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE	32	/* must be a power of two */
+#endif
+#define LOG_MAX_ARGS	4
+
+struct log_entry {
+	const char *fmt;
+	const char *file;
+	uint16_t line;
+	uint8_t subsys;
+	uint8_t level;
+	uint8_t cont;
+	uint32_t args[LOG_MAX_ARGS];
+};
+
+static struct {
+	struct log_entry ring[LOG_RING_SIZE];
+	volatile uint32_t head;		/* written by logp2() */
+	volatile uint32_t tail;		/* written by log_drain() */
+	uint32_t total;
+	uint32_t dropped;
+	uint32_t reported_drops;
+} log_state;
+
+static uint8_t log_levels[_NUM_DSUBSYS] = {
+	[0 ... _NUM_DSUBSYS-1] = LOGL_INFO,
+};
+
+static const char *log_subsys_names[_NUM_DSUBSYS] = {
+	[DMAIN]	= "main",
+	[DTUN]	= "tun",
+	[DVCO]	= "vco",
+	[DSSC]	= "ssc",
+	[DUSB]	= "usb",
+};
+
+/* number of arguments consumed by a printf format string */
+static int log_num_args(const char *fmt)
+{
+	int n = 0;
+
+	while ((fmt = strchr(fmt, '%'))) {
+		fmt++;
+		if (*fmt == '%') {
+			fmt++;
+			continue;
+		}
+		n++;
+	}
+
+	return n < LOG_MAX_ARGS ? n : LOG_MAX_ARGS;
+}
 
 void logp2(int subsys, unsigned int level, char *file,
 	   int line, int cont, const char *format, ...)
 {
+	struct log_entry *le;
+	unsigned long flags;
 	va_list ap;
-	printf("%u/%u/%s:%u: ", subsys, level, file, line);
+	int i, num;
+
+	if (subsys >= 0 && subsys < _NUM_DSUBSYS && level < log_levels[subsys])
+		return;
 
+	local_irq_save(flags);
+	if (log_state.head - log_state.tail >= LOG_RING_SIZE) {
+		log_state.dropped++;
+		local_irq_restore(flags);
+		return;
+	}
+	le = &log_state.ring[log_state.head % LOG_RING_SIZE];
+
+	le->fmt = format;
+	le->file = file;
+	le->line = line;
+	le->subsys = subsys;
+	le->level = level;
+	le->cont = cont;
+
+	num = log_num_args(format);
 	va_start(ap, format);
-	vfprintf(stderr, format, ap);
+	for (i = 0; i < num; i++)
+		le->args[i] = va_arg(ap, uint32_t);
 	va_end(ap);
-	fputc('\r', stderr);
+
+	log_state.total++;
+	log_state.head++;
+	local_irq_restore(flags);
+}
+
+/* print at most one pending message, called from the main loop.  Returns
+ * the number of messages that are still pending */
+int log_drain(void)
+{
+	struct log_entry *le;
+	uint32_t dropped = log_state.dropped;
+
+	if (dropped != log_state.reported_drops) {
+		printf("-- %u log messages dropped --\n\r",
+			dropped - log_state.reported_drops);
+		log_state.reported_drops = dropped;
+	}
+
+	if (log_state.head == log_state.tail)
+		return 0;
+
+	le = &log_state.ring[log_state.tail % LOG_RING_SIZE];
+	if (!le->cont)
+		printf("%u/%u/%s:%u: ", le->subsys, le->level,
+			le->file, le->line);
+	printf(le->fmt, le->args[0], le->args[1], le->args[2], le->args[3]);
+	putchar('\r');
+
+	/* only hand the slot back once we're done with it */
+	log_state.tail++;
+
+	return log_state.head - log_state.tail;
+}
+
+void log_set_level(int subsys, unsigned int level)
+{
+	if (subsys < 0 || subsys >= _NUM_DSUBSYS)
+		return;
+
+	log_levels[subsys] = level;
+}
+
+/***********************************************************************
+ * command integration
+ ***********************************************************************/
+
+static int log_subsys_by_cmd(const char *cmd)
+{
+	int i;
+
+	/* commands are named "log.<subsys>" */
+	for (i = 0; i < _NUM_DSUBSYS; i++) {
+		if (log_subsys_names[i] && !strcmp(cmd + 4, log_subsys_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+static int cmd_log_level(struct cmd_state *cs, enum cmd_op op,
+			 const char *cmd, int argc, char **argv)
+{
+	int subsys = log_subsys_by_cmd(cmd);
+
+	if (subsys < 0)
+		return -EINVAL;
+
+	switch (op) {
+	case CMD_OP_SET:
+		if (argc < 1)
+			return -EINVAL;
+		log_set_level(subsys, atoi(argv[0]));
+		break;
+	case CMD_OP_GET:
+		uart_cmd_out(cs, "Log level of %s is %u\n\r",
+			     log_subsys_names[subsys], log_levels[subsys]);
+		break;
+	}
+	return 0;
+}
+
+static int cmd_log_stats(struct cmd_state *cs, enum cmd_op op,
+			 const char *cmd, int argc, char **argv)
+{
+	uart_cmd_out(cs, "log messages=%u, pending=%u, dropped=%u\n\r",
+		     log_state.total, log_state.head - log_state.tail,
+		     log_state.dropped);
+	return 0;
+}
+
+static struct cmd cmds[] = {
+	{ "log.main", CMD_OP_SET|CMD_OP_GET, cmd_log_level,
+	  "Minimum level of logged messages (1=debug..8=fatal)" },
+	{ "log.tun", CMD_OP_SET|CMD_OP_GET, cmd_log_level,
+	  "Minimum level of logged tuner messages" },
+	{ "log.vco", CMD_OP_SET|CMD_OP_GET, cmd_log_level,
+	  "Minimum level of logged VCXO messages" },
+	{ "log.ssc", CMD_OP_SET|CMD_OP_GET, cmd_log_level,
+	  "Minimum level of logged SSC messages" },
+	{ "log.usb", CMD_OP_SET|CMD_OP_GET, cmd_log_level,
+	  "Minimum level of logged USB messages" },
+	{ "log.stats", CMD_OP_EXEC, cmd_log_stats,
+	  "Statistics about the log ring" },
+};
+
+void log_init(void)
+{
+	uart_cmds_register(cmds, ARRAY_SIZE(cmds));
 }
@@ -17,6 +17,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+
 #include <board.h>
 #include <errno.h>
 #include <irq/irq.h>
@@ -34,6 +36,7 @@
 #include <common.h>
 #include <req_ctx.h>
 #include <uart_cmd.h>
+#include <osdr_ssc.h>
 
 struct reg {
 	unsigned int offset;
@@ -92,10 +95,38 @@ struct ssc_state {
 	uint32_t total_xfers;
 	uint32_t total_irqs;
 	uint32_t total_ovrun;
+	/* in-band framing */
+	uint16_t seq;
+	uint32_t sample_ctr;
+	uint32_t last_ovrun;
+	uint8_t flags;
+	/* scratch buffer the DMA spins on while the pool is exhausted */
+	int in_scratch;
+	uint32_t total_dropped;		/* words written to the scratch buffer */
+	/* last timed command, reported in the frame header */
+	uint32_t cmd_sample;
+	uint16_t cmd_tag;
+	uint16_t cmd_seq;
 };
 
 struct ssc_state ssc_state;
 
+static uint8_t scratch_buf[RCTX_SIZE_SMALL];
+static DmaLinkList scratch_lli;
+
+#define DMA_CH_DADDR	(*(volatile uint32_t *)((uint8_t *)AT91C_BASE_HDMA_CH_0 + \
+				(BOARD_SSC_DMA_CHANNEL*0x28) + 4))
+
+/* an rctx may come from either pool, see req_ctx_find_get().  Its payload
+ * has to be whole samples and its length has to fit osdr_frame_hdr.len */
+#if (RCTX_SIZE_SMALL % 4) || (RCTX_SIZE_LARGE % 4) || (RCTX_SIZE_LARGE > 0xffff)
+#error "request context sizes don't fit the frame header"
+#endif
+
+/* not part of ssc_state, it has to survive ssc_init() */
+static int ssc_framing;
+static ssc_sample_hook_t ssc_hook;
+
 #define INTENDED_HDMA_C_LEN	10
 
 static void __refill_dma()
@@ -112,12 +143,16 @@ static void __refill_dma()
 			break;
 		}
 
+		/* leave room for the frame header, if any */
+		rctx->hdr_len = ssc_framing ? sizeof(struct osdr_frame_hdr) : 0;
+
 		/* populate DMA descriptor inside request context */
 		rctx->dma_lli.sourceAddress = (unsigned int) &AT91C_BASE_SSC0->SSC_RHR;
-		rctx->dma_lli.destAddress = rctx->data;
-		rctx->dma_lli.controlA = DMA_CTRLA | (rctx->size/4);
+		rctx->dma_lli.destAddress = rctx->data + rctx->hdr_len;
+		rctx->dma_lli.controlA = DMA_CTRLA | ((rctx->size - rctx->hdr_len)/4);
 		rctx->dma_lli.controlB = DMA_CTRLB;
-		rctx->dma_lli.descriptor = 0; /* end of list */
+		/* end of list: continue into the scratch buffer */
+		rctx->dma_lli.descriptor = &scratch_lli;
 
 		/* append to list and update end pointer */
 		if (!llist_empty(&ssc_state.pending_rctx)) {
@@ -134,17 +169,166 @@ static void __refill_dma()
 	*/
 }
 
-int ssc_dma_start(void)
+/* The scratch descriptor loops onto itself, so the DMA never runs off the
+ * end of the chain.  Samples landing there are dropped but counted. */
+static void __scratch_arm(void)
+{
+	scratch_lli.sourceAddress = (unsigned int) &AT91C_BASE_SSC0->SSC_RHR;
+	scratch_lli.destAddress = (unsigned int) scratch_buf;
+	scratch_lli.controlA = DMA_CTRLA | (sizeof(scratch_buf)/4);
+	scratch_lli.controlB = DMA_CTRLB;
+	scratch_lli.descriptor = &scratch_lli;
+}
+
+static void __scratch_dropped(uint32_t words)
+{
+	ssc_state.total_dropped += words;
+	/* make the gap visible in the frame sample counter */
+	ssc_state.sample_ctr += words;
+}
+
+/* Move the DMA from the scratch buffer back to the head of the chain.  The
+ * receiver keeps running, words arriving meanwhile show up as overruns. */
+static void __scratch_leave(void)
 {
 	struct req_ctx *rctx;
 
-	__refill_dma();
+	rctx = llist_entry(ssc_state.pending_rctx.next, struct req_ctx, list);
+
+	DMA_DisableChannel(BOARD_SSC_DMA_CHANNEL);
+	__scratch_dropped((DMA_CH_DADDR - (uint32_t) scratch_buf) / 4);
+	__scratch_arm();
+
+	DMA_SetDescriptorAddr(BOARD_SSC_DMA_CHANNEL, &rctx->dma_lli);
+	DMA_EnableChannel(BOARD_SSC_DMA_CHANNEL);
+
+	ssc_state.in_scratch = 0;
+	LED_Set(0);
+}
+
+/* fill in the frame header of a completed buffer, called from IRQ */
+static void __frame_complete(struct req_ctx *rctx)
+{
+	struct osdr_frame_hdr *hdr = (struct osdr_frame_hdr *) rctx->data;
+	uint32_t words = (rctx->tot_len - rctx->hdr_len) / 4;
+
+	if (ssc_state.total_ovrun != ssc_state.last_ovrun) {
+		ssc_state.last_ovrun = ssc_state.total_ovrun;
+		ssc_state.flags |= OSDR_FRAME_F_OVERRUN;
+	}
+
+	if (rctx->hdr_len) {
+		hdr->magic = OSDR_FRAME_MAGIC;
+		hdr->hdr_len = rctx->hdr_len;
+		hdr->flags = ssc_state.flags;
+		hdr->len = rctx->tot_len;
+		hdr->seq = ssc_state.seq;
+		hdr->sample_ctr = ssc_state.sample_ctr;
+		hdr->ovrun = ssc_state.total_ovrun;
+		hdr->cmd_sample = ssc_state.cmd_sample;
+		hdr->cmd_tag = ssc_state.cmd_tag;
+		hdr->cmd_seq = ssc_state.cmd_seq;
+		ssc_state.flags = 0;
+	}
+
+	/* counters keep running without framing, so that it can be
+	 * switched on at any time */
+	ssc_state.seq++;
+	ssc_state.sample_ctr += words;
+}
+
+/* \brief Sample counter of the word the DMA is about to write
+ *
+ * sample_ctr only advances when a buffer completes, this adds the progress
+ * of the DMA within the current buffer. */
+uint32_t ssc_sample_position(void)
+{
+	struct req_ctx *rctx;
+	uint32_t pos, dest, start = 0, words = 0;
+
+	IRQ_DisableIT(AT91C_ID_HDMA);
+
+	pos = ssc_state.sample_ctr;
+
+	if (ssc_state.active) {
+		dest = DMA_CH_DADDR;
+
+		if (ssc_state.in_scratch) {
+			start = (uint32_t) scratch_buf;
+			words = sizeof(scratch_buf)/4;
+		} else if (!llist_empty(&ssc_state.pending_rctx)) {
+			rctx = llist_entry(ssc_state.pending_rctx.next,
+					   struct req_ctx, list);
+			start = (uint32_t) rctx->dma_lli.destAddress;
+			words = (rctx->size - rctx->hdr_len) / 4;
+		}
+
+		/* outside means the buffer is complete, but its
+		 * interrupt is still pending */
+		if (dest >= start && dest - start <= words * 4)
+			pos += (dest - start) / 4;
+		else
+			pos += words;
+	}
+
+	IRQ_EnableIT(AT91C_ID_HDMA);
+
+	return pos;
+}
+
+/* \brief Report a completed timed command in the following frame headers */
+void ssc_report_cmd(uint16_t tag, uint32_t sample)
+{
+	IRQ_DisableIT(AT91C_ID_HDMA);
+	ssc_state.cmd_sample = sample;
+	ssc_state.cmd_tag = tag;
+	/* 0 means none so far */
+	if (!++ssc_state.cmd_seq)
+		ssc_state.cmd_seq = 1;
+	IRQ_EnableIT(AT91C_ID_HDMA);
+}
+
+void ssc_set_sample_hook(ssc_sample_hook_t hook)
+{
+	ssc_hook = hook;
+}
+
+/* pass a completed buffer to the sample hook, called from IRQ */
+static int __sample_hook(struct req_ctx *rctx)
+{
+	uint32_t words = (rctx->tot_len - rctx->hdr_len) / 4;
+
+	if (!ssc_hook)
+		return 0;
+
+	/* __frame_complete() has already advanced the counter */
+	return ssc_hook((const uint32_t *) (rctx->data + rctx->hdr_len),
+			words, ssc_state.sample_ctr - words);
+}
+
+void ssc_set_framing(int on)
+{
+	ssc_framing = on ? 1 : 0;
+}
+
+int ssc_get_framing(void)
+{
+	return ssc_framing;
+}
+
+int ssc_dma_start(void)
+{
+	struct req_ctx *rctx;
 
+	/* while active, the chain is maintained from the DMA interrupt */
 	if (ssc_state.active) {
 		//TRACE_WARNING("Cannot start SSC DMA, active == 1\n\r");
 		return -EBUSY;
 	}
 
+	__scratch_arm();
+	__refill_dma();
+
 	if (llist_empty(&ssc_state.pending_rctx)) {
 		//TRACE_WARNING("Cannot start SSC DMA, no rctx pending\n\r");
 		return -ENOMEM;
@@ -171,6 +355,9 @@ int ssc_dma_start(void)
 				| AT91C_HDMA_FIFOCFG_LARGESTBURST);
 
 	ssc_state.active = 1;
+	ssc_state.in_scratch = 0;
+	/* whatever arrived while the receiver was off is lost */
+	ssc_state.flags |= OSDR_FRAME_F_RESTART;
 	DMA_EnableChannel(BOARD_SSC_DMA_CHANNEL);
 	LED_Set(0);
 	TRACE_INFO("Started SSC DMA\n\r");
@@ -184,6 +371,7 @@ int ssc_dma_stop(void)
 {
 	SSC_DisableReceiver(AT91C_BASE_SSC0);
 	ssc_state.active = 0;
+	ssc_state.in_scratch = 0;
 
 	/* clear any pending interrupts */
 	DMA_DisableChannel(BOARD_SSC_DMA_CHANNEL);
@@ -216,8 +404,12 @@ void HDMA_IrqHandler(void)
 			llist_del(&rctx->list);
 			ssc_state.hdma_chain_len--;
 			rctx->tot_len = rctx->size;
+			__frame_complete(rctx);
 #if 1
-			usb_submit_req_ctx(rctx);
+			if (__sample_hook(rctx))
+				req_ctx_set_state(rctx, RCTX_STATE_FREE);
+			else
+				usb_submit_req_ctx(rctx);
 #else
 			req_ctx_set_state(rctx, RCTX_STATE_FREE);
 #endif
@@ -225,9 +417,25 @@ void HDMA_IrqHandler(void)
 			__refill_dma();
 
 		}
+
+		if (scratch_lli.controlA & AT91C_HDMA_DONE) {
+			/* ran out of buffers, a scratch block was dropped */
+			if (!ssc_state.in_scratch) {
+				ssc_state.in_scratch = 1;
+				LED_Clear(0);
+			}
+			__scratch_dropped(sizeof(scratch_buf)/4);
+			scratch_lli.controlA = DMA_CTRLA | (sizeof(scratch_buf)/4);
+		}
+
+		if (ssc_state.in_scratch) {
+			__refill_dma();
+			if (!llist_empty(&ssc_state.pending_rctx))
+				__scratch_leave();
+		}
 	}
 	if (status & CBTC(BOARD_SSC_DMA_CHANNEL)) {
-		/* the end of the list was reached */
+		/* should not happen, the chain ends in the scratch loop */
 		LED_Clear(0);
 		SSC_DisableReceiver(AT91C_BASE_SSC0);
 		ssc_state.active = 0;
@@ -238,9 +446,22 @@ void HDMA_IrqHandler(void)
 
 void ssc_stats(void)
 {
-	printf("SSC num_irq=%u, num_xfers=%u, num_ovrun=%u\n\r",
+	printf("SSC num_irq=%u, num_xfers=%u, num_ovrun=%u, num_dropped=%u%s\n\r",
 		ssc_state.total_irqs, ssc_state.total_xfers,
-		ssc_state.total_ovrun);
+		ssc_state.total_ovrun, ssc_state.total_dropped,
+		ssc_state.in_scratch ? " (dropping)" : "");
+}
+
+void ssc_get_stats(struct ssc_stats *st)
+{
+	st->total_xfers = ssc_state.total_xfers;
+	st->total_irqs = ssc_state.total_irqs;
+	st->total_ovrun = ssc_state.total_ovrun;
+	st->active = ssc_state.active;
+	st->hdma_chain_len = ssc_state.hdma_chain_len;
+	st->seq = ssc_state.seq;
+	st->sample_ctr = ssc_state.sample_ctr;
+	st->total_dropped = ssc_state.total_dropped;
 }
 
 void SSC0_IrqHandler(void)
@@ -289,6 +510,24 @@ static int cmd_ssc_dump(struct cmd_state *cs, enum cmd_op op,
 	fastsource_dump();
 }
 
+static int cmd_ssc_framing(struct cmd_state *cs, enum cmd_op op,
+			   const char *cmd, int argc, char **argv)
+{
+	switch (op) {
+	case CMD_OP_SET:
+		if (argc < 1)
+			return -EINVAL;
+		ssc_set_framing(atoi(argv[0]));
+		break;
+	case CMD_OP_GET:
+		uart_cmd_out(cs, "SSC framing is %s (seq=%u, samples=%u)\n\r",
+			     ssc_framing ? "on" : "off", ssc_state.seq,
+			     ssc_state.sample_ctr);
+		break;
+	}
+	return 0;
+}
+
 static struct cmd cmds[] = {
 	{ "ssc.start", CMD_OP_EXEC, cmd_ssc_start,
 	  "Start the SSC Receiver" },
@@ -298,6 +537,8 @@ static struct cmd cmds[] = {
 	  "Statistics about the SSC" },
 	{ "ssc.dump", CMD_OP_EXEC, cmd_ssc_dump,
 	  "Dump SSC DMA registers" },
+	{ "ssc.framing", CMD_OP_SET|CMD_OP_GET, cmd_ssc_framing,
+	  "Prepend a sequence/overrun header to each sample buffer" },
 };
 
 int ssc_init(void)
@@ -0,0 +1,310 @@
+/* On-device power sweep
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <board.h>
+
+#include <common.h>
+#include <uart_cmd.h>
+#include <logging.h>
+#include <tuner_e4k.h>
+#include <osdr_ssc.h>
+#include <osdr_sweep.h>
+#include <fast_source.h>
+
+#define SWEEP_DEF_SETTLE	4096
+#define SWEEP_DEF_SAMPLES	16384
+
+/* how long the PLL may take to lock, 5ms */
+#define SWEEP_LOCK_CYCLES	(BOARD_MCK / 200)
+
+struct sweep {
+	struct e4k_state *e4k;
+	volatile enum sweep_state state;
+
+	uint32_t start;
+	uint32_t step;
+	unsigned int steps;
+	unsigned int cur;
+	uint32_t lock_start;
+	uint32_t unlocked;
+
+	uint32_t settle;
+	uint32_t samples;
+
+	/* measurement window, the accumulator belongs to the DMA interrupt
+	 * until measured is set */
+	volatile uint32_t from;
+	volatile uint64_t acc;
+	volatile uint32_t count;
+	volatile int measured;
+
+	uint32_t power[SWEEP_MAX_STEPS];
+};
+
+static struct sweep sweep = {
+	.settle = SWEEP_DEF_SETTLE,
+	.samples = SWEEP_DEF_SAMPLES,
+};
+
+/* accumulate I^2+Q^2 over the window, called from the DMA interrupt */
+static int sweep_hook(const uint32_t *samples, unsigned int num,
+		      uint32_t first)
+{
+	struct sweep *sw = &sweep;
+	int32_t ofs;
+	unsigned int i, end;
+	int16_t si, sq;
+	uint64_t acc = 0;
+
+	/* the stream belongs to the sweep until it is done */
+	if (sw->state != SWEEP_MEASURE || sw->measured)
+		return 1;
+
+	/* where the window starts within this buffer */
+	ofs = sw->from - first;
+	if (ofs >= (int32_t) num)
+		return 1;
+
+	i = ofs > 0 ? ofs : 0;
+	end = i + (sw->samples - sw->count);
+	if (end > num)
+		end = num;
+
+	sw->count += end - i;
+
+	for (; i < end; i++) {
+		si = samples[i] & 0xffff;
+		sq = samples[i] >> 16;
+		/* at most 2^31, fits */
+		acc += (uint32_t)(si * si) + (uint32_t)(sq * sq);
+	}
+
+	sw->acc += acc;
+
+	if (sw->count >= sw->samples)
+		sw->measured = 1;
+
+	return 1;
+}
+
+static void sweep_finish(void)
+{
+	ssc_set_sample_hook(NULL);
+	sweep.state = SWEEP_DONE;
+
+	LOGP(DMAIN, LOGL_INFO, "Sweep done, %u steps, %u unlocked\n",
+	     sweep.steps, sweep.unlocked);
+}
+
+/* tune to the current step, or skip it if that fails */
+static void sweep_tune(void)
+{
+	struct sweep *sw = &sweep;
+	struct e4k_hop hop;
+	int rc;
+
+	while (sw->cur < sw->steps) {
+		rc = e4k_hop_prepare(sw->e4k, &hop, sw->start + sw->cur * sw->step,
+				     E4K_HOP_GAIN_KEEP);
+		if (rc >= 0)
+			rc = e4k_hop_apply(sw->e4k, &hop);
+		if (rc >= 0) {
+			sw->lock_start = DWT_CYCCNT;
+			sw->state = SWEEP_LOCK;
+			return;
+		}
+
+		sw->power[sw->cur++] = SWEEP_POWER_UNLOCKED;
+		sw->unlocked++;
+	}
+
+	sweep_finish();
+}
+
+static void sweep_next(uint32_t power)
+{
+	sweep.power[sweep.cur++] = power;
+	sweep_tune();
+}
+
+/*! \brief Set up the measurement of each step
+ *  \param[in] settle samples to skip after the PLL has locked
+ *  \param[in] samples samples to average
+ */
+void sweep_configure(uint32_t settle, uint32_t samples)
+{
+	sweep.settle = settle;
+	sweep.samples = samples ? samples : 1;
+}
+
+/*! \brief Start a sweep, a running one is aborted
+ *  \param[in] start frequency of the first step in Hz
+ *  \param[in] step frequency increment in Hz
+ *  \param[in] count number of steps, 0 just aborts
+ *  \returns 0 on success, negative in case of error
+ */
+int sweep_start(uint32_t start, uint32_t step, unsigned int count)
+{
+	sweep_abort();
+
+	if (count > SWEEP_MAX_STEPS)
+		return -EINVAL;
+	if (!count)
+		return 0;
+
+	sweep.start = start;
+	sweep.step = step;
+	sweep.steps = count;
+	sweep.cur = 0;
+	sweep.unlocked = 0;
+
+	/* the host isn't necessarily reading, without the buffers it left
+	 * behind the DMA would only fill the scratch buffer */
+	ssc_set_sample_hook(sweep_hook);
+	fastsource_drop_queued();
+	sweep_tune();
+
+	return 0;
+}
+
+void sweep_abort(void)
+{
+	ssc_set_sample_hook(NULL);
+	sweep.state = SWEEP_IDLE;
+	sweep.steps = 0;
+}
+
+/*! \brief Advance the sweep, called from the main loop */
+void sweep_process(void)
+{
+	struct sweep *sw = &sweep;
+	int locked, err;
+
+	switch (sw->state) {
+	case SWEEP_LOCK:
+		/* the read waits for the tuning writes, check them too */
+		locked = e4k_pll_locked(sw->e4k);
+		err = e4k_check_errors(sw->e4k);
+		if (locked > 0 && !err) {
+			sw->acc = 0;
+			sw->count = 0;
+			sw->measured = 0;
+			sw->from = ssc_sample_position() + sw->settle;
+			sw->state = SWEEP_MEASURE;
+		} else if (locked < 0 || err ||
+			   DWT_CYCCNT - sw->lock_start >= SWEEP_LOCK_CYCLES) {
+			sw->unlocked++;
+			sweep_next(SWEEP_POWER_UNLOCKED);
+		}
+		break;
+	case SWEEP_MEASURE:
+		if (sw->measured)
+			sweep_next(sw->acc / sw->count);
+		break;
+	default:
+		break;
+	}
+}
+
+void sweep_get_status(struct sweep_status *st)
+{
+	st->state = sweep.state;
+	st->steps = sweep.steps;
+	st->done = sweep.cur;
+	st->unlocked = sweep.unlocked;
+}
+
+/*! \brief Copy out the mean power of the measured steps
+ *  \returns number of values copied
+ */
+unsigned int sweep_get_power(uint32_t *power, unsigned int first,
+			     unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num && first + i < sweep.cur; i++)
+		power[i] = sweep.power[first + i];
+
+	return i;
+}
+
+/***********************************************************************
+ * command integration
+ ***********************************************************************/
+
+static int cmd_sweep_run(struct cmd_state *cs, enum cmd_op op,
+			 const char *cmd, int argc, char **argv)
+{
+	if (argc < 3)
+		return -EINVAL;
+
+	return sweep_start(strtoul(argv[0], NULL, 10),
+			   strtoul(argv[1], NULL, 10), atoi(argv[2]));
+}
+
+static int cmd_sweep_cfg(struct cmd_state *cs, enum cmd_op op,
+			 const char *cmd, int argc, char **argv)
+{
+	switch (op) {
+	case CMD_OP_SET:
+		if (argc < 2)
+			return -EINVAL;
+		sweep_configure(strtoul(argv[0], NULL, 10),
+				strtoul(argv[1], NULL, 10));
+		break;
+	case CMD_OP_GET:
+		uart_cmd_out(cs, "settle=%u samples=%u\n\r",
+			     sweep.settle, sweep.samples);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int cmd_sweep_dump(struct cmd_state *cs, enum cmd_op op,
+			  const char *cmd, int argc, char **argv)
+{
+	unsigned int i;
+
+	for (i = 0; i < sweep.cur; i++)
+		uart_cmd_out(cs, "%u %u\n\r", sweep.start + i * sweep.step,
+			     sweep.power[i]);
+
+	return 0;
+}
+
+static struct cmd cmds[] = {
+	{ "sweep.run", CMD_OP_SET, cmd_sweep_run,
+	  "Power sweep: start,step,count (Hz)" },
+	{ "sweep.cfg", CMD_OP_SET|CMD_OP_GET, cmd_sweep_cfg,
+	  "Samples to skip and to average per step: settle,samples" },
+	{ "sweep.dump", CMD_OP_EXEC, cmd_sweep_dump,
+	  "Frequency and mean I^2+Q^2 of each step" },
+};
+
+void sweep_init(struct e4k_state *e4k)
+{
+	sweep.e4k = e4k;
+
+	uart_cmds_register(cmds, ARRAY_SIZE(cmds));
+}
@@ -0,0 +1,408 @@
+/* Interrupt / PDC driven TWI transaction queue
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+
+#include <board.h>
+#include <irq/irq.h>
+#include <twi/twi.h>
+
+#include <common.h>
+#include <uart_cmd.h>
+#include <osdr_twi.h>
+
+/* The PDC moves all but the last byte of a write and all but the last two
+ * bytes of a read, the STOP condition has to be issued by hand before the
+ * final byte.  Each transfer walks through the following states: */
+enum twi_state {
+	TWI_ST_IDLE,
+	TWI_ST_TX_PDC,		/* PDC sending, wait for ENDTX */
+	TWI_ST_TX_LAST,		/* wait for TXRDY, then STOP + last byte */
+	TWI_ST_RX_PDC,		/* PDC receiving, wait for ENDRX */
+	TWI_ST_RX_PENULT,	/* wait for RXRDY, then STOP */
+	TWI_ST_RX_LAST,		/* wait for the last RXRDY */
+	TWI_ST_TXCOMP,		/* wait for the STOP to be sent */
+};
+
+/* an E4K burst takes well below a millisecond, if nothing completes for
+ * this long a slave is holding the bus */
+#define TWI_TIMEOUT_CYCLES	(BOARD_MCK / 100)
+
+struct osdr_twi {
+	AT91S_TWI *twi;
+	struct llist_head queue;
+	struct twi_xfer *cur;
+	enum twi_state state;
+
+	uint32_t total_xfers;
+	uint32_t total_bytes;
+	uint32_t total_nacks;
+	uint32_t total_cancelled;
+	uint32_t total_timeouts;
+	volatile uint32_t completed;	/* changes whenever the bus progresses */
+};
+
+static struct osdr_twi twi_bus;
+
+static void __twi_start(struct osdr_twi *bus);
+
+/* report the result of a transfer, called with the TWI IRQ disabled */
+static void __twi_finish(struct osdr_twi *bus, struct twi_xfer *xfer,
+			 int status)
+{
+	struct twi_batch *batch = xfer->batch;
+
+	if (status == 0) {
+		bus->total_xfers++;
+		bus->total_bytes += xfer->len;
+	} else if (status == -ECANCELED)
+		bus->total_cancelled++;
+	else if (status == -ETIMEDOUT)
+		bus->total_timeouts++;
+	else
+		bus->total_nacks++;
+
+	bus->completed++;
+
+	xfer->status = status;
+	if (xfer->cb)
+		xfer->cb(xfer);
+
+	if (batch) {
+		if (status < 0 && batch->status == 0)
+			batch->status = status;
+		if (--batch->pending == 0 && batch->cb)
+			batch->cb(batch);
+	}
+}
+
+static void __twi_complete(struct osdr_twi *bus, int status)
+{
+	struct twi_xfer *xfer = bus->cur;
+	AT91S_TWI *twi = bus->twi;
+
+	twi->TWI_IDR = 0xffffffff;
+	twi->TWI_PTCR = AT91C_PDC_TXTDIS | AT91C_PDC_RXTDIS;
+
+	bus->cur = NULL;
+	bus->state = TWI_ST_IDLE;
+
+	__twi_finish(bus, xfer, status);
+	__twi_start(bus);
+}
+
+/* start the next transfer from the queue, if the bus is idle */
+static void __twi_start(struct osdr_twi *bus)
+{
+	AT91S_TWI *twi = bus->twi;
+	struct twi_xfer *xfer;
+
+	if (bus->cur)
+		return;
+
+	while (!bus->cur) {
+		if (llist_empty(&bus->queue))
+			return;
+
+		xfer = llist_entry(bus->queue.next, struct twi_xfer, list);
+		llist_del(&xfer->list);
+
+		/* an earlier transfer of the same batch has failed */
+		if (xfer->batch && xfer->batch->status < 0) {
+			__twi_finish(bus, xfer, -ECANCELED);
+			continue;
+		}
+		bus->cur = xfer;
+	}
+
+	twi->TWI_MMR = 0;
+	twi->TWI_MMR = (xfer->addr << 16) |
+		       (xfer->iaddr_len ? AT91C_TWI_IADRSZ_1_BYTE : 0) |
+		       (xfer->dir == TWI_XFER_READ ? AT91C_TWI_MREAD : 0);
+	twi->TWI_IADR = xfer->iaddr;
+
+	if (xfer->dir == TWI_XFER_WRITE) {
+		if (xfer->len > 1) {
+			twi->TWI_TPR = (uint32_t) xfer->data;
+			twi->TWI_TCR = xfer->len - 1;
+			bus->state = TWI_ST_TX_PDC;
+			twi->TWI_PTCR = AT91C_PDC_TXTEN;
+			twi->TWI_IER = AT91C_TWI_ENDTX | AT91C_TWI_NACK;
+		} else {
+			bus->state = TWI_ST_TX_LAST;
+			twi->TWI_IER = AT91C_TWI_TXRDY | AT91C_TWI_NACK;
+		}
+	} else {
+		if (xfer->len > 2) {
+			twi->TWI_RPR = (uint32_t) xfer->data;
+			twi->TWI_RCR = xfer->len - 2;
+			bus->state = TWI_ST_RX_PDC;
+			twi->TWI_PTCR = AT91C_PDC_RXTEN;
+			twi->TWI_CR = AT91C_TWI_START;
+			twi->TWI_IER = AT91C_TWI_ENDRX | AT91C_TWI_NACK;
+		} else if (xfer->len == 2) {
+			bus->state = TWI_ST_RX_PENULT;
+			twi->TWI_CR = AT91C_TWI_START;
+			twi->TWI_IER = AT91C_TWI_RXRDY | AT91C_TWI_NACK;
+		} else {
+			bus->state = TWI_ST_RX_LAST;
+			twi->TWI_CR = AT91C_TWI_START | AT91C_TWI_STOP;
+			twi->TWI_IER = AT91C_TWI_RXRDY | AT91C_TWI_NACK;
+		}
+	}
+}
+
+void TWI0_IrqHandler(void)
+{
+	struct osdr_twi *bus = &twi_bus;
+	AT91S_TWI *twi = bus->twi;
+	struct twi_xfer *xfer = bus->cur;
+	uint32_t sr = twi->TWI_SR & twi->TWI_IMR;
+
+	if (!xfer) {
+		twi->TWI_IDR = 0xffffffff;
+		return;
+	}
+
+	if (sr & AT91C_TWI_NACK) {
+		__twi_complete(bus, -EIO);
+		return;
+	}
+
+	switch (bus->state) {
+	case TWI_ST_TX_PDC:
+		if (!(sr & AT91C_TWI_ENDTX))
+			break;
+		twi->TWI_PTCR = AT91C_PDC_TXTDIS;
+		twi->TWI_IDR = AT91C_TWI_ENDTX;
+		bus->state = TWI_ST_TX_LAST;
+		twi->TWI_IER = AT91C_TWI_TXRDY;
+		break;
+	case TWI_ST_TX_LAST:
+		if (!(sr & AT91C_TWI_TXRDY))
+			break;
+		twi->TWI_IDR = AT91C_TWI_TXRDY;
+		twi->TWI_CR = AT91C_TWI_STOP;
+		twi->TWI_THR = xfer->data[xfer->len - 1];
+		bus->state = TWI_ST_TXCOMP;
+		twi->TWI_IER = AT91C_TWI_TXCOMP;
+		break;
+	case TWI_ST_RX_PDC:
+		if (!(sr & AT91C_TWI_ENDRX))
+			break;
+		twi->TWI_PTCR = AT91C_PDC_RXTDIS;
+		twi->TWI_IDR = AT91C_TWI_ENDRX;
+		bus->state = TWI_ST_RX_PENULT;
+		twi->TWI_IER = AT91C_TWI_RXRDY;
+		break;
+	case TWI_ST_RX_PENULT:
+		if (!(sr & AT91C_TWI_RXRDY))
+			break;
+		twi->TWI_CR = AT91C_TWI_STOP;
+		xfer->data[xfer->len - 2] = twi->TWI_RHR;
+		bus->state = TWI_ST_RX_LAST;
+		break;
+	case TWI_ST_RX_LAST:
+		if (!(sr & AT91C_TWI_RXRDY))
+			break;
+		xfer->data[xfer->len - 1] = twi->TWI_RHR;
+		twi->TWI_IDR = AT91C_TWI_RXRDY;
+		bus->state = TWI_ST_TXCOMP;
+		twi->TWI_IER = AT91C_TWI_TXCOMP;
+		break;
+	case TWI_ST_TXCOMP:
+		if (sr & AT91C_TWI_TXCOMP)
+			__twi_complete(bus, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+/*! \brief Queue a transfer, returns immediately */
+int osdr_twi_submit(struct osdr_twi *bus, struct twi_xfer *xfer)
+{
+	if (!xfer->len)
+		return -EINVAL;
+
+	xfer->status = -EINPROGRESS;
+
+	IRQ_DisableIT(AT91C_ID_TWI0);
+	llist_add_tail(&xfer->list, &bus->queue);
+	if (!bus->cur)
+		__twi_start(bus);
+	IRQ_EnableIT(AT91C_ID_TWI0);
+
+	return 0;
+}
+
+/* Give up on the current transfer if the bus made no progress since the
+ * wait started, the ones queued behind it run afterwards.  Called while
+ * waiting, with the TWI IRQ enabled */
+static void __twi_check_stuck(struct osdr_twi *bus, uint32_t *start,
+			      uint32_t *seen)
+{
+	if (bus->completed != *seen) {
+		*seen = bus->completed;
+		*start = DWT_CYCCNT;
+		return;
+	}
+
+	if (DWT_CYCCNT - *start < TWI_TIMEOUT_CYCLES)
+		return;
+
+	IRQ_DisableIT(AT91C_ID_TWI0);
+	if (bus->completed == *seen && bus->cur) {
+		bus->twi->TWI_CR = AT91C_TWI_STOP;
+		__twi_complete(bus, -ETIMEDOUT);
+	}
+	IRQ_EnableIT(AT91C_ID_TWI0);
+
+	*seen = bus->completed;
+	*start = DWT_CYCCNT;
+}
+
+/*! \brief Wait for a transfer to complete, returns its status.  Transfers
+ * stuck on the bus are aborted with -ETIMEDOUT */
+int osdr_twi_wait(struct twi_xfer *xfer)
+{
+	uint32_t start = DWT_CYCCNT, seen = twi_bus.completed;
+
+	while (xfer->status == -EINPROGRESS)
+		__twi_check_stuck(&twi_bus, &start, &seen);
+
+	return xfer->status;
+}
+
+/*! \brief Queue a list of transfers to be executed back to back */
+int osdr_twi_submit_batch(struct osdr_twi *bus, struct twi_batch *batch,
+			  struct twi_xfer *xfers, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		if (!xfers[i].len)
+			return -EINVAL;
+	}
+
+	batch->status = 0;
+	batch->pending = num;
+
+	IRQ_DisableIT(AT91C_ID_TWI0);
+	for (i = 0; i < num; i++) {
+		xfers[i].batch = batch;
+		xfers[i].status = -EINPROGRESS;
+		llist_add_tail(&xfers[i].list, &bus->queue);
+	}
+	if (!bus->cur)
+		__twi_start(bus);
+	IRQ_EnableIT(AT91C_ID_TWI0);
+
+	return 0;
+}
+
+/*! \brief Wait for all transfers of a batch, returns the first error */
+int osdr_twi_batch_wait(struct twi_batch *batch)
+{
+	uint32_t start = DWT_CYCCNT, seen = twi_bus.completed;
+
+	while (batch->pending)
+		__twi_check_stuck(&twi_bus, &start, &seen);
+
+	return batch->status;
+}
+
+int osdr_twi_write(struct osdr_twi *bus, uint8_t addr, uint8_t reg,
+		   const uint8_t *data, unsigned int len)
+{
+	struct twi_xfer xfer = {
+		.addr = addr,
+		.dir = TWI_XFER_WRITE,
+		.iaddr = reg,
+		.iaddr_len = 1,
+		.data = (uint8_t *) data,
+		.len = len,
+	};
+	int rc;
+
+	rc = osdr_twi_submit(bus, &xfer);
+	if (rc < 0)
+		return rc;
+
+	return osdr_twi_wait(&xfer);
+}
+
+int osdr_twi_read(struct osdr_twi *bus, uint8_t addr, uint8_t reg,
+		  uint8_t *data, unsigned int len)
+{
+	struct twi_xfer xfer = {
+		.addr = addr,
+		.dir = TWI_XFER_READ,
+		.iaddr = reg,
+		.iaddr_len = 1,
+		.data = data,
+		.len = len,
+	};
+	int rc;
+
+	rc = osdr_twi_submit(bus, &xfer);
+	if (rc < 0)
+		return rc;
+
+	return osdr_twi_wait(&xfer);
+}
+
+/***********************************************************************
+ * command integration
+ ***********************************************************************/
+
+static int cmd_twi_stats(struct cmd_state *cs, enum cmd_op op,
+			 const char *cmd, int argc, char **argv)
+{
+	uart_cmd_out(cs, "TWI xfers=%u, bytes=%u, nacks=%u, cancelled=%u, "
+		     "timeouts=%u\n\r",
+		     twi_bus.total_xfers, twi_bus.total_bytes,
+		     twi_bus.total_nacks, twi_bus.total_cancelled,
+		     twi_bus.total_timeouts);
+	return 0;
+}
+
+static struct cmd cmds[] = {
+	{ "twi.stats", CMD_OP_EXEC, cmd_twi_stats,
+	  "Statistics about the I2C transfers" },
+};
+
+/*! \brief Initialize the queue, the TWI has to be configured as master */
+struct osdr_twi *osdr_twi_init(AT91S_TWI *twi)
+{
+	twi_bus.twi = twi;
+	twi_bus.cur = NULL;
+	twi_bus.state = TWI_ST_IDLE;
+	INIT_LLIST_HEAD(&twi_bus.queue);
+
+	twi->TWI_IDR = 0xffffffff;
+	twi->TWI_PTCR = AT91C_PDC_TXTDIS | AT91C_PDC_RXTDIS;
+
+	IRQ_ConfigureIT(AT91C_ID_TWI0, 0, TWI0_IrqHandler);
+	IRQ_EnableIT(AT91C_ID_TWI0);
+
+	uart_cmds_register(cmds, ARRAY_SIZE(cmds));
+
+	return &twi_bus;
+}
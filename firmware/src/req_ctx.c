@@ -31,8 +31,14 @@
 #define local_irq_save(x)	do { __disable_fault_irq(); __disable_irq(); } while(0)
 #define local_irq_restore(x)	do { __enable_fault_irq(); __enable_irq(); } while(0)
 
+/* pool geometry, may be overridden from the Makefile.  Requests for small
+ * buffers fall back to large ones when the small ones are exhausted. */
+#ifndef NUM_RCTX_SMALL
 #define NUM_RCTX_SMALL 20
+#endif
+#ifndef NUM_RCTX_LARGE
 #define NUM_RCTX_LARGE 0
+#endif
 
 #define NUM_REQ_CTX	(NUM_RCTX_SMALL+NUM_RCTX_LARGE)
 
@@ -41,21 +47,58 @@ static uint8_t rctx_data_large[NUM_RCTX_LARGE][RCTX_SIZE_LARGE];
 
 static struct req_ctx req_ctx[NUM_REQ_CTX];
 
-struct req_ctx __ramfunc *req_ctx_find_get(int large,
-				 unsigned long old_state, 
-				 unsigned long new_state)
+/* Free request contexts are kept on a list per buffer size, linked through
+ * req_ctx.list which is unused while they are free. */
+struct rctx_pool {
+	struct llist_head free;
+	uint16_t num;
+	uint16_t num_free;
+	uint16_t low_watermark;	/* lowest num_free seen */
+	uint32_t alloc_fail;
+};
+
+static struct rctx_pool rctx_pools[2];	/* small, large */
+
+#define rctx_pool_of(ctx)	(&rctx_pools[(ctx)->size == RCTX_SIZE_LARGE])
+
+/* call with interrupts disabled */
+static struct req_ctx *__rctx_pool_get(struct rctx_pool *pool)
+{
+	struct req_ctx *ctx;
+
+	if (llist_empty(&pool->free))
+		return NULL;
+
+	ctx = llist_entry(pool->free.next, struct req_ctx, list);
+	llist_del(&ctx->list);
+
+	pool->num_free--;
+	if (pool->num_free < pool->low_watermark)
+		pool->low_watermark = pool->num_free;
+
+	return ctx;
+}
+
+/* call with interrupts disabled */
+static void __rctx_pool_put(struct req_ctx *ctx)
+{
+	struct rctx_pool *pool = rctx_pool_of(ctx);
+
+	llist_add_tail(&ctx->list, &pool->free);
+	pool->num_free++;
+}
+
+static struct req_ctx *req_ctx_scan(unsigned long old_state,
+				    unsigned long new_state, int large)
 {
 	unsigned long flags;
 	uint8_t i;
 
-	if (large)
-		i = NUM_RCTX_SMALL;
-	else
-		i = 0;
-
-	for (; i < NUM_REQ_CTX; i++) {
+	for (i = large ? NUM_RCTX_SMALL : 0; i < NUM_REQ_CTX; i++) {
 		local_irq_save(flags);
 		if (req_ctx[i].state == old_state) {
+			if (new_state == RCTX_STATE_FREE)
+				__rctx_pool_put(&req_ctx[i]);
 			req_ctx[i].state = new_state;
 			local_irq_restore(flags);
 			return &req_ctx[i];
@@ -66,17 +109,63 @@ struct req_ctx __ramfunc *req_ctx_find_get(int large,
 	return NULL;
 }
 
+struct req_ctx __ramfunc *req_ctx_find_get(int large,
+				 unsigned long old_state, 
+				 unsigned long new_state)
+{
+	unsigned long flags;
+	struct req_ctx *ctx;
+
+	/* only free contexts are tracked, anything else is rare */
+	if (old_state != RCTX_STATE_FREE)
+		return req_ctx_scan(old_state, new_state, large);
+
+	local_irq_save(flags);
+	ctx = NULL;
+	if (!large)
+		ctx = __rctx_pool_get(&rctx_pools[0]);
+	if (!ctx)
+		ctx = __rctx_pool_get(&rctx_pools[1]);
+	if (ctx)
+		ctx->state = new_state;
+	else
+		rctx_pools[large ? 1 : 0].alloc_fail++;
+	local_irq_restore(flags);
+
+	return ctx;
+}
+
 uint8_t req_ctx_num(struct req_ctx *ctx)
 {
 	return ((char *)ctx - (char *)&req_ctx[0])/sizeof(*ctx);
 }
 
+void req_ctx_get_stats(int large, struct req_ctx_stats *st)
+{
+	struct rctx_pool *pool = &rctx_pools[large ? 1 : 0];
+	unsigned long flags;
+
+	local_irq_save(flags);
+	st->num = pool->num;
+	st->num_free = pool->num_free;
+	st->low_watermark = pool->low_watermark;
+	st->alloc_fail = pool->alloc_fail;
+	local_irq_restore(flags);
+}
+
 void req_ctx_set_state(struct req_ctx *ctx, unsigned long new_state)
 {
 	unsigned long flags;
 
 	/* FIXME: do we need this kind of locking, we're UP! */
 	local_irq_save(flags);
+	if (new_state == RCTX_STATE_FREE && ctx->state != RCTX_STATE_FREE)
+		__rctx_pool_put(ctx);
+	else if (new_state != RCTX_STATE_FREE && ctx->state == RCTX_STATE_FREE) {
+		/* taken by req_ctx_scan() or directly, not via the pool */
+		llist_del(&ctx->list);
+		rctx_pool_of(ctx)->num_free--;
+	}
 	ctx->state = new_state;
 	local_irq_restore(flags);
 }
@@ -90,17 +179,30 @@ void req_ctx_init(void)
 {
 	int i;
 
+	for (i = 0; i < 2; i++) {
+		INIT_LLIST_HEAD(&rctx_pools[i].free);
+		rctx_pools[i].num = rctx_pools[i].num_free = 0;
+		rctx_pools[i].alloc_fail = 0;
+	}
+
 	for (i = 0; i < NUM_RCTX_SMALL; i++) {
 		req_ctx[i].size = RCTX_SIZE_SMALL;
 		req_ctx[i].data = rctx_data[i];
 		req_ctx[i].state = RCTX_STATE_FREE;
+		__rctx_pool_put(&req_ctx[i]);
+		rctx_pools[0].num++;
 	}
 
 	for (i = 0; i < NUM_RCTX_LARGE; i++) {
 		req_ctx[NUM_RCTX_SMALL+i].size = RCTX_SIZE_LARGE;
 		req_ctx[NUM_RCTX_SMALL+i].data = rctx_data_large[i];
 		req_ctx[NUM_RCTX_SMALL+i].state = RCTX_STATE_FREE;
+		__rctx_pool_put(&req_ctx[NUM_RCTX_SMALL+i]);
+		rctx_pools[1].num++;
 	}
+
+	for (i = 0; i < 2; i++)
+		rctx_pools[i].low_watermark = rctx_pools[i].num_free;
 }
 
 struct req_ctx *req_ctx_dequeue(struct llist_head *list)
@@ -121,6 +223,47 @@ struct req_ctx *req_ctx_dequeue(struct llist_head *list)
 	return rctx;
 }
 
+/* dequeue the head of the list only if its buffer directly follows the
+ * one of prev in memory, so that both can go out in one transfer */
+struct req_ctx *req_ctx_dequeue_contig(struct llist_head *list,
+				       struct req_ctx *prev)
+{
+	unsigned long flags;
+	struct req_ctx *rctx;
+
+	local_irq_save(flags);
+	if (llist_empty(list)) {
+		local_irq_restore(flags);
+		return NULL;
+	}
+
+	rctx = llist_entry(list->next, struct req_ctx, list);
+	if (rctx->data != prev->data + prev->tot_len ||
+	    prev->tot_len != prev->size) {
+		local_irq_restore(flags);
+		return NULL;
+	}
+
+	llist_del(&rctx->list);
+	local_irq_restore(flags);
+
+	return rctx;
+}
+
+unsigned int req_ctx_queue_len(struct llist_head *list)
+{
+	unsigned long flags;
+	struct llist_head *pos;
+	unsigned int len = 0;
+
+	local_irq_save(flags);
+	llist_for_each(pos, list)
+		len++;
+	local_irq_restore(flags);
+
+	return len;
+}
+
 void req_ctx_enqueue(struct llist_head *list, struct req_ctx *rctx)
 {
 	unsigned long flags;
@@ -133,6 +276,7 @@ void req_ctx_enqueue(struct llist_head *list, struct req_ctx *rctx)
 
 void req_ctx_dump()
 {
+	struct req_ctx_stats st;
 	int i;
 
 	local_irq_save(flags);
@@ -141,4 +285,11 @@ void req_ctx_dump()
 		printf(" %02x", req_ctx[i].state);
 	local_irq_restore(flags);
 	printf("\n\r");
+
+	for (i = 0; i < 2; i++) {
+		req_ctx_get_stats(i, &st);
+		printf("ctx pool %s: %u/%u free, low watermark %u, %u failed\n\r",
+			i ? "large" : "small", st.num_free, st.num,
+			st.low_watermark, st.alloc_fail);
+	}
 }
@@ -23,11 +23,12 @@
 #include <stdio.h>
 #include <errno.h>
 
+#include <common.h>
 #include <si570.h>
 #include <logging.h>
 #include <utility/trace.h>
 
-#include <twi/twid.h>
+#include <osdr_twi.h>
 
 static void udelay(uint32_t usec)
 {
@@ -44,15 +45,15 @@ static void udelay(uint32_t usec)
 static int smbus8_read_bytes(void *i2c, uint8_t addr, uint8_t reg_nr,
 			    uint8_t *out, uint8_t num)
 {
-	unsigned char rc;
+	int rc;
 
-	rc = TWID_Read(i2c, addr, reg_nr, 1, out, num, NULL);
-	if (rc != 0) {
-		LOGP(DVCO, LOGL_ERROR, "Error %u in TWID_Read\n", rc);
+	rc = osdr_twi_read(i2c, addr, reg_nr, out, num);
+	if (rc < 0) {
+		LOGP(DVCO, LOGL_ERROR, "Error %d in I2C read\n", rc);
 		return -EIO;
 	}
 
-	return rc;
+	return 0;
 }
 
 static int smbus8_read_byte(void *i2c, uint8_t addr, uint8_t reg_nr,
@@ -64,15 +65,15 @@ static int smbus8_read_byte(void *i2c, uint8_t addr, uint8_t reg_nr,
 static int smbus8_write_bytes(void *i2c, uint8_t addr, uint8_t reg_nr,
 			      uint8_t *val, uint8_t num)
 {
-	unsigned char rc;
+	int rc;
 
-	rc = TWID_Write(i2c, addr, reg_nr, 1, val, num, NULL);
-	if (rc != 0) {
-		LOGP(DVCO, LOGL_ERROR, "Error %u in TWID_Write\n", rc);
+	rc = osdr_twi_write(i2c, addr, reg_nr, val, num);
+	if (rc < 0) {
+		LOGP(DVCO, LOGL_ERROR, "Error %d in I2C write\n", rc);
 		return -EIO;
 	}
 
-	return rc;
+	return 0;
 }
 
 static int smbus8_write_byte(void *i2c, uint8_t addr, uint8_t reg_nr,
@@ -248,6 +249,17 @@ found_solution:
 	uint8_t data[6];
 	uint64_t xf, xd, xr;
 	uint32_t n1v;
+	static uint8_t freeze = 0x10, unfreeze = 0x00, newfreq = 0x40;
+	/* freeze the DCO, program the new dividers, unfreeze and apply.
+	 * The four writes go out back to back as one batch */
+	struct twi_xfer xfers[] = {
+		{ .iaddr = 137, .data = &freeze, .len = 1 },
+		{ .iaddr = 7, .data = data, .len = 6 },
+		{ .iaddr = 137, .data = &unfreeze, .len = 1 },
+		{ .iaddr = 135, .data = &newfreq, .len = 1 },
+	};
+	struct twi_batch batch = { 0 };
+	int i, rc;
 
 	xf = freq;
 	xf*= 1000;
@@ -267,12 +279,19 @@ found_solution:
 	data[4] = (xr  >> 8);
 	data[5] = (xr  >> 0);
 
-	smbus8_write_byte(ctx->i2c, ctx->slave_addr, 137, 0x10);
-
-	smbus8_write_bytes(ctx->i2c,ctx->slave_addr, 7, data, 6);
+	for (i = 0; i < ARRAY_SIZE(xfers); i++) {
+		xfers[i].addr = ctx->slave_addr;
+		xfers[i].dir = TWI_XFER_WRITE;
+		xfers[i].iaddr_len = 1;
+	}
 
-	smbus8_write_byte(ctx->i2c, ctx->slave_addr, 137, 0x00);
-	smbus8_write_byte(ctx->i2c, ctx->slave_addr, 135, 0x40);
+	rc = osdr_twi_submit_batch(ctx->i2c, &batch, xfers, ARRAY_SIZE(xfers));
+	if (rc == 0)
+		rc = osdr_twi_batch_wait(&batch);
+	if (rc < 0) {
+		LOGP(DVCO, LOGL_ERROR, "Error %d in I2C write\n", rc);
+		return -EIO;
+	}
 
 	ctx->lock = 1;
 }
@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include <reg_field.h>
+#include <logging.h>
 #include <tuner_e4k.h>
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
@@ -74,22 +75,170 @@ int e4k_reg_read(struct e4k_state *e4k, uint8_t reg)
 }
 #endif
 
+/***********************************************************************
+ * Register Cache
+ *
+ * Register modifications only update the shadow copy in e4k->shadow and
+ * mark the register dirty.  e4k_flush() then writes each run of consecutive
+ * dirty registers in a single I2C burst, so a read-modify-write of a
+ * cached register costs no bus time at all until the flush.  Registers
+ * which the tuner modifies on its own are always read from the chip.
+ */
+
+#define SHADOW_TEST(map, reg)	((map)[(reg) >> 5] & (1 << ((reg) & 31)))
+#define SHADOW_SET(map, reg)	((map)[(reg) >> 5] |= (1 << ((reg) & 31)))
+#define SHADOW_CLR(map, reg)	((map)[(reg) >> 5] &= ~(1 << ((reg) & 31)))
+
+static int e4k_reg_is_volatile(uint8_t reg)
+{
+	switch (reg) {
+	case E4K_REG_MASTER1:	/* power-on-reset indicator */
+	case E4K_REG_DC1:	/* self-clearing calibration trigger */
+	case E4K_REG_DC2:	/* calibration results */
+	case E4K_REG_DC3:
+	case E4K_REG_DC4:
+		return 1;
+	}
+	return 0;
+}
+
+/*! \brief Forget the contents of the register cache
+ *  \param[in] e4k reference to the tuner
+ *
+ *  Needs to be called whenever the registers were modified behind the back
+ *  of the cache, e.g. after a reset or by raw register writes.
+ */
+void e4k_cache_invalidate(struct e4k_state *e4k)
+{
+	memset(e4k->shadow.valid, 0, sizeof(e4k->shadow.valid));
+	memset(e4k->shadow.dirty, 0, sizeof(e4k->shadow.dirty));
+}
+
+/*! \brief Read a register, from the cache if possible */
+static uint8_t e4k_reg_cached_read(struct e4k_state *e4k, uint8_t reg)
+{
+	struct e4k_shadow *sh = &e4k->shadow;
+
+	if (SHADOW_TEST(sh->dirty, reg) ||
+	    (SHADOW_TEST(sh->valid, reg) && !e4k_reg_is_volatile(reg)))
+		return sh->regs[reg];
+
+	sh->regs[reg] = e4k_reg_read(e4k, reg);
+	SHADOW_SET(sh->valid, reg);
+
+	return sh->regs[reg];
+}
+
+/*! \brief Queue a register write until the next e4k_flush() */
+static void e4k_reg_queue(struct e4k_state *e4k, uint8_t reg, uint8_t val)
+{
+	struct e4k_shadow *sh = &e4k->shadow;
+
+	sh->regs[reg] = val;
+	SHADOW_SET(sh->valid, reg);
+	SHADOW_SET(sh->dirty, reg);
+}
+
+/* Register writes complete in the background.  The registers whose write
+ * failed are dropped from the cache, as the chip may hold anything, and
+ * the error is kept until e4k_check_errors() reports it. */
+static int e4k_collect_errors(struct e4k_state *e4k)
+{
+	uint32_t failed[E4K_NUM_REGS/32] = { 0 };
+	unsigned int i;
+	int rc;
+
+	rc = e4k_reg_write_errors(e4k, failed);
+	if (rc < 0) {
+		for (i = 0; i < ARRAY_SIZE(failed); i++)
+			e4k->shadow.valid[i] &= ~failed[i];
+		if (!e4k->error)
+			e4k->error = rc;
+	}
+
+	return e4k->error;
+}
+
+/*! \brief Report whether queued register writes have failed
+ *  \param[in] e4k reference to the tuner
+ *  \returns 0 if all writes completed so far succeeded, negative otherwise
+ *
+ *  All writes have completed once a register read has returned.  The
+ *  error is only reported once.
+ */
+int e4k_check_errors(struct e4k_state *e4k)
+{
+	int rc = e4k_collect_errors(e4k);
+
+	e4k->error = 0;
+
+	return rc;
+}
+
+/*! \brief Write all dirty registers to the tuner
+ *  \param[in] e4k reference to the tuner
+ *  \returns 0 on success, negative in case of error, including earlier
+ *  writes which failed after their flush had returned and haven't been
+ *  reported by e4k_check_errors() yet
+ */
+int e4k_flush(struct e4k_state *e4k)
+{
+	struct e4k_shadow *sh = &e4k->shadow;
+	unsigned int reg, len, i;
+	int rc, ret;
+
+	ret = e4k_collect_errors(e4k);
+
+	for (reg = 0; reg < E4K_NUM_REGS; reg++) {
+		/* skip 32 clean registers at once */
+		if (!sh->dirty[reg >> 5]) {
+			reg |= 31;
+			continue;
+		}
+		if (!SHADOW_TEST(sh->dirty, reg))
+			continue;
+
+		for (len = 1; reg + len < E4K_NUM_REGS; len++) {
+			if (!SHADOW_TEST(sh->dirty, reg + len))
+				break;
+		}
+
+		rc = e4k_reg_write_burst(e4k, reg, &sh->regs[reg], len);
+		for (i = reg; i < reg + len; i++) {
+			SHADOW_CLR(sh->dirty, i);
+			/* we don't know what the chip has now */
+			if (rc < 0)
+				SHADOW_CLR(sh->valid, i);
+		}
+		if (rc < 0)
+			ret = rc;
+
+		reg += len - 1;
+	}
+
+	return ret;
+}
+
 /*! \brief Set or clear some (masked) bits inside a register
  *  \param[in] e4k reference to the tuner
  *  \param[in] reg number of the register
  *  \param[in] mask bit-mask of the value
  *  \param[in] val data value to be written to register
  *  \returns 0 on success, negative in case of error
+ *
+ *  The write is only queued, the caller has to call e4k_flush().
  */
 static int e4k_reg_set_mask(struct e4k_state *e4k, uint8_t reg,
 		     uint8_t mask, uint8_t val)
 {
-	uint8_t tmp = e4k_reg_read(e4k, reg);
+	uint8_t tmp = e4k_reg_cached_read(e4k, reg);
 
 	if ((tmp & mask) == val)
 		return 0;
 
-	return e4k_reg_write(e4k, reg, (tmp & ~mask) | (val & mask));
+	e4k_reg_queue(e4k, reg, (tmp & ~mask) | (val & mask));
+
+	return 0;
 }
 
 /*! \brief Write a given field inside a register
@@ -100,13 +249,8 @@ static int e4k_reg_set_mask(struct e4k_state *e4k, uint8_t reg,
  */
 static int e4k_field_write(struct e4k_state *e4k, const struct reg_field *field, uint8_t val)
 {
-	int rc;
 	uint8_t mask;
 
-	rc = e4k_reg_read(e4k, field->reg);
-	if (rc < 0)
-		return rc;
-
 	mask = width2mask[field->width] << field->shift;
 
 	return e4k_reg_set_mask(e4k, field->reg, mask, val << field->shift);
@@ -121,10 +265,7 @@ static int e4k_field_read(struct e4k_state *e4k, const struct reg_field *field)
 {
 	int rc;
 
-	rc = e4k_reg_read(e4k, field->reg);
-	if (rc < 0)
-		return rc;
-
+	rc = e4k_reg_cached_read(e4k, field->reg);
 	rc = (rc >> field->shift) & width2mask[field->width];
 
 	return rc;
@@ -202,7 +343,9 @@ int e4k_rf_filter_set(struct e4k_state *e4k)
 	if (rc < 0)
 		return rc;
 
-	return e4k_reg_set_mask(e4k, E4K_REG_FILT1, 0xF, rc);
+	e4k_reg_set_mask(e4k, E4K_REG_FILT1, 0xF, rc);
+
+	return e4k_flush(e4k);
 }
 
 /* Mixer Filter */
@@ -285,7 +428,9 @@ int e4k_if_filter_bw_set(struct e4k_state *e4k, enum e4k_if_filter filter,
 
 	field = &if_filter_fields[filter];
 
-	return e4k_field_write(e4k, field, bw_idx);
+	e4k_field_write(e4k, field, bw_idx);
+
+	return e4k_flush(e4k);
 }
 
 /*! \brief Enables / Disables the channel filter
@@ -295,8 +440,10 @@ int e4k_if_filter_bw_set(struct e4k_state *e4k, enum e4k_if_filter filter,
  */
 int e4k_if_filter_chan_enable(struct e4k_state *e4k, int on)
 {
-	return e4k_reg_set_mask(e4k, E4K_REG_FILT3, E4K_FILT3_DISABLE,
-	                        on ? 0 : E4K_FILT3_DISABLE);
+	e4k_reg_set_mask(e4k, E4K_REG_FILT3, E4K_FILT3_DISABLE,
+	                 on ? 0 : E4K_FILT3_DISABLE);
+
+	return e4k_flush(e4k);
 }
 
 int e4k_if_filter_bw_get(struct e4k_state *e4k, enum e4k_if_filter filter)
@@ -359,7 +506,7 @@ static int is_fvco_valid(uint32_t fvco_z)
 	/* check if the resulting fosc is valid */
 	if (fvco_z/1000 < E4K_FVCO_MIN_KHZ ||
 	    fvco_z/1000 > E4K_FVCO_MAX_KHZ) {
-		printf("Fvco %u invalid\n\r", fvco_z);
+		LOGP(DTUN, LOGL_ERROR, "Fvco %u invalid\n", fvco_z);
 		return 0;
 	}
 
@@ -369,7 +516,7 @@ static int is_fvco_valid(uint32_t fvco_z)
 static int is_fosc_valid(uint32_t fosc)
 {
 	if (fosc < MHZ(16) || fosc > MHZ(30)) {
-		printf("Fosc %u invalid\n\r", fosc);
+		LOGP(DTUN, LOGL_ERROR, "Fosc %u invalid\n", fosc);
 		return 0;
 	}
 
@@ -379,7 +526,7 @@ static int is_fosc_valid(uint32_t fosc)
 static int is_z_valid(uint32_t z)
 {
 	if (z > 255) {
-		printf("Z %u invalid\n\r", z);
+		LOGP(DTUN, LOGL_ERROR, "Z %u invalid\n", z);
 		return 0;
 	}
 
@@ -428,7 +575,60 @@ static uint32_t compute_flo(uint32_t f_osc, uint8_t z, uint16_t x, uint8_t r)
 	if (fvco == 0)
 		return -EINVAL;
 
-	return fvco / r;
+	/* the Cortex-M3 has no 64bit division.  All R are of the form
+	 * 2^n * {1, 3, 5}, so shift first and do the rest in 32bit */
+	while (!(r & 1)) {
+		fvco >>= 1;
+		r >>= 1;
+	}
+
+	return (uint32_t)fvco / r;
+}
+
+/* Fvco / Fosc is computed by multiplying with the reciprocal of Fosc,
+ * which only changes when the reference clock is reprogrammed */
+#define FOSC_RECIP_SHIFT	52
+
+static struct {
+	uint32_t fosc;
+	uint64_t recip;		/* 2^FOSC_RECIP_SHIFT / fosc */
+} fosc_recip;
+
+/* \brief compute floor(Fvco * Y / Fosc)
+ * \returns Z in the upper, X in the lower 16 bits */
+static uint32_t compute_zx(uint64_t fvco, uint32_t fosc)
+{
+	uint64_t num = fvco * E4K_PLL_Y;
+	uint64_t q, rem;
+
+	if (fosc_recip.fosc != fosc) {
+		fosc_recip.fosc = fosc;
+		fosc_recip.recip = ((uint64_t)1 << FOSC_RECIP_SHIFT) / fosc;
+	}
+
+	/* Fvco < 2^33 and, as Fosc >= 16MHz, recip < 2^29 */
+	q = (fvco * fosc_recip.recip) >> (FOSC_RECIP_SHIFT - 16);
+
+	/* the truncated reciprocal can only make the quotient too small */
+	rem = num - q * fosc;
+	while (rem >= fosc) {
+		rem -= fosc;
+		q++;
+	}
+
+	return q;
+}
+
+static enum e4k_band band_for_flo(uint32_t flo)
+{
+	if (flo < MHZ(140))
+		return E4K_BAND_VHF2;
+	else if (flo < MHZ(350))
+		return E4K_BAND_VHF3;
+	else if (flo < MHZ(1135))
+		return E4K_BAND_UHF;
+	else
+		return E4K_BAND_L;
 }
 
 static int e4k_band_set(struct e4k_state *e4k, enum e4k_band band)
@@ -439,15 +639,17 @@ static int e4k_band_set(struct e4k_state *e4k, enum e4k_band band)
 	case E4K_BAND_VHF2:
 	case E4K_BAND_VHF3:
 	case E4K_BAND_UHF:
-		e4k_reg_write(e4k, E4K_REG_BIAS, 3);
+		e4k_reg_queue(e4k, E4K_REG_BIAS, 3);
 		break;
 	case E4K_BAND_L:
-		e4k_reg_write(e4k, E4K_REG_BIAS, 0);
+		e4k_reg_queue(e4k, E4K_REG_BIAS, 0);
 		break;
 	}
 	/* workaround: if we don't reset this register before writing to it,
-	 * we get a gap between 325-350 MHz */
-	rc = e4k_reg_set_mask(e4k, E4K_REG_SYNTH1, 0x06, 0);
+	 * we get a gap between 325-350 MHz.  The intermediate value has to
+	 * reach the chip, so don't let the cache merge the two writes */
+	e4k_reg_set_mask(e4k, E4K_REG_SYNTH1, 0x06, 0);
+	e4k_flush(e4k);
 	rc = e4k_reg_set_mask(e4k, E4K_REG_SYNTH1, 0x06, band << 1);
 	if (rc >= 0)
 		e4k->band = band;
@@ -466,9 +668,8 @@ uint32_t e4k_compute_pll_params(struct e4k_pll_params *oscp, uint32_t fosc, uint
 {
 	uint32_t i;
 	uint8_t r = 2;
-	uint64_t intended_fvco, remainder;
-	uint64_t z = 0;
-	uint32_t x;
+	uint64_t intended_fvco;
+	uint32_t zx, z, x;
 	int flo;
 	int three_phase_mixing = 0;
 	oscp->r_idx = 0;
@@ -485,20 +686,15 @@ uint32_t e4k_compute_pll_params(struct e4k_pll_params *oscp, uint32_t fosc, uint
 		}
 	}
 
-	printf("Fint=%u, R=%u\n\r", intended_flo, r);
+	LOGP(DTUN, LOGL_DEBUG, "Fint=%u, R=%u\n", intended_flo, r);
 
 	/* flo(max) = 1700MHz, R(max) = 48, we need 64bit! */
 	intended_fvco = (uint64_t)intended_flo * r;
 
-	/* compute integral component of multiplier */
-	z = intended_fvco / fosc;
-
-	/* compute fractional part.  this will not overflow,
-	* as fosc(max) = 30MHz and z(max) = 255 */
-	remainder = intended_fvco - (fosc * z);
-	/* remainder(max) = 30MHz, E4K_PLL_Y = 65536 -> 64bit! */
-	x = (remainder * E4K_PLL_Y) / fosc;
-	/* x(max) as result of this computation is 65536 */
+	/* integral (Z) and fractional (X/Y) component of the multiplier */
+	zx = compute_zx(intended_fvco, fosc);
+	z = zx >> 16;
+	x = zx & 0xffff;
 
 	flo = compute_flo(fosc, z, x, r);
 
@@ -519,33 +715,63 @@ int e4k_tune_params(struct e4k_state *e4k, struct e4k_pll_params *p)
 	uint8_t val;
 
 	/* program R + 3phase/2phase */
-	e4k_reg_write(e4k, E4K_REG_SYNTH7, p->r_idx);
+	e4k_reg_queue(e4k, E4K_REG_SYNTH7, p->r_idx);
 	/* program Z */
-	e4k_reg_write(e4k, E4K_REG_SYNTH3, p->z);
+	e4k_reg_queue(e4k, E4K_REG_SYNTH3, p->z);
 	/* program X */
-	e4k_reg_write(e4k, E4K_REG_SYNTH4, p->x & 0xff);
-	e4k_reg_write(e4k, E4K_REG_SYNTH5, p->x >> 8);
+	e4k_reg_queue(e4k, E4K_REG_SYNTH4, p->x & 0xff);
+	e4k_reg_queue(e4k, E4K_REG_SYNTH5, p->x >> 8);
+	/* Z and X go out as one burst */
+	e4k_flush(e4k);
 
 	/* we're in auto calibration mode, so there's no need to trigger it */
 
 	memcpy(&e4k->vco, p, sizeof(e4k->vco));
 
 	/* set the band */
-	if (e4k->vco.flo < MHZ(140))
-		e4k_band_set(e4k, E4K_BAND_VHF2);
-	else if (e4k->vco.flo < MHZ(350))
-		e4k_band_set(e4k, E4K_BAND_VHF3);
-	else if (e4k->vco.flo < MHZ(1135))
-		e4k_band_set(e4k, E4K_BAND_UHF);
-	else
-		e4k_band_set(e4k, E4K_BAND_L);
+	e4k_band_set(e4k, band_for_flo(e4k->vco.flo));
 
 	/* select and set proper RF filter */
 	e4k_rf_filter_set(e4k);
+	e4k_flush(e4k);
 
 	return e4k->vco.flo;
 }
 
+/* \brief Look up the PLL parameters in the cache, compute them on a miss
+ * \returns actual PLL frequency, 0 in case of error */
+static uint32_t e4k_pll_params_get(struct e4k_state *e4k,
+				   struct e4k_pll_params *p, uint32_t freq)
+{
+	struct e4k_pll_cache_entry *ce, *lru = &e4k->pll_cache[0];
+	uint32_t flo;
+	int i;
+
+	for (i = 0; i < E4K_PLL_CACHE_SIZE; i++) {
+		ce = &e4k->pll_cache[i];
+		if (ce->last_use && ce->p.intended_flo == freq &&
+		    ce->p.fosc == e4k->vco.fosc) {
+			ce->last_use = ++e4k->pll_cache_clock;
+			e4k->pll_cache_hits++;
+			memcpy(p, &ce->p, sizeof(*p));
+			return p->flo;
+		}
+		if (ce->last_use < lru->last_use)
+			lru = ce;
+	}
+
+	e4k->pll_cache_misses++;
+
+	flo = e4k_compute_pll_params(p, e4k->vco.fosc, freq);
+	if (!flo)
+		return 0;
+
+	memcpy(&lru->p, p, sizeof(*p));
+	lru->last_use = ++e4k->pll_cache_clock;
+
+	return flo;
+}
+
 /*! \brief High-level tuning API, just specify frquency
  *
  *  This function will compute matching PLL parameters, program them into the
@@ -561,17 +787,19 @@ int e4k_tune_freq(struct e4k_state *e4k, uint32_t freq)
 	struct e4k_pll_params p;
 
 	/* determine PLL parameters */
-	rc = e4k_compute_pll_params(&p, e4k->vco.fosc, freq);
+	rc = e4k_pll_params_get(e4k, &p, freq);
 	if (!rc)
 		return -EINVAL;
 
 	/* actually tune to those parameters */
 	rc = e4k_tune_params(e4k, &p);
 
-	/* check PLL lock */
+	/* check PLL lock, the read waits for all of the writes above */
 	rc = e4k_reg_read(e4k, E4K_REG_SYNTH1);
+	if (e4k_check_errors(e4k) < 0)
+		return -EIO;
 	if (!(rc & 0x01)) {
-		printf("[E4K] PLL not locked!\n\r");
+		LOGP(DTUN, LOGL_NOTICE, "PLL not locked!\n");
 		return -1;
 	}
 
@@ -647,28 +875,41 @@ static const int32_t enhgain[] = {
 	10, 30, 50, 70
 };
 
-int e4k_set_lna_gain(struct e4k_state *e4k, int32_t gain)
+/* \brief GAIN1 register value for a LNA gain in tenths of a dB */
+static int lna_gain_reg(int32_t gain)
 {
 	uint32_t i;
 	for(i = 0; i < ARRAY_SIZE(lnagain)/2; ++i) {
-		if(lnagain[i*2] == gain) {
-			e4k_reg_set_mask(e4k, E4K_REG_GAIN1, 0xf, lnagain[i*2+1]);
-			return gain;
-		}
+		if(lnagain[i*2] == gain)
+			return lnagain[i*2+1];
 	}
 	return -EINVAL;
 }
 
+int e4k_set_lna_gain(struct e4k_state *e4k, int32_t gain)
+{
+	int rc = lna_gain_reg(gain);
+
+	if (rc < 0)
+		return rc;
+
+	e4k_reg_set_mask(e4k, E4K_REG_GAIN1, 0xf, rc);
+	e4k_flush(e4k);
+	return gain;
+}
+
 int e4k_set_enh_gain(struct e4k_state *e4k, int32_t gain)
 {
 	uint32_t i;
 	for(i = 0; i < ARRAY_SIZE(enhgain); ++i) {
 		if(enhgain[i] == gain) {
 			e4k_reg_set_mask(e4k, E4K_REG_AGC11, 0x7, E4K_AGC11_LNA_GAIN_ENH | (i << 1));
+			e4k_flush(e4k);
 			return gain;
 		}
 	}
 	e4k_reg_set_mask(e4k, E4K_REG_AGC11, 0x7, 0);
+	e4k_flush(e4k);
 
 	/* special case: 0 = off*/
 	if(0 == gain)
@@ -694,7 +935,7 @@ int e4k_enable_manual_gain(struct e4k_state *e4k, uint8_t manual)
 		e4k_reg_set_mask(e4k, E4K_REG_AGC11, 0x7, 0);
 	}
 
-	return 0;
+	return e4k_flush(e4k);
 }
 
 static int find_stage_gain(uint8_t stage, int8_t val)
@@ -734,7 +975,9 @@ int e4k_if_gain_set(struct e4k_state *e4k, uint8_t stage, int8_t value)
 	field = &if_stage_gain_regs[stage];
 	mask = width2mask[field->width] << field->shift;
 
-	return e4k_reg_set_mask(e4k, field->reg, mask, rc << field->shift);
+	e4k_reg_set_mask(e4k, field->reg, mask, rc << field->shift);
+
+	return e4k_flush(e4k);
 }
 
 int e4k_mixer_gain_set(struct e4k_state *e4k, int8_t value)
@@ -752,7 +995,9 @@ int e4k_mixer_gain_set(struct e4k_state *e4k, int8_t value)
 		return -EINVAL;
 	}
 
-	return e4k_reg_set_mask(e4k, E4K_REG_GAIN2, 1, bit);
+	e4k_reg_set_mask(e4k, E4K_REG_GAIN2, 1, bit);
+
+	return e4k_flush(e4k);
 }
 
 int e4k_commonmode_set(struct e4k_state *e4k, int8_t value)
@@ -762,7 +1007,90 @@ int e4k_commonmode_set(struct e4k_state *e4k, int8_t value)
 	else if(value > 7)
 		return -EINVAL;
 
-	return e4k_reg_set_mask(e4k, E4K_REG_DC7, 7, value);
+	e4k_reg_set_mask(e4k, E4K_REG_DC7, 7, value);
+
+	return e4k_flush(e4k);
+}
+
+/***********************************************************************
+ * Frequency Hopping */
+
+/*! \brief Precompute everything needed to tune to a frequency
+ *
+ *  The result can be programmed with e4k_hop_apply() without any
+ *  arithmetic or table lookups, which keeps hopping fast.
+ *
+ *  \param[in] e4k reference to tuner
+ *  \param[out] hop precomputed tuning step
+ *  \param[in] freq frequency in Hz
+ *  \param[in] gain LNA gain in tenths of a dB, E4K_HOP_GAIN_KEEP for none
+ *  \returns actual PLL frequency, negative in case of error
+ */
+int e4k_hop_prepare(struct e4k_state *e4k, struct e4k_hop *hop,
+		    uint32_t freq, int32_t gain)
+{
+	int rc;
+
+	if (!e4k_pll_params_get(e4k, &hop->p, freq))
+		return -EINVAL;
+
+	hop->band = band_for_flo(hop->p.flo);
+
+	rc = choose_rf_filter(hop->band, hop->p.flo);
+	if (rc < 0)
+		return rc;
+	hop->rf_filter = rc;
+
+	if (gain == E4K_HOP_GAIN_KEEP)
+		hop->lna_gain = -1;
+	else {
+		rc = lna_gain_reg(gain);
+		if (rc < 0)
+			return rc;
+		hop->lna_gain = rc;
+	}
+
+	return hop->p.flo;
+}
+
+/*! \brief Program a tuning step prepared by e4k_hop_prepare()
+ *
+ *  Unlike e4k_tune_freq() this doesn't wait for the PLL to lock, the
+ *  caller can check SYNTH1 if it cares.
+ *
+ *  \param[in] e4k reference to tuner
+ *  \param[in] hop precomputed tuning step
+ *  \returns 0 on success, negative in case of error
+ */
+int e4k_hop_apply(struct e4k_state *e4k, const struct e4k_hop *hop)
+{
+	e4k_reg_queue(e4k, E4K_REG_SYNTH7, hop->p.r_idx);
+	e4k_reg_queue(e4k, E4K_REG_SYNTH3, hop->p.z);
+	e4k_reg_queue(e4k, E4K_REG_SYNTH4, hop->p.x & 0xff);
+	e4k_reg_queue(e4k, E4K_REG_SYNTH5, hop->p.x >> 8);
+	e4k_flush(e4k);
+
+	memcpy(&e4k->vco, &hop->p, sizeof(e4k->vco));
+
+	e4k_band_set(e4k, hop->band);
+	e4k_reg_set_mask(e4k, E4K_REG_FILT1, 0xF, hop->rf_filter);
+	if (hop->lna_gain >= 0)
+		e4k_reg_set_mask(e4k, E4K_REG_GAIN1, 0xf, hop->lna_gain);
+
+	return e4k_flush(e4k);
+}
+
+/*! \brief Check whether the PLL has locked after a hop
+ *  \returns 1 if locked, 0 if not, negative in case of error
+ */
+int e4k_pll_locked(struct e4k_state *e4k)
+{
+	int rc = e4k_reg_read(e4k, E4K_REG_SYNTH1);
+
+	if (rc < 0)
+		return rc;
+
+	return (rc & E4K_SYNTH1_PLL_LOCK) ? 1 : 0;
 }
 
 /***********************************************************************
@@ -790,7 +1118,10 @@ int e4k_manual_dc_offset(struct e4k_state *e4k, int8_t iofs, int8_t irange, int8
 		return res;
 
 	res = e4k_reg_set_mask(e4k, E4K_REG_DC4, 0x33, (qrange << 4) | irange);
-	return res;
+	if(res < 0)
+		return res;
+
+	return e4k_flush(e4k);
 }
 
 /*! \brief Perform a DC offset calibration right now
@@ -800,6 +1131,7 @@ int e4k_dc_offset_calibrate(struct e4k_state *e4k)
 {
 	/* make sure the DC range detector is enabled */
 	e4k_reg_set_mask(e4k, E4K_REG_DC5, E4K_DC5_RANGE_DET_EN, E4K_DC5_RANGE_DET_EN);
+	e4k_flush(e4k);
 
 	return e4k_reg_write(e4k, E4K_REG_DC1, 0x01);
 }
@@ -863,14 +1195,15 @@ int e4k_dc_offset_gen_table(struct e4k_state *e4k)
 		fprintf(stderr, "Table %u I=%u/%u, Q=%u/%u\n",
 			i, range_i, offs_i, range_q, offs_q);
 */
-		/* write into the table */
-		e4k_reg_write(e4k, dc_gain_comb[i].reg,
+		/* write into the table, the LUT registers are consecutive
+		 * and get flushed in two bursts below */
+		e4k_reg_queue(e4k, dc_gain_comb[i].reg,
 			      TO_LUT(offs_q, range_q));
-		e4k_reg_write(e4k, dc_gain_comb[i].reg + 0x10,
+		e4k_reg_queue(e4k, dc_gain_comb[i].reg + 0x10,
 			      TO_LUT(offs_i, range_i));
 	}
 
-	return 0;
+	return e4k_flush(e4k);
 }
 
 /***********************************************************************
@@ -878,14 +1211,14 @@ int e4k_dc_offset_gen_table(struct e4k_state *e4k)
 
 static int magic_init(struct e4k_state *e4k)
 {
-	e4k_reg_write(e4k, 0x7e, 0x01);
-	e4k_reg_write(e4k, 0x7f, 0xfe);
-	e4k_reg_write(e4k, 0x82, 0x00);
-	e4k_reg_write(e4k, 0x86, 0x50);	/* polarity A */
-	e4k_reg_write(e4k, 0x87, 0x20);
-	e4k_reg_write(e4k, 0x88, 0x01);
-	e4k_reg_write(e4k, 0x9f, 0x7f);
-	e4k_reg_write(e4k, 0xa0, 0x07);
+	e4k_reg_queue(e4k, 0x7e, 0x01);
+	e4k_reg_queue(e4k, 0x7f, 0xfe);
+	e4k_reg_queue(e4k, 0x82, 0x00);
+	e4k_reg_queue(e4k, 0x86, 0x50);	/* polarity A */
+	e4k_reg_queue(e4k, 0x87, 0x20);
+	e4k_reg_queue(e4k, 0x88, 0x01);
+	e4k_reg_queue(e4k, 0x9f, 0x7f);
+	e4k_reg_queue(e4k, 0xa0, 0x07);
 
 	return 0;
 }
@@ -904,12 +1237,15 @@ int e4k_init(struct e4k_state *e4k)
 		E4K_MASTER1_POR_DET
 	);
 
+	/* the reset has cleared all registers */
+	e4k_cache_invalidate(e4k);
+
 	/* Configure clock input */
-	e4k_reg_write(e4k, E4K_REG_CLK_INP, 0x00);
+	e4k_reg_queue(e4k, E4K_REG_CLK_INP, 0x00);
 
 	/* Disable clock output */
-	e4k_reg_write(e4k, E4K_REG_REF_CLK, 0x00);
-	e4k_reg_write(e4k, E4K_REG_CLKOUT_PWDN, 0x96);
+	e4k_reg_queue(e4k, E4K_REG_REF_CLK, 0x00);
+	e4k_reg_queue(e4k, E4K_REG_CLKOUT_PWDN, 0x96);
 
 	/* Write some magic values into registers */
 	magic_init(e4k);
@@ -921,14 +1257,14 @@ int e4k_init(struct e4k_state *e4k)
 	e4k_dc_offset_gen_table(e4k);
 
 	/* Enable time variant DC correction */
-	e4k_reg_write(e4k, E4K_REG_DCTIME1, 0x01);
-	e4k_reg_write(e4k, E4K_REG_DCTIME2, 0x01);
+	e4k_reg_queue(e4k, E4K_REG_DCTIME1, 0x01);
+	e4k_reg_queue(e4k, E4K_REG_DCTIME2, 0x01);
 #endif
 
 	/* Set LNA mode to manual */
-	e4k_reg_write(e4k, E4K_REG_AGC4, 0x10); /* High threshold */
-	e4k_reg_write(e4k, E4K_REG_AGC5, 0x04);	/* Low threshold */
-	e4k_reg_write(e4k, E4K_REG_AGC6, 0x1a);	/* LNA calib + loop rate */
+	e4k_reg_queue(e4k, E4K_REG_AGC4, 0x10); /* High threshold */
+	e4k_reg_queue(e4k, E4K_REG_AGC5, 0x04);	/* Low threshold */
+	e4k_reg_queue(e4k, E4K_REG_AGC6, 0x1a);	/* LNA calib + loop rate */
 
 	e4k_reg_set_mask(e4k, E4K_REG_AGC1, E4K_AGC1_MOD_MASK,
 		E4K_AGC_MOD_SERIAL);
@@ -967,7 +1303,7 @@ int e4k_init(struct e4k_state *e4k)
 	e4k_reg_set_mask(e4k, E4K_REG_DCTIME1, 0x03, 0);
 	e4k_reg_set_mask(e4k, E4K_REG_DCTIME2, 0x03, 0);
 
-	return 0;
+	return e4k_flush(e4k);
 }
 
 int e4k_dump(struct e4k_state *e4k)
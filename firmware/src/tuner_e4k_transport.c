@@ -20,38 +20,128 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 
 #include <common.h>
 #include <logging.h>
 #include <tuner_e4k.h>
 
-//#include <twi/twi.h>
-#include <twi/twid.h>
 #include <pio/pio.h>
 #include <board.h>
+#include <irq/irq.h>
 
+#include <osdr_twi.h>
 
-int e4k_reg_write(struct e4k_state *e4k, uint8_t reg, uint8_t val)
+/* Register writes are queued on the TWI and the caller continues right
+ * away.  Reads are queued behind them and waited for, so they always see
+ * the result of all previous writes.  Each pending write needs a slot
+ * holding a copy of its data.  Failed writes are remembered until
+ * e4k_reg_write_errors() picks them up. */
+#define E4K_WR_SLOTS	8
+#define E4K_WR_MAX	16
+
+struct e4k_wr_slot {
+	struct twi_xfer xfer;
+	uint8_t buf[E4K_WR_MAX];
+};
+
+static struct e4k_wr_slot wr_slots[E4K_WR_SLOTS];
+static unsigned int wr_next;
+
+/* called from IRQ context */
+static void e4k_wr_compl(struct twi_xfer *xfer)
 {
-	unsigned char rc;
+	struct e4k_state *e4k = xfer->cb_data;
+	unsigned int reg;
+
+	if (xfer->status < 0) {
+		for (reg = xfer->iaddr; reg < xfer->iaddr + xfer->len; reg++)
+			e4k->wr_failed[reg >> 5] |= 1 << (reg & 31);
+		e4k->wr_error = xfer->status;
+		e4k->stats.errors++;
+		LOGP(DTUN, LOGL_ERROR, "Error %d writing reg 0x%02x\n",
+		     xfer->status, xfer->iaddr);
+	}
+}
 
-	rc = TWID_Write(e4k->i2c_dev, e4k->i2c_addr, reg, 1, &val, 1, NULL);
-	if (rc != 0) {
-		LOGP(DTUN, LOGL_ERROR, "Error %u in TWID_Write\n", rc);
-		return -EIO;
+/* write consecutive registers in one transaction, the E4K increments the
+ * register address after each byte */
+int e4k_reg_write_burst(struct e4k_state *e4k, uint8_t reg,
+			const uint8_t *buf, unsigned int len)
+{
+	struct e4k_wr_slot *slot;
+	unsigned int chunk;
+	int rc;
+
+	while (len) {
+		chunk = len > E4K_WR_MAX ? E4K_WR_MAX : len;
+
+		/* wait for the oldest write if all slots are in use */
+		slot = &wr_slots[wr_next++ % E4K_WR_SLOTS];
+		osdr_twi_wait(&slot->xfer);
+
+		memcpy(slot->buf, buf, chunk);
+		slot->xfer.addr = e4k->i2c_addr;
+		slot->xfer.dir = TWI_XFER_WRITE;
+		slot->xfer.iaddr = reg;
+		slot->xfer.iaddr_len = 1;
+		slot->xfer.data = slot->buf;
+		slot->xfer.len = chunk;
+		slot->xfer.cb = e4k_wr_compl;
+		slot->xfer.cb_data = e4k;
+		slot->xfer.batch = NULL;
+
+		e4k->stats.writes++;
+		e4k->stats.bytes += chunk;
+
+		rc = osdr_twi_submit(e4k->i2c_dev, &slot->xfer);
+		if (rc < 0)
+			return rc;
+
+		reg += chunk;
+		buf += chunk;
+		len -= chunk;
 	}
 
 	return 0;
 }
 
-uint8_t e4k_reg_read(struct e4k_state *e4k, uint8_t reg)
+int e4k_reg_write(struct e4k_state *e4k, uint8_t reg, uint8_t val)
+{
+	return e4k_reg_write_burst(e4k, reg, &val, 1);
+}
+
+/* fetch and clear the errors of the writes completed so far, the
+ * registers whose write failed are ORed into failed */
+int e4k_reg_write_errors(struct e4k_state *e4k, uint32_t *failed)
+{
+	unsigned int i;
+	int rc;
+
+	IRQ_DisableIT(AT91C_ID_TWI0);
+	for (i = 0; i < ARRAY_SIZE(e4k->wr_failed); i++) {
+		failed[i] |= e4k->wr_failed[i];
+		e4k->wr_failed[i] = 0;
+	}
+	rc = e4k->wr_error;
+	e4k->wr_error = 0;
+	IRQ_EnableIT(AT91C_ID_TWI0);
+
+	return rc;
+}
+
+int e4k_reg_read(struct e4k_state *e4k, uint8_t reg)
 {
-	unsigned char rc;
+	int rc;
 	uint8_t val;
 
-	rc = TWID_Read(e4k->i2c_dev, e4k->i2c_addr, reg, 1, &val, 1, NULL);
-	if (rc != 0) {
-		LOGP(DTUN, LOGL_ERROR, "Error %u in TWID_Read\n", rc);
+	e4k->stats.reads++;
+
+	rc = osdr_twi_read(e4k->i2c_dev, e4k->i2c_addr, reg, &val, 1);
+	if (rc < 0) {
+		e4k->stats.errors++;
+		LOGP(DTUN, LOGL_ERROR, "Error %d reading reg 0x%02x\n",
+		     rc, reg);
 		return -EIO;
 	}
 
@@ -59,7 +149,7 @@ uint8_t e4k_reg_read(struct e4k_state *e4k, uint8_t reg)
 }
 
 
-/* We assume the caller has already done TWID_initialize() */
+/* We assume the caller has already done osdr_twi_init() */
 int sam3u_e4k_init(struct e4k_state *e4k, void *i2c, uint8_t slave_addr)
 {
 	e4k->i2c_dev = i2c;
@@ -77,6 +167,9 @@ static const Pin pin_pwdn = PIN_PDWN;
  */
 void sam3u_e4k_power(struct e4k_state *e4k, int on)
 {
+	/* the register contents are lost while the chip is powered down */
+	e4k_cache_invalidate(e4k);
+
 	if (on)
 		PIO_Set(&pin_pwdn);
 	else
@@ -6,15 +6,23 @@
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include <common.h>
 #include <tuner_e4k.h>
 
 
+/* suppress the output of the stubs while benchmarking */
+static int quiet;
+
 void logp2(int subsys, unsigned int level, char *file,
 	   int line, int cont, const char *format, ...)
 {
 	va_list ap;
+
+	if (quiet)
+		return;
+
 	fprintf(stderr, "%u/%u/%s:%u: ", subsys, level, file, line);
 
 	va_start(ap, format);
@@ -28,9 +36,10 @@ static uint8_t regs[0x7f];
 /* stub functions for register read/write */
 int e4k_reg_write(struct e4k_state *e4k, uint8_t reg, uint8_t val)
 {
-	printf("REG WRITE: [0x%02x] = 0x%02x\n", reg, val);
+	if (!quiet)
+		printf("REG WRITE: [0x%02x] = 0x%02x\n", reg, val);
 
-	if (reg > ARRAY_SIZE(regs))
+	if (reg >= ARRAY_SIZE(regs))
 		return -ERANGE;
 
 	regs[reg] = val;
@@ -38,12 +47,53 @@ int e4k_reg_write(struct e4k_state *e4k, uint8_t reg, uint8_t val)
 	return 0;
 }
 
+/* register whose writes get NACKed, like the transport reports them */
+static int fail_reg = -1;
+
+int e4k_reg_write_burst(struct e4k_state *e4k, uint8_t reg,
+			const uint8_t *buf, unsigned int len)
+{
+	unsigned int i;
+	int rc;
+
+	if (fail_reg >= reg && fail_reg < reg + len) {
+		for (i = reg; i < reg + len; i++)
+			e4k->wr_failed[i >> 5] |= 1 << (i & 31);
+		e4k->wr_error = -EIO;
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		rc = e4k_reg_write(e4k, reg + i, buf[i]);
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+int e4k_reg_write_errors(struct e4k_state *e4k, uint32_t *failed)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < ARRAY_SIZE(e4k->wr_failed); i++) {
+		failed[i] |= e4k->wr_failed[i];
+		e4k->wr_failed[i] = 0;
+	}
+	rc = e4k->wr_error;
+	e4k->wr_error = 0;
+
+	return rc;
+}
+
 int e4k_reg_read(struct e4k_state *e4k, uint8_t reg)
 {
-	if (reg > ARRAY_SIZE(regs))
+	if (reg >= ARRAY_SIZE(regs))
 		return -ERANGE;
 
-	printf("REG READ:  [0x%02x] = 0x%02x\n", reg, regs[reg]);
+	if (!quiet)
+		printf("REG READ:  [0x%02x] = 0x%02x\n", reg, regs[reg]);
 
 	return regs[reg];
 }
@@ -81,14 +131,269 @@ static const uint32_t test_freqs[] = {
 };
 	//1234567890
 
-int main(int argc, char **argv)
+/* the PLL computation as it was before the fixed-point rework, used as
+ * reference for correctness and speed */
+#define REF_PLL_Y	65536
+
+static const struct {
+	uint32_t freq;
+	uint8_t reg_synth7;
+	uint8_t mult;
+} ref_pll_vars[] = {
+	{72400000,	(1 << 3) | 7,	48},
+	{81200000,	(1 << 3) | 6,	40},
+	{108300000,	(1 << 3) | 5,	32},
+	{162500000,	(1 << 3) | 4,	24},
+	{216600000,	(1 << 3) | 3,	16},
+	{325000000,	(1 << 3) | 2,	12},
+	{350000000,	(1 << 3) | 1,	8},
+	{432000000,	(0 << 3) | 3,	8},
+	{667000000,	(0 << 3) | 2,	6},
+	{1200000000,	(0 << 3) | 1,	4}
+};
+
+static uint64_t native_div64(uint64_t n, uint64_t d)
+{
+	return n / d;
+}
+
+/* shift and subtract division, the Cortex-M3 has no 64bit divide
+ * instruction and libgcc does something very similar */
+static uint64_t soft_div64(uint64_t n, uint64_t d)
+{
+	uint64_t q = 0;
+	int shift;
+
+	if (n < d)
+		return 0;
+
+	shift = __builtin_clzll(d) - __builtin_clzll(n);
+	d <<= shift;
+	for (; shift >= 0; shift--) {
+		q <<= 1;
+		if (n >= d) {
+			n -= d;
+			q |= 1;
+		}
+		d >>= 1;
+	}
+
+	return q;
+}
+
+static uint64_t (*ref_div64)(uint64_t n, uint64_t d) = native_div64;
+
+static uint32_t ref_compute_pll_params(struct e4k_pll_params *oscp,
+				       uint32_t fosc, uint32_t intended_flo)
+{
+	uint32_t i;
+	uint8_t r = 2;
+	uint64_t intended_fvco, remainder, fvco;
+	uint64_t z = 0;
+	uint32_t x;
+
+	oscp->r_idx = 0;
+	for (i = 0; i < ARRAY_SIZE(ref_pll_vars); ++i) {
+		if (intended_flo < ref_pll_vars[i].freq) {
+			oscp->r_idx = ref_pll_vars[i].reg_synth7;
+			r = ref_pll_vars[i].mult;
+			break;
+		}
+	}
+
+	intended_fvco = (uint64_t)intended_flo * r;
+	z = ref_div64(intended_fvco, fosc);
+	remainder = intended_fvco - (fosc * z);
+	x = ref_div64(remainder * REF_PLL_Y, fosc);
+
+	/* Z is truncated to 8 bits, just like compute_flo() does */
+	fvco = (uint64_t)fosc * (uint8_t)z + ((uint64_t)fosc * x) / REF_PLL_Y;
+
+	oscp->flo = ref_div64(fvco, r);
+	oscp->r = r;
+	oscp->x = x;
+	oscp->z = z;
+
+	return oscp->flo;
+}
+
+static const uint32_t fosc_list[] = {
+	16000000, 26000000, 28800000, 30000000
+};
+
+static int check_pll_params(void)
+{
+	struct e4k_pll_params p, ref;
+	uint32_t flo;
+	int i, errors = 0;
+
+	for (i = 0; i < ARRAY_SIZE(fosc_list); i++) {
+		for (flo = 50000000; flo < 2200000000U; flo += 99991) {
+			e4k_compute_pll_params(&p, fosc_list[i], flo);
+			ref_compute_pll_params(&ref, fosc_list[i], flo);
+			if (p.flo != ref.flo || p.z != ref.z || p.x != ref.x ||
+			    p.r != ref.r || p.r_idx != ref.r_idx) {
+				if (errors++ < 10)
+					printf("mismatch fosc=%u flo=%u: "
+					       "%u/%u/%u vs %u/%u/%u\n",
+					       fosc_list[i], flo, p.z, p.x,
+					       p.flo, ref.z, ref.x, ref.flo);
+			}
+		}
+	}
+
+	return errors;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_ITER	2000000
+
+static void bench_pll_params(void)
+{
+	struct e4k_pll_params p;
+	volatile uint32_t sink = 0;
+	double t, t_ref, t_soft, t_new;
+	uint32_t i, flo;
+
+	t = now();
+	for (i = 0, flo = 50000000; i < BENCH_ITER; i++, flo += 997)
+		sink += ref_compute_pll_params(&p, 26000000, flo);
+	t_ref = now() - t;
+
+	ref_div64 = soft_div64;
+	t = now();
+	for (i = 0, flo = 50000000; i < BENCH_ITER; i++, flo += 997)
+		sink += ref_compute_pll_params(&p, 26000000, flo);
+	t_soft = now() - t;
+	ref_div64 = native_div64;
+
+	t = now();
+	for (i = 0, flo = 50000000; i < BENCH_ITER; i++, flo += 997)
+		sink += e4k_compute_pll_params(&p, 26000000, flo);
+	t_new = now() - t;
+
+	printf("PLL computation: reference %.1f ns (%.1f ns with software "
+		"64bit division), fixed-point %.1f ns\n",
+		t_ref * 1e9 / BENCH_ITER, t_soft * 1e9 / BENCH_ITER,
+		t_new * 1e9 / BENCH_ITER);
+}
+
+static const uint32_t hop_freqs[] = {
+	433920000, 868300000, 145500000, 1575420000
+};
+
+static void bench_pll_cache(void)
 {
 	int i;
 
+	g_e4k.vco.fosc = FOSC;
+	for (i = 0; i < 1000; i++)
+		e4k_tune_freq(&g_e4k, hop_freqs[i % ARRAY_SIZE(hop_freqs)]);
+
+	printf("PLL cache: %u hits, %u misses\n",
+		g_e4k.pll_cache_hits, g_e4k.pll_cache_misses);
+}
+
+/* a precomputed hop has to leave the tuner in the same state as tuning */
+static int check_hops(void)
+{
+	struct e4k_hop hops[ARRAY_SIZE(hop_freqs)];
+	uint8_t tuned[ARRAY_SIZE(regs)];
+	int i, errors = 0;
+
+	g_e4k.vco.fosc = FOSC;
+	for (i = 0; i < ARRAY_SIZE(hop_freqs); i++) {
+		if (e4k_hop_prepare(&g_e4k, &hops[i], hop_freqs[i],
+				    E4K_HOP_GAIN_KEEP) < 0)
+			errors++;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(hop_freqs); i++) {
+		e4k_tune_freq(&g_e4k, hop_freqs[i]);
+		memcpy(tuned, regs, sizeof(regs));
+
+		/* somewhere else first, so every register has to change */
+		e4k_tune_freq(&g_e4k, hop_freqs[(i + 1) % ARRAY_SIZE(hop_freqs)]);
+		e4k_hop_apply(&g_e4k, &hops[i]);
+
+		if (memcmp(tuned, regs, sizeof(regs))) {
+			printf("hop to %u differs from tuning\n", hop_freqs[i]);
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+/* a failed write has to be reported and must not stay in the cache.  The
+ * RF filter is a read-modify-write, which the cache skips if it believes
+ * the register already holds the value */
+static int check_write_errors(void)
+{
+	uint8_t ref[ARRAY_SIZE(regs)];
+	int i = E4K_REG_FILT1, errors = 0;
+
+	e4k_tune_freq(&g_e4k, 450000000);
+	memcpy(ref, regs, sizeof(regs));
+	e4k_tune_freq(&g_e4k, 100000000);
+	if (ref[i] == regs[i])
+		return 1;
+
+	fail_reg = i;
+	if (e4k_tune_freq(&g_e4k, 450000000) != -EIO) {
+		printf("failed write to 0x%02x not reported\n", i);
+		errors++;
+	}
+	fail_reg = -1;
+
+	if (e4k_check_errors(&g_e4k) != 0) {
+		printf("write error reported twice\n");
+		errors++;
+	}
+
+	/* the cache must not believe the chip took the value */
+	e4k_tune_freq(&g_e4k, 450000000);
+	if (memcmp(ref, regs, sizeof(regs))) {
+		printf("failed write to 0x%02x not retried\n", i);
+		errors++;
+	}
+
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	int i, errors;
+
 	printf("Initializing....\n");
 	e4k_init(&g_e4k);
 
 	for (i = 0; i < ARRAY_SIZE(test_freqs); i++) {
 		compute_and_dump(test_freqs[i]);
 	}
+
+	quiet = 1;
+
+	errors = check_pll_params();
+	printf("PLL parameters: %d mismatches\n", errors);
+
+	bench_pll_params();
+	bench_pll_cache();
+
+	i = check_hops();
+	printf("Hop table: %d mismatches\n", i);
+	errors += i;
+
+	i = check_write_errors();
+	printf("Write errors: %d mismatches\n", i);
+	errors += i;
+
+	return errors ? 1 : 0;
 }
@@ -140,6 +140,91 @@ OSMOSDR_API int osmosdr_set_tuner_mixer_enh(osmosdr_dev_t *dev, int enh);
 /* set IF stages gain */
 OSMOSDR_API int osmosdr_set_tuner_if_gain(osmosdr_dev_t *dev, int stage, int gain);
 
+/*!
+ * Enable or disable the software AGC.
+ *
+ * While streaming asynchronously, the clipping ratio and a histogram of the
+ * signal level are computed for the received samples, and the LNA, mixer
+ * and IF stage 2/3 gains are adjusted step by step to keep the level close
+ * to the target. Gain changes are rate limited and applied without blocking
+ * the stream. Enabling the AGC switches the tuner to manual gain mode.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param on 1 enables the AGC, 0 disables it
+ * \param target signal level in tenths of a dBFS, 0 for the default (-18 dBFS)
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_set_agc(osmosdr_dev_t *dev, int on, int target);
+
+/*!
+ * Get the gain the buffer currently passed to the read callback was
+ * received with. Only valid when called from within the callback.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param gain overall gain in tenths of a dB, may be NULL
+ * \return <0 on error, 1 if the AGC changed the gain with this buffer,
+ *	    so part of it may have been received with the previous gain,
+ *	    0 otherwise
+ */
+OSMOSDR_API int osmosdr_get_buffer_gain(osmosdr_dev_t *dev, int *gain);
+
+#define OSMOSDR_HOP_TABLE_MAX	64	/* entries the device can hold */
+#define OSMOSDR_HOP_NEXT	-1	/* index argument of osmosdr_hop() */
+
+/*!
+ * Upload a frequency hop table to the device. The device precomputes the
+ * tuner settings of every entry, so that a hop costs a single control
+ * request and just the tuner register writes. The previous table and its
+ * position are discarded.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param freqs frequencies in Hz
+ * \param gains LNA gain of each entry in tenths of a dB, NULL to leave
+ *	  the gain alone
+ * \param num number of entries, at most OSMOSDR_HOP_TABLE_MAX, 0 clears
+ *	  the table
+ * \return 0 on success, -EIO if an entry can't be tuned to
+ */
+OSMOSDR_API int osmosdr_set_hop_table(osmosdr_dev_t *dev,
+				      const uint32_t *freqs, const int *gains,
+				      unsigned int num);
+
+/*!
+ * Tune to an entry of the hop table. Unlike osmosdr_set_center_freq()
+ * this doesn't wait for the device to execute the hop, use
+ * osmosdr_wait_commands() to learn about failures.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param index table entry, OSMOSDR_HOP_NEXT for the one following the
+ *	  last hop
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_hop(osmosdr_dev_t *dev, int index);
+
+/*!
+ * Let the device advance through the hop table on its own while
+ * streaming. The dwell time is measured in samples and has the
+ * granularity of a USB buffer. osmosdr_get_center_freq() doesn't follow
+ * these hops, use osmosdr_get_hop_status() instead.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param samples dwell time per entry, 0 stops hopping
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_set_hop_dwell(osmosdr_dev_t *dev, uint32_t samples);
+
+/*!
+ * Get the hop table entry the device is tuned to.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param index receives the entry, -1 if there was no hop since the
+ *	  upload, may be NULL
+ * \param hops receives the number of hops so far, may be NULL
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_get_hop_status(osmosdr_dev_t *dev, int *index,
+				       uint32_t *hops);
+
 /*!
  * Get a list of sample rates supported by the device.
  *
@@ -172,6 +257,92 @@ OSMOSDR_API uint32_t osmosdr_get_sample_rate(osmosdr_dev_t *dev);
 /* this allows direct access to the FPGA register bank */
 OSMOSDR_API int osmosdr_set_fpga_reg(osmosdr_dev_t *dev, uint8_t reg, uint32_t value);
 
+/*!
+ * Read back a register of the FPGA.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param reg the register number
+ * \param value receives the register contents
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_get_fpga_reg(osmosdr_dev_t *dev, uint8_t reg,
+				     uint32_t *value);
+
+/*!
+ * Read back a register of the tuner chip.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param reg the register number
+ * \param value receives the register contents
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_get_tuner_reg(osmosdr_dev_t *dev, uint8_t reg,
+				      uint8_t *value);
+
+struct osmosdr_device_stats {
+	uint32_t ssc_xfers;		/* buffers filled by the sample DMA */
+	uint32_t ssc_irqs;
+	uint32_t ssc_overruns;		/* samples lost in the receiver */
+	uint32_t ssc_active;		/* receiver running */
+	uint32_t dma_chain_len;		/* buffers queued for the sample DMA */
+	uint32_t usb_pending;		/* buffers waiting to be sent */
+	uint32_t bufs_free;
+	uint32_t bufs_total;
+	uint32_t frame_seq;		/* see osmosdr_set_stream_framing() */
+	uint32_t sample_ctr;
+	uint32_t pll_locked;		/* tuner PLL lock */
+	uint32_t bufs_low;		/* lowest bufs_free seen */
+	uint32_t bufs_alloc_fail;	/* no buffer for the sample DMA */
+	uint32_t ssc_dropped;		/* samples dropped for lack of buffers */
+};
+
+struct osmosdr_command_status {
+	uint32_t submitted;		/* control writes accepted */
+	uint32_t completed;		/* control writes executed */
+	uint32_t errors;		/* control writes that failed */
+	uint16_t last_err_func;		/* request of the last failure */
+	int32_t last_err_res;		/* its result */
+	uint32_t last_err_seq;		/* its place, counted like submitted */
+};
+
+/*!
+ * Get the execution status of control writes. The device acknowledges
+ * writes right away and executes them from its main loop, so that slow
+ * tuner and clock programming does not disturb streaming.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param status receives the counters
+ * \return 0 on success, LIBUSB_ERROR_PIPE if the firmware executes
+ * writes synchronously
+ */
+OSMOSDR_API int osmosdr_get_command_status(osmosdr_dev_t *dev,
+				struct osmosdr_command_status *status);
+
+/*!
+ * Wait until the device has executed all control writes sent so far.
+ * osmosdr_set_center_freq() does this already.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param timeout_ms how long to wait
+ * \return 0 on success, -EIO if a write failed since the previous call,
+ * including those already reported by a synchronous setter, -ETIMEDOUT if
+ * writes are still pending
+ */
+OSMOSDR_API int osmosdr_wait_commands(osmosdr_dev_t *dev,
+				      unsigned int timeout_ms);
+
+/*!
+ * Read the health counters of the device firmware. All counters run since
+ * the device was powered up and wrap around. Safe to call while streaming,
+ * but not from the async callback.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param stats receives the counters
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_get_device_stats(osmosdr_dev_t *dev,
+					 struct osmosdr_device_stats *stats);
+
 /* more access to OsmoSDR functions */
 
 /* set decimation (0 = off, 1 = 1:2, 2 = 1:4, 3 = 1:8, ... 6 = 1:64) */
@@ -186,12 +357,152 @@ OSMOSDR_API int osmosdr_set_fpga_iq_gain(osmosdr_dev_t *dev, uint16_t igain, uin
 /* configure i and q offset correction (corrected_i = orig_i + iofs */
 OSMOSDR_API int osmosdr_set_fpga_iq_ofs(osmosdr_dev_t *dev, int16_t iofs, int16_t qofs);
 
+/*!
+ * Enable or disable the automatic DC offset and I/Q gain imbalance
+ * calibration.
+ *
+ * While streaming asynchronously, the offset and the amplitude mismatch of
+ * the I and Q channels are estimated from the received samples and corrected
+ * by programming the FPGA (see osmosdr_set_fpga_iq_gain() and
+ * osmosdr_set_fpga_iq_ofs()), so the correction itself costs no host CPU.
+ * Converged values are cached per frequency band and gain and applied right
+ * away when tuning back to a known band.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param on 1 enables the calibration, 0 disables it
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_set_iq_calibration(osmosdr_dev_t *dev, int on);
+
+/*!
+ * Get the current I/Q correction values and the calibration state.
+ *
+ * NOTE: The FPGA can only correct offset and gain. The phase imbalance is
+ * measured and reported, but not corrected.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param iofs current I offset correction, may be NULL
+ * \param qofs current Q offset correction, may be NULL
+ * \param igain current I gain correction, may be NULL
+ * \param qgain current Q gain correction, may be NULL
+ * \param phase measured phase imbalance in tenths of a degree, may be NULL
+ * \return <0 on error, 0 while converging, 1 once converged
+ */
+OSMOSDR_API int osmosdr_get_iq_calibration(osmosdr_dev_t *dev,
+					   int16_t *iofs, int16_t *qofs,
+					   uint16_t *igain, uint16_t *qgain,
+					   int *phase);
+
 /* streaming functions */
 
+enum osmosdr_buffer_profile {
+	OSMOSDR_PROFILE_NONE = 0,	/* fixed defaults, 32 x 256 KiB */
+	OSMOSDR_PROFILE_LOW_LATENCY,	/* 2 ms buffers, 40 ms read-ahead */
+	OSMOSDR_PROFILE_BALANCED,	/* 10 ms buffers, 250 ms read-ahead */
+	OSMOSDR_PROFILE_THROUGHPUT	/* 50 ms buffers, 1 s read-ahead */
+};
+
+/*!
+ * Get the transfer count and size a profile results in at the current
+ * sample rate. Useful to size the reads for osmosdr_read_sync().
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param profile one of the OSMOSDR_PROFILE_* values other than NONE
+ * \param buf_num transfer count, may be NULL
+ * \param buf_len transfer length in bytes, may be NULL
+ * \return 0 on success, -2 if no sample rate has been set
+ */
+OSMOSDR_API int osmosdr_get_profile_buffers(osmosdr_dev_t *dev,
+					    enum osmosdr_buffer_profile profile,
+					    uint32_t *buf_num, uint32_t *buf_len);
+
+/*!
+ * Select the profile used when osmosdr_read_async() or osmosdr_start_sync()
+ * are called with a buf_num or buf_len of 0. It is evaluated at that time,
+ * so set the sample rate first.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param profile one of the OSMOSDR_PROFILE_* values
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_set_buffer_profile(osmosdr_dev_t *dev,
+					   enum osmosdr_buffer_profile profile);
+
+/*!
+ * Enable or disable measuring the delivery latency. The delay of the first
+ * sample of each buffer is estimated from the sample clock, relative to the
+ * fastest delivery seen, so it includes the buffer fill time and queueing
+ * but not the constant part of the transit time. Restarting the stream
+ * resets the figures.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param on 1 to enable, 0 to disable
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_set_latency_measurement(osmosdr_dev_t *dev, int on);
+
+/*!
+ * Get the latency figures of the current stream.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param avg_us average latency in microseconds, may be NULL
+ * \param max_us maximum latency in microseconds, may be NULL
+ * \return 0 on success, -2 if the measurement is disabled
+ */
+OSMOSDR_API int osmosdr_get_latency(osmosdr_dev_t *dev, uint32_t *avg_us,
+				    uint32_t *max_us);
+
+/*!
+ * Flush stale samples queued in the device. The halt on the sample endpoint
+ * is cleared and whatever the firmware still holds is read and discarded.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \return 0 on success, -2 while transfers are in flight
+ */
 OSMOSDR_API int osmosdr_reset_buffer(osmosdr_dev_t *dev);
 
+/*!
+ * Start the read-ahead for synchronous reads. Until osmosdr_stop_sync() is
+ * called, osmosdr_read_sync() is served from a pool of bulk transfers that
+ * are kept queued in the background, instead of issuing one blocking
+ * transfer per call. Data is only received while reading, so the caller has
+ * to keep up with the sample rate.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param buf_num optional buffer count, buf_num * buf_len = read-ahead size
+ *		  set to 0 for default buffer count (32)
+ * \param buf_len optional buffer length, must be multiple of 512,
+ *		  set to 0 for default buffer length (16 * 32 * 512)
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_start_sync(osmosdr_dev_t *dev, uint32_t buf_num,
+				   uint32_t buf_len);
+
+/*!
+ * Stop the read-ahead started with osmosdr_start_sync().
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_stop_sync(osmosdr_dev_t *dev);
+
 OSMOSDR_API int osmosdr_read_sync(osmosdr_dev_t *dev, void *buf, int len, int *n_read);
 
+/*!
+ * Read samples from the device synchronously, giving up after a timeout.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param buf buffer to read the samples into
+ * \param len number of bytes to read
+ * \param n_read number of bytes actually read, may be NULL
+ * \param timeout in milliseconds, 0 waits forever
+ * \return 0 on success, LIBUSB_ERROR_TIMEOUT if the timeout expired before
+ *	    len bytes were read, other negative values on error
+ */
+OSMOSDR_API int osmosdr_read_sync_timeout(osmosdr_dev_t *dev, void *buf,
+					  int len, int *n_read,
+					  unsigned int timeout);
+
 typedef void(*osmosdr_read_async_cb_t)(unsigned char *buf, uint32_t len, void *ctx);
 
 /*!
@@ -213,6 +524,365 @@ OSMOSDR_API int osmosdr_read_async(osmosdr_dev_t *dev,
 				 uint32_t buf_num,
 				 uint32_t buf_len);
 
+#define OSMOSDR_BUF_DISCONTINUITY	(1 << 0) /* samples lost before this one */
+
+struct osmosdr_buffer_info {
+	uint64_t sample_index;	/* of the first sample, counting lost ones */
+	uint64_t arrival_us;	/* monotonic host time of the completion */
+	uint64_t sample_time_us; /* estimated host time of the first sample,
+				  * 0 until the estimator has settled */
+	uint32_t flags;		/* OSMOSDR_BUF_* */
+};
+
+typedef void(*osmosdr_read_async_ext_cb_t)(unsigned char *buf, uint32_t len,
+					   const struct osmosdr_buffer_info *info,
+					   void *ctx);
+
+/*!
+ * Same as osmosdr_read_async(), but the callback also gets the position of
+ * the buffer in the stream and its timing.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param cb callback function to return received samples
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num optional buffer count, buf_num * buf_len = overall buffer size
+ *		  set to 0 for default buffer count (32)
+ * \param buf_len optional buffer length, must be multiple of 512,
+ *		  set to 0 for default buffer length (16 * 32 * 512)
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_read_async_ext(osmosdr_dev_t *dev,
+				       osmosdr_read_async_ext_cb_t cb,
+				       void *ctx,
+				       uint32_t buf_num,
+				       uint32_t buf_len);
+
+/*!
+ * Start reading samples asynchronously without blocking. The callback is
+ * invoked from osmosdr_handle_events_nonblocking(), so the caller's event
+ * loop drives the stream. Stop it with osmosdr_cancel_async() and keep
+ * handling events until osmosdr_handle_events_nonblocking() has returned the
+ * device to the idle state, or close the device.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param cb callback function to return received samples
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num optional buffer count, buf_num * buf_len = overall buffer size
+ *		  set to 0 for default buffer count (32)
+ * \param buf_len optional buffer length, must be multiple of 512,
+ *		  set to 0 for default buffer length (16 * 32 * 512)
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_start_async(osmosdr_dev_t *dev,
+				    osmosdr_read_async_cb_t cb,
+				    void *ctx,
+				    uint32_t buf_num,
+				    uint32_t buf_len);
+
+/*!
+ * Same as osmosdr_start_async(), with the callback of osmosdr_read_async_ext().
+ */
+OSMOSDR_API int osmosdr_start_async_ext(osmosdr_dev_t *dev,
+					osmosdr_read_async_ext_cb_t cb,
+					void *ctx,
+					uint32_t buf_num,
+					uint32_t buf_len);
+
+struct osmosdr_timing_stats {
+	uint64_t samples;	/* received so far, counting lost ones */
+	int32_t clock_ppm;	/* sample clock against the host clock */
+	uint32_t jitter_rms_us;	/* arrival delay beyond the earliest one */
+	uint32_t jitter_max_us;
+};
+
+/*!
+ * Map a sample index to monotonic host time (CLOCK_MONOTONIC on POSIX).
+ * Every completed transfer is timestamped, and a line is fitted through the
+ * earliest arrivals of the last 64 buffers. The result therefore includes
+ * the constant part of the transfer delay. The estimate restarts after
+ * discontinuities.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param index sample index as in struct osmosdr_buffer_info
+ * \param time_us estimated host time in microseconds
+ * \return 0 on success, -2 while the estimator has not settled
+ */
+OSMOSDR_API int osmosdr_get_sample_time(osmosdr_dev_t *dev, uint64_t index,
+					uint64_t *time_us);
+
+/*!
+ * Get the state of the sample to host time estimator.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param stats receives the figures
+ * \return 0 on success, -2 while the estimator has not settled (only the
+ *	    sample count is valid then)
+ */
+OSMOSDR_API int osmosdr_get_timing_stats(osmosdr_dev_t *dev,
+					 struct osmosdr_timing_stats *stats);
+
+/*!
+ * Get the sample index of the next sample osmosdr_read_sync() will return,
+ * while the read-ahead is running.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param index sample index as used by osmosdr_get_sample_time()
+ * \return 0 on success, -2 without osmosdr_start_sync()
+ */
+OSMOSDR_API int osmosdr_get_read_position(osmosdr_dev_t *dev, uint64_t *index);
+
+typedef struct osmosdr_pollfd {
+	int fd;
+	short events; /* POLLIN / POLLOUT as for poll(2) */
+} osmosdr_pollfd_t;
+
+/*!
+ * Get the file descriptors to watch for the device's USB events and the
+ * time until libusb needs to handle a timeout, for use with poll or epoll.
+ * Each device has its own libusb context, so several devices may be
+ * serviced from the same loop.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param fds array receiving the descriptors, may be NULL
+ * \param max number of elements in fds
+ * \param timeout milliseconds until osmosdr_handle_events_nonblocking()
+ *		  has to be called regardless of activity, -1 if none pending,
+ *		  may be NULL
+ * \return number of descriptors (may exceed max), -ENOTSUP if the platform
+ *	    has no pollable descriptors
+ */
+OSMOSDR_API int osmosdr_get_pollfds(osmosdr_dev_t *dev, osmosdr_pollfd_t *fds,
+				    int max, int *timeout);
+
+typedef void(*osmosdr_pollfd_added_cb_t)(int fd, short events, void *ctx);
+typedef void(*osmosdr_pollfd_removed_cb_t)(int fd, void *ctx);
+
+/*!
+ * Get notified when the set of descriptors from osmosdr_get_pollfds()
+ * changes. Pass NULL for both callbacks to remove the notifiers.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param added called for each descriptor that needs to be watched
+ * \param removed called for each descriptor no longer in use
+ * \param ctx user specific context to pass via the callback functions
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_set_pollfd_notifiers(osmosdr_dev_t *dev,
+					     osmosdr_pollfd_added_cb_t added,
+					     osmosdr_pollfd_removed_cb_t removed,
+					     void *ctx);
+
+/*!
+ * Handle pending USB events of the device without blocking. Sample
+ * callbacks are invoked from within this call.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \return 0 on success, -ENOMEM if streaming stopped because a reopened
+ * device got no transfer buffers
+ */
+OSMOSDR_API int osmosdr_handle_events_nonblocking(osmosdr_dev_t *dev);
+
+#define OSMOSDR_INTEGRITY_EVENTS	16
+
+struct osmosdr_integrity_stats {
+	uint64_t samples;		/* I/Q pairs checked */
+	uint64_t dropped;		/* I/Q pairs missing, modulo 65536 per gap */
+	uint64_t discontinuities;
+	uint64_t corrupt;		/* pairs not following the pattern */
+	uint32_t num_events;		/* total, the last ones are kept below */
+	struct {
+		uint64_t pos;		/* I/Q pairs since the check started */
+		uint32_t lost;
+	} events[OSMOSDR_INTEGRITY_EVENTS]; /* index num_events % size */
+};
+
+/*!
+ * Enable or disable the stream integrity check. The FPGA is put into test
+ * mode, where it sends a decrementing counter on I and an incrementing one
+ * on Q instead of samples, and every received buffer is checked for gaps
+ * in the sequence. IQ calibration and the software AGC are switched off.
+ * Must not be called from the async callback.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param on 1 to enable, 0 to return to normal samples
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_set_integrity_check(osmosdr_dev_t *dev, int on);
+
+/*!
+ * Get the results of the stream integrity check.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param stats receives the counters and the most recent discontinuities
+ * \return 0 on success, -2 if the check is disabled
+ */
+OSMOSDR_API int osmosdr_get_integrity_stats(osmosdr_dev_t *dev,
+				struct osmosdr_integrity_stats *stats);
+
+enum osmosdr_event_type {
+	OSMOSDR_EVENT_DISCONTINUITY = 0, /* samples were lost in the stream */
+	OSMOSDR_EVENT_DEVICE_LOST,	/* the device dropped off the bus */
+	OSMOSDR_EVENT_DEVICE_RESTORED,	/* reopened, settings restored */
+	OSMOSDR_EVENT_OVERRUN,		/* SSC overruns reported in-band */
+	OSMOSDR_EVENT_TIMED_COMMAND	/* a timed command was executed */
+};
+
+typedef void(*osmosdr_event_cb_t)(osmosdr_dev_t *dev,
+				  enum osmosdr_event_type type,
+				  uint64_t samples, void *ctx);
+
+/*!
+ * Register a callback for stream events. Failed transfers are resubmitted
+ * with an increasing delay. If that keeps failing, or the device drops off
+ * the bus, it is looked up again by serial number (by its USB port if it
+ * has none), reopened, set up with the last sample rate, frequency, gain
+ * and FPGA correction, and streaming resumes. If the transfer buffers can't
+ * be allocated again, osmosdr_read_async() returns -ENOMEM. A DISCONTINUITY event carrying the (estimated) number of lost
+ * samples, or 0 if that is unknown, precedes the first buffer delivered
+ * after such a gap. With stream framing, OVERRUN events carry the number of
+ * overruns the device reported since the previous frame, and TIMED_COMMAND
+ * events the device sample counter at which a timed command completed, see
+ * osmosdr_get_timed_command(). Events are
+ * invoked from the same context as the sample callback.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param cb callback function, NULL to remove it
+ * \param ctx user specific context to pass via the callback function
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_set_event_callback(osmosdr_dev_t *dev,
+					   osmosdr_event_cb_t cb, void *ctx);
+
+struct osmosdr_framing_stats {
+	uint64_t frames;		/* headers seen */
+	uint64_t lost;			/* samples missing going by the counter */
+	uint64_t seq_errors;		/* frames missing going by the sequence */
+	uint64_t restarts;		/* receiver restarts, unknown loss */
+	uint64_t overruns;		/* receiver overruns in the device */
+	uint64_t resyncs;		/* bad headers, rest of transfer dropped */
+};
+
+/*!
+ * Enable or disable in-band stream framing. The device then starts every
+ * sample buffer with a small header carrying a sequence number, a sample
+ * counter, its overrun count and the last timed command. The library strips the headers before the
+ * samples are handed out and turns jumps in the counters into events, see
+ * osmosdr_set_event_callback(). Buffer lengths that are a multiple of 1024
+ * bytes keep the frames aligned to the transfers. Must not be called while
+ * streaming.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param on 1 to enable, 0 to receive plain samples
+ * \return 0 on success, -2 while streaming
+ */
+OSMOSDR_API int osmosdr_set_stream_framing(osmosdr_dev_t *dev, int on);
+
+/*!
+ * Get the stream framing statistics.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param stats receives the counters
+ * \return 0 on success, -2 if framing is disabled
+ */
+OSMOSDR_API int osmosdr_get_framing_stats(osmosdr_dev_t *dev,
+				struct osmosdr_framing_stats *stats);
+
+#define OSMOSDR_SWEEP_MAX_STEPS		256
+#define OSMOSDR_SWEEP_UNLOCKED		0xffffffff
+
+/*!
+ * Measure the power over a range of frequencies on the device. The firmware
+ * steps the tuner itself, waits for the PLL to lock, skips the settle
+ * samples and averages I^2+Q^2 over the following ones, without sending
+ * any samples to the host meanwhile. Must not be called while streaming.
+ * The tuner is set back to the previous center frequency afterwards.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param start frequency of the first step in Hz
+ * \param step frequency increment in Hz
+ * \param count number of steps, at most OSMOSDR_SWEEP_MAX_STEPS
+ * \param settle samples to skip after each retune
+ * \param samples samples to average per step
+ * \param power receives the mean I^2+Q^2 of each step in ADC units,
+ *	  OSMOSDR_SWEEP_UNLOCKED where the PLL didn't lock
+ * \return 0 on success, -ETIMEDOUT if the sweep didn't finish in time
+ */
+OSMOSDR_API int osmosdr_power_sweep(osmosdr_dev_t *dev, uint32_t start,
+				    uint32_t step, unsigned int count,
+				    uint32_t settle, uint32_t samples,
+				    uint32_t *power);
+
+/*!
+ * Get the device sample counter of the first sample of the buffer currently
+ * passed to the read callback. Timed commands are scheduled in terms of this
+ * counter, which counts the samples the device dropped as well. Only valid
+ * when called from within the callback, with stream framing enabled.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param ctr receives the counter
+ * \return 0 on success, -2 without framing or outside the callback
+ */
+OSMOSDR_API int osmosdr_get_buffer_sample_ctr(osmosdr_dev_t *dev,
+					      uint32_t *ctr);
+
+/*!
+ * Retune once the stream reaches a given sample. The device keeps up to 8
+ * timed commands and executes each as soon as its sample counter passes the
+ * target, then reports the counter at completion in-band, see
+ * OSMOSDR_EVENT_TIMED_COMMAND. The samples in between are the ones to
+ * discard. Safe to call from the read callback, failures show up with
+ * osmosdr_wait_commands(). osmosdr_get_center_freq() doesn't follow timed
+ * retuning.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param at device sample counter, see osmosdr_get_buffer_sample_ctr()
+ * \param freq frequency in Hz
+ * \param tag reported back along with the completion
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_schedule_center_freq(osmosdr_dev_t *dev, uint32_t at,
+					     uint32_t freq, uint16_t tag);
+
+/*!
+ * Hop through the hop table once the stream reaches a given sample, see
+ * osmosdr_schedule_center_freq() and osmosdr_hop().
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param at device sample counter, see osmosdr_get_buffer_sample_ctr()
+ * \param index table entry or OSMOSDR_HOP_NEXT
+ * \param tag reported back along with the completion
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_schedule_hop(osmosdr_dev_t *dev, uint32_t at,
+				     int index, uint16_t tag);
+
+/*!
+ * Change the LNA gain once the stream reaches a given sample, see
+ * osmosdr_schedule_center_freq().
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param at device sample counter, see osmosdr_get_buffer_sample_ctr()
+ * \param gain LNA gain in tenths of a dB
+ * \param tag reported back along with the completion
+ * \return 0 on success
+ */
+OSMOSDR_API int osmosdr_schedule_tuner_lna_gain(osmosdr_dev_t *dev,
+						uint32_t at, int gain,
+						uint16_t tag);
+
+/*!
+ * Get the last timed command the device reported as completed. If several
+ * complete within one frame, only the last one is reported.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \param tag receives the tag given when scheduling, may be NULL
+ * \param ctr receives the device sample counter at its completion, may
+ *	  be NULL
+ * \return 0 on success, -2 without framing or if none was reported yet
+ */
+OSMOSDR_API int osmosdr_get_timed_command(osmosdr_dev_t *dev, uint16_t *tag,
+					  uint32_t *ctr);
+
 /*!
  * Cancel all pending asynchronous operations on the device.
  *
@@ -221,6 +891,29 @@ OSMOSDR_API int osmosdr_read_async(osmosdr_dev_t *dev,
  */
 OSMOSDR_API int osmosdr_cancel_async(osmosdr_dev_t *dev);
 
+/*!
+ * Pause streaming started with osmosdr_read_async() or osmosdr_start_sync()
+ * without releasing the transfer buffers, e.g. to retune. All transfers are
+ * cancelled and data arriving afterwards is dropped. osmosdr_read_async()
+ * keeps blocking until canceled. May be called from the async callback.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \return 0 on success, -2 if not streaming or already paused
+ */
+OSMOSDR_API int osmosdr_pause(osmosdr_dev_t *dev);
+
+/*!
+ * Resume streaming paused with osmosdr_pause(). Only requests the resume, the
+ * thread handling the events (osmosdr_read_async(), osmosdr_read_sync() or
+ * osmosdr_handle_events_nonblocking()) flushes the samples queued in the
+ * device while paused and resubmits the transfers once the cancelled ones
+ * are back. May be called from any thread, including the async callback.
+ *
+ * \param dev the device handle given by osmosdr_open()
+ * \return 0 on success, -2 if not paused
+ */
+OSMOSDR_API int osmosdr_resume(osmosdr_dev_t *dev);
+
 #ifdef __cplusplus
 }
 #endif
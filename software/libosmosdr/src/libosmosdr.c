@@ -22,8 +22,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#ifndef _WIN32
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
 #include <unistd.h>
+#include <sys/mman.h>
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
@@ -35,6 +39,19 @@
 #include <unistd.h>
 #endif
 
+/* counters shared between the event thread and the caller's thread */
+#ifdef _MSC_VER
+#define atomic_inc(p)		InterlockedIncrement((volatile LONG *)(p))
+#define atomic_dec(p)		InterlockedDecrement((volatile LONG *)(p))
+#define atomic_get(p)		InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define atomic_xchg(p, v)	InterlockedExchange((volatile LONG *)(p), (v))
+#else
+#define atomic_inc(p)		__sync_add_and_fetch((p), 1)
+#define atomic_dec(p)		__sync_sub_and_fetch((p), 1)
+#define atomic_get(p)		__sync_fetch_and_add((p), 0)
+#define atomic_xchg(p, v)	__sync_lock_test_and_set((p), (v))
+#endif
+
 #include <libusb.h>
 
 /*
@@ -47,6 +64,10 @@
 #define LIBUSB_CALL
 #endif
 
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
 #include "osmosdr.h"
 
 typedef struct osmosdr_tuner {
@@ -65,16 +86,189 @@ enum osmosdr_async_status {
 	OSMOSDR_RUNNING
 };
 
+enum osmosdr_recovery_state {
+	OSMOSDR_RECOVERY_NONE = 0,
+	OSMOSDR_RECOVERY_RETRY,	/* transfers waiting to be resubmitted */
+	OSMOSDR_RECOVERY_LOST,	/* device gone, waiting for it to return */
+	OSMOSDR_RECOVERY_FAILED	/* reopened, but no buffers to stream into */
+};
+
+#define USB_PATH_MAX		8	/* bus number and up to 7 ports */
+
+enum osmosdr_pool_type {
+	OSMOSDR_POOL_NONE = 0,
+	OSMOSDR_POOL_DEVMEM,	/* usbfs mapping, no copy in the kernel */
+	OSMOSDR_POOL_MMAP,	/* anonymous mapping, huge pages if possible */
+	OSMOSDR_POOL_HEAP
+};
+
+#define IQ_CAL_CACHE_SIZE	32
+#define IQ_CAL_FREQ_STEP	10000000	/* Hz per cached frequency band */
+#define IQ_CAL_BLOCK_LEN	(1 << 18)	/* samples per estimate */
+#define IQ_CAL_DC_TOL		1.0		/* LSB */
+#define IQ_CAL_GAIN_TOL		0.001		/* relative I/Q amplitude error */
+#define IQ_CAL_UNITY_GAIN	32768
+
+struct iq_cal_entry {
+	int valid;
+	uint32_t band; /* frequency / IQ_CAL_FREQ_STEP */
+	int gain; /* tenths of a dB */
+	uint32_t stamp; /* for LRU replacement */
+	int16_t iofs, qofs;
+	uint16_t igain, qgain;
+};
+
+struct iq_cal_state {
+	int enabled;
+	volatile int restart; /* set on retune or gain change */
+	int converged;
+	uint32_t skip; /* bytes to drop after a correction update */
+	/* accumulated moments of the current block */
+	uint32_t n;
+	int64_t si, sq, sii, sqq, siq;
+	int phase; /* measured phase imbalance, tenths of a degree */
+	uint32_t stamp;
+	struct iq_cal_entry cache[IQ_CAL_CACHE_SIZE];
+};
+
+#define AGC_BLOCK_LEN		256	/* samples per histogram entry */
+#define AGC_MEASURE_LEN		(64 * AGC_BLOCK_LEN)
+#define AGC_HIST_BINS		32	/* 3 dB each, 0 dBFS downwards */
+#define AGC_CLIP_LEVEL		32000
+#define AGC_CLIP_MAX		10000	/* max. one clipped value in 10000 */
+#define AGC_PERCENTILE		10	/* level exceeded by 10% of the blocks */
+#define AGC_HYSTERESIS		30	/* tenths of a dB */
+#define AGC_DEF_TARGET		-180	/* tenths of a dBFS */
+#define AGC_MIN_INTERVAL	50	/* ms between gain changes */
+
+struct agc_state {
+	int enabled;
+	int target; /* tenths of a dBFS */
+	int idx; /* position on the gain ladder */
+	int next_idx;
+	volatile int pending; /* gain change in flight */
+	int changed; /* gain change completed, tag the next buffer */
+	int buf_changed; /* tag of the buffer passed to the callback */
+	uint32_t skip; /* bytes to drop after a gain change */
+	uint32_t holdoff; /* samples until the next change is allowed */
+	uint32_t n, clipped, blocks;
+	uint32_t hist[AGC_HIST_BINS];
+};
+
+struct latency_state {
+	int enabled;
+	int have_floor;
+	int64_t floor; /* smallest arrival time - sample time seen, us */
+	uint64_t bytes; /* since the stream (re)started */
+	uint64_t n, sum; /* us */
+	uint32_t max; /* us */
+};
+
+#define TS_WINDOW		64	/* buffers in the timing regression */
+
+struct ts_state {
+	uint64_t count; /* samples received, plus the estimated gaps */
+	int restart; /* stream interrupted, flag the next buffer */
+	/* (end of buffer sample index, arrival time) of the last buffers */
+	uint64_t n[TS_WINDOW];
+	uint64_t t[TS_WINDOW]; /* us */
+	uint32_t head, fill;
+	/* t = t_ref + a + b * (n - n_ref), fitted to the earliest arrivals */
+	int valid;
+	uint64_t n_ref, t_ref;
+	double a, b;
+	double jitter_rms; /* us */
+	double jitter_max; /* us */
+};
+
+#define INTEGRITY_REG		4	/* FPGA test mode, see fpga.test_mode */
+#define INTEGRITY_BLOCK		64	/* I/Q pairs compared at once */
+
+struct integrity_state {
+	int enabled;
+	int have_last;
+	uint16_t last_i, last_q;
+	struct osmosdr_integrity_stats st;
+};
+
+/* in-band frame header, see struct osdr_frame_hdr in the firmware */
+#define FRAME_MAGIC		0x4d46
+#define FRAME_HDR_MIN		16	/* without the timed command fields */
+#define FRAME_HDR_LEN		24
+#define FRAME_F_RESTART		0x01	/* SSC restarted, samples missing */
+#define FRAME_F_OVERRUN		0x02	/* SSC overrun since the last frame */
+
+struct framing_state {
+	int enabled;
+	/* position in the byte stream, frames may span transfers */
+	uint8_t hdr[FRAME_HDR_LEN];
+	uint32_t hdr_fill;
+	uint32_t hdr_skip; /* header bytes past the ones we know */
+	uint32_t payload_left;
+	int resync; /* lost track, restart at the next transfer */
+	/* what the next header should say */
+	int have_last;
+	uint16_t next_seq;
+	uint32_t next_ctr;
+	uint32_t last_ovrun;
+	/* device sample counter of the buffer in the callback */
+	uint32_t buf_ctr;
+	int buf_ctr_valid;
+	/* last timed command the device reported */
+	uint16_t cmd_seq;
+	uint16_t cmd_tag;
+	uint32_t cmd_ctr;
+	struct osmosdr_framing_stats st;
+};
+
 struct osmosdr_dev {
 	libusb_context *ctx;
 	struct libusb_device_handle *devh;
 	uint32_t xfer_buf_num;
 	uint32_t xfer_buf_len;
 	struct libusb_transfer **xfer;
-	unsigned char **xfer_buf;
+	unsigned char **xfer_buf; /* pointers into xfer_pool */
+	unsigned char *xfer_pool;
+	size_t xfer_pool_len;
+	enum osmosdr_pool_type xfer_pool_type;
 	osmosdr_read_async_cb_t cb;
+	osmosdr_read_async_ext_cb_t ext_cb;
 	void *cb_ctx;
+	uint64_t *xfer_index; /* sample index of the first sample, per transfer */
+	struct ts_state ts;
 	enum osmosdr_async_status async_status;
+	volatile uint32_t xfer_active; /* transfers submitted to libusb */
+	int paused; /* transfers are kept, but not resubmitted */
+	volatile uint32_t resume; /* osmosdr_resume() was called */
+	int nonblocking; /* started by osmosdr_start_async() */
+	osmosdr_pollfd_added_cb_t pollfd_added;
+	osmosdr_pollfd_removed_cb_t pollfd_removed;
+	void *pollfd_ctx;
+	/* read-ahead for osmosdr_read_sync() */
+	int sync_mode;
+	int sync_error;
+	struct libusb_transfer **sync_fifo; /* completed, not yet read */
+	uint32_t sync_head;
+	uint32_t sync_count;
+	uint32_t sync_offset; /* bytes already read from the head transfer */
+	enum osmosdr_buffer_profile profile; /* for buf_num/buf_len of 0 */
+	struct latency_state latency;
+	struct integrity_state integrity;
+	struct framing_state framing;
+	/* stream recovery */
+	enum osmosdr_recovery_state recovery;
+	uint64_t *xfer_retry; /* ms, when to resubmit, 0 if not waiting */
+	uint32_t err_streak; /* failed transfers since the last good one */
+	int clear_halt; /* endpoint stalled, clear it before resubmitting */
+	uint64_t lost_at; /* ms */
+	uint64_t reopen_at; /* ms */
+	uint32_t reopen_tries;
+	uint64_t gap; /* samples dropped, not yet reported */
+	osmosdr_event_cb_t event_cb;
+	void *event_ctx;
+	char serial[256];
+	uint8_t usb_path[USB_PATH_MAX]; /* for devices without a serial */
+	int usb_path_len;
 	/* adc context */
 	uint32_t rate; /* Hz */
 	uint32_t adc_clock; /* Hz */
@@ -82,6 +276,17 @@ struct osmosdr_dev {
 	osmosdr_tuner_t *tuner;
 	uint32_t freq; /* Hz */
 	int gain; /* dB */
+	int gain_mode; /* -1 if never set */
+	uint32_t hop_freqs[OSMOSDR_HOP_TABLE_MAX];
+	unsigned int hop_num;
+	unsigned int hop_next;
+	/* fpga context */
+	int iq_swap;
+	int16_t iofs, qofs;
+	uint16_t igain, qgain;
+	uint32_t cmd_errors; /* failed control writes seen so far */
+	struct iq_cal_state iq_cal;
+	struct agc_state agc;
 };
 
 typedef struct osmosdr_dongle {
@@ -105,8 +310,104 @@ static osmosdr_dongle_t known_devices[] = {
 #define FUNC(group, function) ((group << 8) | function)
 
 #define CTRL_TIMEOUT	300
+#define HOP_ENTRY_LEN	8	/* u32 freq, s16 LNA gain, u16 reserved */
+#define HOP_GAIN_KEEP	0x7fff
+#define HOP_NEXT	0xffff
+#define HOP_NONE	0xffff
+#define TIMED_CMD_LEN	16	/* u32 at, u16 tag, u16 func, 8 bytes data */
+#define SWEEP_READ_STEPS	64	/* power values per control read */
+#define SWEEP_STEP_MS		20	/* per step on top of the samples */
+#define SWEEP_POLL_US		5000
+#define SWEEP_STATE_DONE	3
+#define CMD_WAIT_TIMEOUT	1000	/* ms, queued control writes */
+#define CMD_POLL_US		1000
 #define BULK_TIMEOUT	0
 
+#define MAX_BUF_NUMBER	128
+#define MAX_BUF_LENGTH	(1024 * 1024)
+#define MIN_BUF_NUMBER	4
+
+#define RECOVERY_RETRY_MS	10	/* first resubmission delay */
+#define RECOVERY_RETRY_MAX	8	/* failures in a row before reopening */
+#define RECOVERY_REOPEN_MS	100	/* first re-enumeration delay */
+#define RECOVERY_REOPEN_MAX_MS	2000
+#define RECOVERY_POLL_MS	10
+
+#define POOL_PAGE_SIZE	4096
+#define POOL_HUGE_SIZE	(2 * 1024 * 1024)
+#define POOL_CACHE_LINE	64
+
+/* the firmware queues at most 20 KiB of samples, read a bit more than that */
+#define FLUSH_LEN	(32 * 1024)
+/* the samples that were queued in the device when a setting changed were
+ * taken with the old one, the transfers queued on the host are filled
+ * afterwards */
+#define STALE_LEN	FLUSH_LEN
+#define FLUSH_TIMEOUT	10
+
+static void _osmosdr_iq_cal_restart(osmosdr_dev_t *dev, int async);
+static int _osmosdr_wait_idle(osmosdr_dev_t *dev, unsigned int timeout_ms,
+			      struct osmosdr_command_status *st);
+static void _osmosdr_cmd_mark(osmosdr_dev_t *dev,
+			      struct osmosdr_command_status *mark);
+static int _osmosdr_wait_own(osmosdr_dev_t *dev,
+			     const struct osmosdr_command_status *mark,
+			     uint16_t func);
+static int _osmosdr_free_async_buffers(osmosdr_dev_t *dev);
+static void _osmosdr_cancel_transfers(osmosdr_dev_t *dev);
+static int _osmosdr_alloc_pool(osmosdr_dev_t *dev);
+static void _osmosdr_free_pool(osmosdr_dev_t *dev);
+static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer);
+static unsigned int _osmosdr_xfer_idx(osmosdr_dev_t *dev,
+				      struct libusb_transfer *xfer);
+
+static void LIBUSB_CALL _libusb_ctrl_callback(struct libusb_transfer *xfer)
+{
+	/* buffer and transfer are freed by libusb after we return */
+	if (LIBUSB_TRANSFER_COMPLETED != xfer->status)
+		fprintf(stderr, "async control transfer failed: %d\n",
+			xfer->status);
+}
+
+/* Submit a vendor write request without waiting for its completion. This is
+ * safe to use from within libusb callbacks, where synchronous transfers would
+ * stall the event handling the streaming depends on. The optional completion
+ * callback gets the device handle as user_data. */
+static int _osmosdr_ctrl_write_async(osmosdr_dev_t *dev, uint16_t func,
+				     const uint8_t *data, uint16_t len,
+				     libusb_transfer_cb_fn cb)
+{
+	struct libusb_transfer *xfer;
+	unsigned char *buf;
+	int r;
+
+	xfer = libusb_alloc_transfer(0);
+	if (!xfer)
+		return -ENOMEM;
+
+	buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + len);
+	if (!buf) {
+		libusb_free_transfer(xfer);
+		return -ENOMEM;
+	}
+
+	libusb_fill_control_setup(buf, CTRL_OUT, 0x07, func, 0, len);
+	if (len)
+		memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+
+	libusb_fill_control_transfer(xfer, dev->devh, buf,
+				     cb ? cb : _libusb_ctrl_callback,
+				     (void *)dev, CTRL_TIMEOUT);
+	xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER |
+		      LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	r = libusb_submit_transfer(xfer);
+	if (r < 0)
+		libusb_free_transfer(xfer); /* also frees buf */
+
+	return r;
+}
+
 int e4k_init(void *dev) {
 	osmosdr_dev_t* devt = (osmosdr_dev_t*)dev;
 	int res;
@@ -285,19 +586,28 @@ int osmosdr_get_usb_strings(osmosdr_dev_t *dev, char *manufact, char *product,
 
 int osmosdr_set_center_freq(osmosdr_dev_t *dev, uint32_t freq)
 {
+	struct osmosdr_command_status mark;
 	int r = -2;
 
 	if (!dev || !dev->tuner)
 		return -1;
 
+	_osmosdr_cmd_mark(dev, &mark);
+
 	if (dev->tuner->set_freq)
 		r = dev->tuner->set_freq(dev, freq);
 
+	/* the device tunes from its main loop, report the outcome */
+	if (!r)
+		r = _osmosdr_wait_own(dev, &mark, FUNC(3, 0x05));
+
 	if (!r)
 		dev->freq = freq;
 	else
 		dev->freq = 0;
 
+	_osmosdr_iq_cal_restart(dev, 0);
+
 	return r;
 }
 
@@ -336,6 +646,9 @@ int osmosdr_set_tuner_gain(osmosdr_dev_t *dev, int gain)
 	if (!dev || !dev->tuner)
 		return -1;
 
+	/* a manually set gain overrides the software agc */
+	dev->agc.enabled = 0;
+
 	if (dev->tuner->set_gain)
 		r = dev->tuner->set_gain((void *)dev, gain);
 
@@ -344,6 +657,8 @@ int osmosdr_set_tuner_gain(osmosdr_dev_t *dev, int gain)
 	else
 		dev->gain = 0;
 
+	_osmosdr_iq_cal_restart(dev, 0);
+
 	return r;
 }
 
@@ -362,9 +677,14 @@ int osmosdr_set_tuner_gain_mode(osmosdr_dev_t *dev, int mode)
 	if (!dev || !dev->tuner)
 		return -1;
 
+	dev->agc.enabled = 0;
+
 	if (dev->tuner->set_gain_mode)
 		r = dev->tuner->set_gain_mode((void *)dev, mode);
 
+	if (!r)
+		dev->gain_mode = mode;
+
 	return r;
 }
 
@@ -427,6 +747,118 @@ int osmosdr_set_tuner_if_gain(osmosdr_dev_t *dev, int stage, int gain)
 				       buffer, sizeof(buffer), CTRL_TIMEOUT);
 }
 
+int osmosdr_set_hop_table(osmosdr_dev_t *dev, const uint32_t *freqs,
+			  const int *gains, unsigned int num)
+{
+	uint8_t buffer[OSMOSDR_HOP_TABLE_MAX * HOP_ENTRY_LEN];
+	struct osmosdr_command_status mark;
+	unsigned int i;
+	int gain, r;
+
+	if (!dev || (num && !freqs))
+		return -1;
+
+	if (num > OSMOSDR_HOP_TABLE_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < num; i++) {
+		uint8_t *ent = buffer + i * HOP_ENTRY_LEN;
+
+		gain = gains ? gains[i] : HOP_GAIN_KEEP;
+
+		ent[0] = (uint8_t)(freqs[i] >> 24);
+		ent[1] = (uint8_t)(freqs[i] >> 16);
+		ent[2] = (uint8_t)(freqs[i] >> 8);
+		ent[3] = (uint8_t)(freqs[i] >> 0);
+		ent[4] = (uint8_t)(gain >> 8);
+		ent[5] = (uint8_t)(gain >> 0);
+		ent[6] = 0;
+		ent[7] = 0;
+	}
+
+	dev->hop_num = 0;
+	dev->hop_next = 0;
+
+	_osmosdr_cmd_mark(dev, &mark);
+
+	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0x07,
+				    FUNC(3, 0x10), 0,
+				    buffer, num * HOP_ENTRY_LEN, CTRL_TIMEOUT);
+	if (r < 0)
+		return r;
+
+	/* the device precomputes the entries from its main loop */
+	r = _osmosdr_wait_own(dev, &mark, FUNC(3, 0x10));
+	if (r < 0)
+		return r;
+
+	if (num)
+		memcpy(dev->hop_freqs, freqs, num * sizeof(*freqs));
+	dev->hop_num = num;
+
+	return 0;
+}
+
+int osmosdr_hop(osmosdr_dev_t *dev, int index)
+{
+	uint16_t func_index;
+	uint8_t buffer[2];
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (index == OSMOSDR_HOP_NEXT) {
+		func_index = HOP_NEXT;
+		index = dev->hop_next;
+	} else
+		func_index = index;
+
+	if (index < 0 || index >= (int)dev->hop_num)
+		return -EINVAL;
+
+	buffer[0] = (uint8_t)(func_index >> 8);
+	buffer[1] = (uint8_t)(func_index >> 0);
+
+	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0x07,
+				    FUNC(3, 0x11), 0,
+				    buffer, sizeof(buffer), CTRL_TIMEOUT);
+	if (r < 0)
+		return r;
+
+	dev->hop_next = (index + 1) % dev->hop_num;
+	dev->freq = dev->hop_freqs[index];
+
+	_osmosdr_iq_cal_restart(dev, 0);
+
+	return 0;
+}
+
+int osmosdr_set_hop_dwell(osmosdr_dev_t *dev, uint32_t samples)
+{
+	struct osmosdr_command_status mark;
+	uint8_t buffer[4];
+	int r;
+
+	if (!dev)
+		return -1;
+
+	_osmosdr_cmd_mark(dev, &mark);
+
+	buffer[0] = (uint8_t)(samples >> 24);
+	buffer[1] = (uint8_t)(samples >> 16);
+	buffer[2] = (uint8_t)(samples >> 8);
+	buffer[3] = (uint8_t)(samples >> 0);
+
+	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0x07,
+				    FUNC(3, 0x12), 0,
+				    buffer, sizeof(buffer), CTRL_TIMEOUT);
+	if (r < 0)
+		return r;
+
+	return _osmosdr_wait_own(dev, &mark, FUNC(3, 0x12));
+}
+
 /* two raised to the power of n */
 #define TWO_POW(n)		(1ULL<<(n))
 
@@ -481,6 +913,11 @@ int osmosdr_set_sample_rate(osmosdr_dev_t *dev, uint32_t samp_rate)
 		dev->rate = 0;
 	}
 
+	/* the sample clock of the running stream changed */
+	dev->latency.bytes = 0;
+	dev->latency.have_floor = 0;
+	dev->ts.restart = 1;
+
 	return r;
 }
 
@@ -508,6 +945,144 @@ int osmosdr_set_fpga_reg(osmosdr_dev_t *dev, uint8_t reg, uint32_t value)
 				       buffer, sizeof(buffer), CTRL_TIMEOUT);
 }
 
+static int _osmosdr_ctrl_read(osmosdr_dev_t *dev, uint16_t func,
+			      uint16_t index, uint8_t *data, uint16_t len)
+{
+	int r;
+
+	r = libusb_control_transfer(dev->devh, CTRL_IN, 0x87, func, index,
+				    data, len, CTRL_TIMEOUT);
+	if (r < 0)
+		return r;
+
+	return r == len ? 0 : -EIO;
+}
+
+static uint32_t _osmosdr_be32(const uint8_t *data)
+{
+	return ((uint32_t)data[0] << 24) | (data[1] << 16) |
+	       (data[2] << 8) | data[3];
+}
+
+int osmosdr_get_fpga_reg(osmosdr_dev_t *dev, uint8_t reg, uint32_t *value)
+{
+	struct osmosdr_command_status st;
+	uint8_t buffer[4];
+	int r;
+
+	if (!dev || !value)
+		return -1;
+
+	/* the device refuses bus reads while writes are pending */
+	_osmosdr_wait_idle(dev, CMD_WAIT_TIMEOUT, &st);
+
+	r = _osmosdr_ctrl_read(dev, FUNC(1, 0x01), reg,
+			       buffer, sizeof(buffer));
+	if (r < 0)
+		return r;
+
+	*value = _osmosdr_be32(buffer);
+
+	return 0;
+}
+
+int osmosdr_get_tuner_reg(osmosdr_dev_t *dev, uint8_t reg, uint8_t *value)
+{
+	struct osmosdr_command_status st;
+
+	if (!dev || !value)
+		return -1;
+
+	_osmosdr_wait_idle(dev, CMD_WAIT_TIMEOUT, &st);
+
+	return _osmosdr_ctrl_read(dev, FUNC(3, 0x01), reg, value, 1);
+}
+
+int osmosdr_get_hop_status(osmosdr_dev_t *dev, int *index, uint32_t *hops)
+{
+	uint8_t buffer[12];
+	uint32_t cur;
+	int r;
+
+	if (!dev)
+		return -1;
+
+	r = _osmosdr_ctrl_read(dev, FUNC(3, 0x10), 0, buffer, sizeof(buffer));
+	if (r < 0)
+		return r;
+
+	cur = _osmosdr_be32(buffer + 0);
+
+	if (index)
+		*index = (cur == HOP_NONE) ? -1 : (int)cur;
+	if (hops)
+		*hops = _osmosdr_be32(buffer + 8);
+
+	return 0;
+}
+
+int osmosdr_get_command_status(osmosdr_dev_t *dev,
+			       struct osmosdr_command_status *status)
+{
+	uint8_t buffer[24];
+	uint16_t len = sizeof(buffer);
+	int r;
+
+	if (!dev || !status)
+		return -1;
+
+	r = _osmosdr_ctrl_read(dev, FUNC(0, 0x01), 0, buffer, len);
+	if (LIBUSB_ERROR_PIPE == r) {
+		/* firmware that doesn't tell which write failed */
+		len = 20;
+		r = _osmosdr_ctrl_read(dev, FUNC(0, 0x01), 0, buffer, len);
+	}
+	if (r < 0)
+		return r;
+
+	status->submitted = _osmosdr_be32(buffer + 0);
+	status->completed = _osmosdr_be32(buffer + 4);
+	status->errors = _osmosdr_be32(buffer + 8);
+	status->last_err_func = (uint16_t)_osmosdr_be32(buffer + 12);
+	status->last_err_res = (int32_t)_osmosdr_be32(buffer + 16);
+	/* without it, take the failure for the latest write */
+	status->last_err_seq = len > 20 ? _osmosdr_be32(buffer + 20) :
+			       status->submitted - 1;
+
+	return 0;
+}
+
+int osmosdr_get_device_stats(osmosdr_dev_t *dev,
+			     struct osmosdr_device_stats *stats)
+{
+	uint8_t buffer[56];
+	int r;
+
+	if (!dev || !stats)
+		return -1;
+
+	r = _osmosdr_ctrl_read(dev, FUNC(0, 0x00), 0, buffer, sizeof(buffer));
+	if (r < 0)
+		return r;
+
+	stats->ssc_xfers = _osmosdr_be32(buffer + 0);
+	stats->ssc_irqs = _osmosdr_be32(buffer + 4);
+	stats->ssc_overruns = _osmosdr_be32(buffer + 8);
+	stats->ssc_active = _osmosdr_be32(buffer + 12);
+	stats->dma_chain_len = _osmosdr_be32(buffer + 16);
+	stats->usb_pending = _osmosdr_be32(buffer + 20);
+	stats->bufs_free = _osmosdr_be32(buffer + 24);
+	stats->bufs_total = _osmosdr_be32(buffer + 28);
+	stats->frame_seq = _osmosdr_be32(buffer + 32);
+	stats->sample_ctr = _osmosdr_be32(buffer + 36);
+	stats->pll_locked = _osmosdr_be32(buffer + 40);
+	stats->bufs_low = _osmosdr_be32(buffer + 44);
+	stats->bufs_alloc_fail = _osmosdr_be32(buffer + 48);
+	stats->ssc_dropped = _osmosdr_be32(buffer + 52);
+
+	return 0;
+}
+
 int osmosdr_set_fpga_decimation(osmosdr_dev_t *dev, int dec)
 {
 	osmosdr_dev_t* devt = (osmosdr_dev_t*)dev;
@@ -527,121 +1102,665 @@ int osmosdr_set_fpga_iq_swap(osmosdr_dev_t *dev, int sw)
 {
 	osmosdr_dev_t* devt = (osmosdr_dev_t*)dev;
 	uint8_t buffer[1];
+	int r;
 
 	if((sw < 0) || (sw > 1))
 		return -1;
 
 	buffer[0] = sw;
 
-	return libusb_control_transfer(devt->devh, CTRL_OUT, 0x07,
-				       FUNC(1, 0x03), 0,
-				       buffer, sizeof(buffer), CTRL_TIMEOUT);
+	r = libusb_control_transfer(devt->devh, CTRL_OUT, 0x07,
+				    FUNC(1, 0x03), 0,
+				    buffer, sizeof(buffer), CTRL_TIMEOUT);
+	if (r >= 0)
+		devt->iq_swap = sw;
+
+	return r;
 }
 
 int osmosdr_set_fpga_iq_gain(osmosdr_dev_t *dev, uint16_t igain, uint16_t qgain)
 {
 	osmosdr_dev_t* devt = (osmosdr_dev_t*)dev;
 	uint8_t buffer[4];
+	int r;
 
 	buffer[0] = (uint8_t)(igain >> 8);
 	buffer[1] = (uint8_t)(igain >> 0);
 	buffer[2] = (uint8_t)(qgain >> 8);
 	buffer[3] = (uint8_t)(qgain >> 0);
 
-	return libusb_control_transfer(devt->devh, CTRL_OUT, 0x07,
-				       FUNC(1, 0x04), 0,
-				       buffer, sizeof(buffer), CTRL_TIMEOUT);
+	r = libusb_control_transfer(devt->devh, CTRL_OUT, 0x07,
+				    FUNC(1, 0x04), 0,
+				    buffer, sizeof(buffer), CTRL_TIMEOUT);
+
+	if (r == sizeof(buffer)) {
+		dev->igain = igain;
+		dev->qgain = qgain;
+	}
+
+	return r;
 }
 
 int osmosdr_set_fpga_iq_ofs(osmosdr_dev_t *dev, int16_t iofs, int16_t qofs)
 {
 	osmosdr_dev_t* devt = (osmosdr_dev_t*)dev;
 	uint8_t buffer[4];
+	int r;
 
 	buffer[0] = (uint8_t)(iofs >> 8);
 	buffer[1] = (uint8_t)(iofs >> 0);
 	buffer[2] = (uint8_t)(qofs >> 8);
 	buffer[3] = (uint8_t)(qofs >> 0);
 
-	return libusb_control_transfer(devt->devh, CTRL_OUT, 0x07,
-				       FUNC(1, 0x05), 0,
-				       buffer, sizeof(buffer), CTRL_TIMEOUT);
+	r = libusb_control_transfer(devt->devh, CTRL_OUT, 0x07,
+				    FUNC(1, 0x05), 0,
+				    buffer, sizeof(buffer), CTRL_TIMEOUT);
+
+	if (r == sizeof(buffer)) {
+		dev->iofs = iofs;
+		dev->qofs = qofs;
+	}
+
+	return r;
 }
 
-static osmosdr_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
+/* automatic dc offset and i/q gain imbalance calibration */
+
+static struct iq_cal_entry *_iq_cal_find(struct iq_cal_state *c,
+					 uint32_t freq, int gain)
 {
+	uint32_t band = freq / IQ_CAL_FREQ_STEP;
 	unsigned int i;
-	osmosdr_dongle_t *device = NULL;
 
-	for (i = 0; i < sizeof(known_devices)/sizeof(osmosdr_dongle_t); i++ ) {
-		if (known_devices[i].vid == vid && known_devices[i].pid == pid) {
-			device = &known_devices[i];
-			break;
+	for (i = 0; i < IQ_CAL_CACHE_SIZE; i++) {
+		struct iq_cal_entry *e = &c->cache[i];
+
+		if (e->valid && e->band == band && e->gain == gain) {
+			e->stamp = ++c->stamp;
+			return e;
 		}
 	}
 
-	return device;
+	return NULL;
 }
 
-uint32_t osmosdr_get_device_count(void)
+static void _iq_cal_store(osmosdr_dev_t *dev)
 {
-	int i;
-	libusb_context *ctx;
-	libusb_device **list;
-	struct libusb_device_descriptor dd;
-	uint32_t device_count = 0;
-	ssize_t cnt;
-
-	libusb_init(&ctx);
-
-	cnt = libusb_get_device_list(ctx, &list);
+	struct iq_cal_state *c = &dev->iq_cal;
+	struct iq_cal_entry *e;
+	unsigned int i;
 
-	for (i = 0; i < cnt; i++) {
-		libusb_get_device_descriptor(list[i], &dd);
+	e = _iq_cal_find(c, dev->freq, dev->gain);
+	if (!e) {
+		/* take a free slot or replace the least recently used one */
+		e = &c->cache[0];
+		for (i = 0; i < IQ_CAL_CACHE_SIZE; i++) {
+			if (!c->cache[i].valid) {
+				e = &c->cache[i];
+				break;
+			}
 
-		if (find_known_device(dd.idVendor, dd.idProduct))
-			device_count++;
+			if (c->cache[i].stamp < e->stamp)
+				e = &c->cache[i];
+		}
 	}
 
-	libusb_free_device_list(list, 1);
-
-	libusb_exit(ctx);
-
-	return device_count;
+	e->valid = 1;
+	e->band = dev->freq / IQ_CAL_FREQ_STEP;
+	e->gain = dev->gain;
+	e->stamp = ++c->stamp;
+	e->iofs = dev->iofs;
+	e->qofs = dev->qofs;
+	e->igain = dev->igain;
+	e->qgain = dev->qgain;
 }
 
-const char *osmosdr_get_device_name(uint32_t index)
+/* load a correction into the FPGA, only the registers that change */
+static void _iq_cal_write_async(osmosdr_dev_t *dev, uint16_t igain,
+				uint16_t qgain, int16_t iofs, int16_t qofs)
 {
-	int i;
-	libusb_context *ctx;
-	libusb_device **list;
-	struct libusb_device_descriptor dd;
-	osmosdr_dongle_t *device = NULL;
-	uint32_t device_count = 0;
-	ssize_t cnt;
+	uint8_t buffer[4];
 
-	libusb_init(&ctx);
+	if (igain != dev->igain || qgain != dev->qgain) {
+		buffer[0] = (uint8_t)(igain >> 8);
+		buffer[1] = (uint8_t)(igain >> 0);
+		buffer[2] = (uint8_t)(qgain >> 8);
+		buffer[3] = (uint8_t)(qgain >> 0);
 
-	cnt = libusb_get_device_list(ctx, &list);
+		if (!_osmosdr_ctrl_write_async(dev, FUNC(1, 0x04),
+					       buffer, sizeof(buffer), NULL)) {
+			dev->igain = igain;
+			dev->qgain = qgain;
+		}
+	}
 
-	for (i = 0; i < cnt; i++) {
-		libusb_get_device_descriptor(list[i], &dd);
+	if (iofs != dev->iofs || qofs != dev->qofs) {
+		buffer[0] = (uint8_t)(iofs >> 8);
+		buffer[1] = (uint8_t)(iofs >> 0);
+		buffer[2] = (uint8_t)(qofs >> 8);
+		buffer[3] = (uint8_t)(qofs >> 0);
 
-		device = find_known_device(dd.idVendor, dd.idProduct);
+		if (!_osmosdr_ctrl_write_async(dev, FUNC(1, 0x05),
+					       buffer, sizeof(buffer), NULL)) {
+			dev->iofs = iofs;
+			dev->qofs = qofs;
+		}
+	}
+}
 
-		if (device) {
-			device_count++;
+/* called from the configuration functions whenever frequency or gain
+ * change, with async set from within libusb callbacks */
+static void _osmosdr_iq_cal_restart(osmosdr_dev_t *dev, int async)
+{
+	struct iq_cal_state *c = &dev->iq_cal;
+	struct iq_cal_entry *e;
+
+	if (!c->enabled)
+		return;
+
+	e = _iq_cal_find(c, dev->freq, dev->gain);
+	if (e && async) {
+		_iq_cal_write_async(dev, e->igain, e->qgain, e->iofs, e->qofs);
+	} else if (e) {
+		osmosdr_set_fpga_iq_gain(dev, e->igain, e->qgain);
+		osmosdr_set_fpga_iq_ofs(dev, e->iofs, e->qofs);
+	}
 
-			if (index == device_count - 1)
-				break;
+	c->converged = e ? 1 : 0;
+	c->restart = 1;
+}
 
-			device = NULL;
-		}
+/* Accumulate first and second order moments of interleaved 16 bit I/Q
+ * samples. The loop body is free of branches so the compiler can vectorize
+ * it. */
+static void _iq_cal_accumulate(struct iq_cal_state *c, const int16_t *s,
+			       uint32_t n)
+{
+	int64_t si = 0, sq = 0, sii = 0, sqq = 0, siq = 0;
+	uint32_t k;
+
+	for (k = 0; k < n; k++) {
+		int32_t i = s[2 * k];
+		int32_t q = s[2 * k + 1];
+
+		si += i;
+		sq += q;
+		sii += i * i;
+		sqq += q * q;
+		siq += i * q;
 	}
 
-	libusb_free_device_list(list, 1);
+	c->n += n;
+	c->si += si;
+	c->sq += sq;
+	c->sii += sii;
+	c->sqq += sqq;
+	c->siq += siq;
+}
 
-	libusb_exit(ctx);
+static long _iq_cal_clamp(long val, long min, long max)
+{
+	return val < min ? min : (val > max ? max : val);
+}
+
+static void _iq_cal_update(osmosdr_dev_t *dev)
+{
+	struct iq_cal_state *c = &dev->iq_cal;
+	double n = c->n;
+	double mi = c->si / n, mq = c->sq / n;
+	double vi = c->sii / n - mi * mi;
+	double vq = c->sqq / n - mq * mq;
+	double ciq = c->siq / n - mi * mq;
+	double ratio, corr, g;
+	long iofs, qofs, igain, qgain;
+
+	if (vi <= 0.0 || vq <= 0.0)
+		return;
+
+	/* amplitude ratio of I to Q and their normalized correlation, which
+	 * is the sine of the phase error between both channels */
+	ratio = sqrt(vi / vq);
+	corr = ciq / sqrt(vi * vq);
+	corr = corr > 1.0 ? 1.0 : (corr < -1.0 ? -1.0 : corr);
+	c->phase = (int)lrint(asin(corr) * 1800.0 / M_PI);
+
+	c->converged = fabs(mi) < IQ_CAL_DC_TOL && fabs(mq) < IQ_CAL_DC_TOL &&
+		       fabs(ratio - 1.0) < IQ_CAL_GAIN_TOL;
+	if (c->converged) {
+		_iq_cal_store(dev);
+		return;
+	}
+
+	/* the FPGA adds the offset before scaling, so the measured mean is
+	 * scaled back onto the offset registers */
+	iofs = _iq_cal_clamp(dev->iofs - lrint(mi * IQ_CAL_UNITY_GAIN /
+						dev->igain), -32768, 32767);
+	qofs = _iq_cal_clamp(dev->qofs - lrint(mq * IQ_CAL_UNITY_GAIN /
+						dev->qgain), -32768, 32767);
+
+	/* split the gain correction between both channels to keep the overall
+	 * signal level */
+	g = sqrt(ratio);
+	igain = _iq_cal_clamp(lrint(dev->igain / g), 1, 65535);
+	qgain = _iq_cal_clamp(lrint(dev->qgain * g), 1, 65535);
+
+	_iq_cal_write_async(dev, igain, qgain, iofs, qofs);
+
+	c->skip = STALE_LEN;
+}
+
+/* called for every completed transfer while streaming */
+static void _osmosdr_iq_cal_process(osmosdr_dev_t *dev, unsigned char *buf,
+				    uint32_t len)
+{
+	struct iq_cal_state *c = &dev->iq_cal;
+
+	if (c->restart) {
+		c->restart = 0;
+		c->n = 0;
+		c->si = c->sq = c->sii = c->sqq = c->siq = 0;
+		c->skip = STALE_LEN;
+	}
+
+	if (c->skip >= len) {
+		c->skip -= len;
+		return;
+	}
+	buf += c->skip;
+	len -= c->skip;
+	c->skip = 0;
+
+	_iq_cal_accumulate(c, (const int16_t *)buf, len / 4);
+
+	if (c->n >= IQ_CAL_BLOCK_LEN) {
+		_iq_cal_update(dev);
+		c->n = 0;
+		c->si = c->sq = c->sii = c->sqq = c->siq = 0;
+	}
+}
+
+/* software agc driving the e4k gain stages */
+
+static const int agc_lna_gains[] = {
+	-50, -25, 0, 25, 50, 75, 100, 125, 150, 175, 200, 250, 300
+};
+
+#define AGC_LNA_STEPS	(int)(sizeof(agc_lna_gains) / sizeof(int))
+#define AGC_IF_STEPS	3
+#define AGC_NUM_STEPS	(AGC_LNA_STEPS + 1 + 2 * AGC_IF_STEPS)
+#define AGC_INIT_STEP	10
+
+struct agc_gains {
+	int lna; /* tenths of a dB */
+	int mixer;
+	int if2;
+	int if3;
+};
+
+/* The gain ladder raises the LNA first for the best noise figure, then the
+ * mixer and finally IF stages 2 and 3. Adjacent steps differ in exactly one
+ * stage, so each step costs a single control transfer. */
+static void _agc_step_gains(int idx, struct agc_gains *g)
+{
+	int k = idx - AGC_LNA_STEPS;
+
+	g->lna = agc_lna_gains[idx < AGC_LNA_STEPS ? idx : AGC_LNA_STEPS - 1];
+	g->mixer = k >= 0 ? 120 : 40;
+	g->if2 = k > 0 ? min(k, AGC_IF_STEPS) * 30 : 0;
+	g->if3 = k > AGC_IF_STEPS ? min(k - AGC_IF_STEPS, AGC_IF_STEPS) * 30 : 0;
+}
+
+static int _agc_step_total(int idx)
+{
+	struct agc_gains g;
+
+	_agc_step_gains(idx, &g);
+
+	return g.lna + g.mixer + g.if2 + g.if3;
+}
+
+static void LIBUSB_CALL _agc_ctrl_callback(struct libusb_transfer *xfer)
+{
+	osmosdr_dev_t *dev = (osmosdr_dev_t *)xfer->user_data;
+	struct agc_state *a = &dev->agc;
+
+	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
+		a->idx = a->next_idx;
+		a->changed = 1;
+		dev->gain = _agc_step_total(a->idx);
+		_osmosdr_iq_cal_restart(dev, 1);
+	} else {
+		fprintf(stderr, "agc gain change failed: %d\n", xfer->status);
+	}
+
+	/* what the device had queued was taken with the old gain */
+	a->skip = STALE_LEN;
+	a->pending = 0;
+}
+
+/* issue the control transfer for the one stage that differs */
+static int _agc_move(osmosdr_dev_t *dev, int next)
+{
+	struct agc_gains cur, nxt;
+	uint8_t buffer[5];
+	uint16_t func;
+	uint16_t len;
+	int32_t val;
+
+	_agc_step_gains(dev->agc.idx, &cur);
+	_agc_step_gains(next, &nxt);
+
+	if (cur.lna != nxt.lna) {
+		func = FUNC(3, 0x0b);
+		val = nxt.lna;
+		len = 4;
+		buffer[0] = (uint8_t)(val >> 24);
+		buffer[1] = (uint8_t)(val >> 16);
+		buffer[2] = (uint8_t)(val >> 8);
+		buffer[3] = (uint8_t)(val >> 0);
+	} else if (cur.mixer != nxt.mixer) {
+		func = FUNC(3, 0x03);
+		len = 1;
+		buffer[0] = nxt.mixer / 10;
+	} else {
+		func = FUNC(3, 0x02);
+		len = 5;
+		buffer[0] = (cur.if2 != nxt.if2) ? 2 : 3;
+		val = ((cur.if2 != nxt.if2) ? nxt.if2 : nxt.if3) / 10;
+		buffer[1] = (uint8_t)(val >> 24);
+		buffer[2] = (uint8_t)(val >> 16);
+		buffer[3] = (uint8_t)(val >> 8);
+		buffer[4] = (uint8_t)(val >> 0);
+	}
+
+	dev->agc.next_idx = next;
+	dev->agc.pending = 1;
+
+	if (_osmosdr_ctrl_write_async(dev, func, buffer, len,
+				      _agc_ctrl_callback) < 0) {
+		dev->agc.pending = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sum up the energy of a block of I/Q samples and count the values close to
+ * full scale. The loop body is free of branches so the compiler can vectorize
+ * it. */
+static uint64_t _agc_block_energy(const int16_t *s, uint32_t n,
+				  uint32_t *clipped)
+{
+	uint64_t energy = 0;
+	uint32_t clip = 0;
+	uint32_t k;
+
+	for (k = 0; k < 2 * n; k++) {
+		int32_t v = s[k];
+
+		energy += (uint32_t)(v * v);
+		clip += (v >= AGC_CLIP_LEVEL) | (v <= -AGC_CLIP_LEVEL);
+	}
+
+	*clipped += clip;
+
+	return energy;
+}
+
+static void _agc_measure(struct agc_state *a, const int16_t *s, uint32_t n)
+{
+	uint32_t k;
+
+	for (k = 0; k + AGC_BLOCK_LEN <= n; k += AGC_BLOCK_LEN) {
+		uint64_t energy = _agc_block_energy(s + 2 * k, AGC_BLOCK_LEN,
+						    &a->clipped);
+		double ms = (double)energy / (2 * AGC_BLOCK_LEN);
+		int bin;
+
+		/* histogram of the block rms level, in 3 dB steps below
+		 * full scale */
+		if (ms < 1.0)
+			bin = AGC_HIST_BINS - 1;
+		else
+			bin = (int)(-10.0 * log10(ms / 1073741824.0) / 3.0);
+
+		if (bin < 0)
+			bin = 0;
+		if (bin >= AGC_HIST_BINS)
+			bin = AGC_HIST_BINS - 1;
+
+		a->hist[bin]++;
+		a->blocks++;
+	}
+
+	a->n += k;
+}
+
+static void _agc_decide(osmosdr_dev_t *dev)
+{
+	struct agc_state *a = &dev->agc;
+	uint32_t count = 0;
+	int bin, level, next = a->idx;
+
+	/* level exceeded by AGC_PERCENTILE percent of the blocks */
+	for (bin = 0; bin < AGC_HIST_BINS - 1; bin++) {
+		count += a->hist[bin];
+		if (count * 100 >= a->blocks * AGC_PERCENTILE)
+			break;
+	}
+	level = -(bin * 30 + 15);
+
+	if ((uint64_t)a->clipped * AGC_CLIP_MAX > 2ULL * a->n ||
+	    level > a->target + AGC_HYSTERESIS) {
+		if (a->idx > 0)
+			next = a->idx - 1;
+	} else if (level < a->target - AGC_HYSTERESIS &&
+		   a->idx < AGC_NUM_STEPS - 1) {
+		/* only go up if the step does not overshoot the window */
+		if (level + _agc_step_total(a->idx + 1) -
+		    _agc_step_total(a->idx) <= a->target + AGC_HYSTERESIS)
+			next = a->idx + 1;
+	}
+
+	if (next != a->idx && !_agc_move(dev, next))
+		a->holdoff = (uint64_t)dev->rate * AGC_MIN_INTERVAL / 1000;
+}
+
+/* called for every completed transfer while streaming */
+static void _osmosdr_agc_process(osmosdr_dev_t *dev, unsigned char *buf,
+				 uint32_t len)
+{
+	struct agc_state *a = &dev->agc;
+	uint32_t n = len / 4;
+
+	a->buf_changed = a->changed;
+	a->changed = 0;
+
+	a->holdoff = a->holdoff > n ? a->holdoff - n : 0;
+
+	if (a->pending)
+		return;
+
+	if (a->skip >= len) {
+		a->skip -= len;
+		return;
+	}
+	buf += a->skip;
+	n = (len - a->skip) / 4;
+	a->skip = 0;
+
+	_agc_measure(a, (const int16_t *)buf, n);
+
+	if (a->n < AGC_MEASURE_LEN)
+		return;
+
+	if (!a->holdoff)
+		_agc_decide(dev);
+
+	a->n = a->clipped = a->blocks = 0;
+	memset(a->hist, 0, sizeof(a->hist));
+}
+
+int osmosdr_set_agc(osmosdr_dev_t *dev, int on, int target)
+{
+	struct agc_gains g;
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (!on) {
+		dev->agc.enabled = 0;
+		return 0;
+	}
+
+	if (dev->agc.enabled)
+		return 0;
+
+	/* start in the middle of the ladder with all stages set explicitly */
+	r = osmosdr_set_tuner_gain_mode(dev, 1);
+	if (r < 0)
+		return r;
+
+	_agc_step_gains(AGC_INIT_STEP, &g);
+
+	if (osmosdr_set_tuner_lna_gain(dev, g.lna) < 0 ||
+	    osmosdr_set_tuner_mixer_gain(dev, g.mixer) < 0 ||
+	    osmosdr_set_tuner_if_gain(dev, 2, g.if2) < 0 ||
+	    osmosdr_set_tuner_if_gain(dev, 3, g.if3) < 0)
+		return -1;
+
+	memset(&dev->agc, 0, sizeof(dev->agc));
+	dev->agc.target = target ? target : AGC_DEF_TARGET;
+	dev->agc.idx = AGC_INIT_STEP;
+	dev->agc.skip = STALE_LEN;
+	dev->gain = _agc_step_total(AGC_INIT_STEP);
+	dev->agc.enabled = 1;
+
+	_osmosdr_iq_cal_restart(dev, 0);
+
+	return 0;
+}
+
+int osmosdr_get_buffer_gain(osmosdr_dev_t *dev, int *gain)
+{
+	if (!dev)
+		return -1;
+
+	if (gain)
+		*gain = dev->gain;
+
+	return dev->agc.enabled ? dev->agc.buf_changed : 0;
+}
+
+int osmosdr_set_iq_calibration(osmosdr_dev_t *dev, int on)
+{
+	if (!dev)
+		return -1;
+
+	dev->iq_cal.enabled = on ? 1 : 0;
+
+	/* apply cached values if there are any and start estimating */
+	_osmosdr_iq_cal_restart(dev, 0);
+
+	return 0;
+}
+
+int osmosdr_get_iq_calibration(osmosdr_dev_t *dev, int16_t *iofs,
+			       int16_t *qofs, uint16_t *igain,
+			       uint16_t *qgain, int *phase)
+{
+	if (!dev)
+		return -1;
+
+	if (iofs)
+		*iofs = dev->iofs;
+	if (qofs)
+		*qofs = dev->qofs;
+	if (igain)
+		*igain = dev->igain;
+	if (qgain)
+		*qgain = dev->qgain;
+	if (phase)
+		*phase = dev->iq_cal.phase;
+
+	return dev->iq_cal.converged;
+}
+
+static osmosdr_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
+{
+	unsigned int i;
+	osmosdr_dongle_t *device = NULL;
+
+	for (i = 0; i < sizeof(known_devices)/sizeof(osmosdr_dongle_t); i++ ) {
+		if (known_devices[i].vid == vid && known_devices[i].pid == pid) {
+			device = &known_devices[i];
+			break;
+		}
+	}
+
+	return device;
+}
+
+uint32_t osmosdr_get_device_count(void)
+{
+	int i;
+	libusb_context *ctx;
+	libusb_device **list;
+	struct libusb_device_descriptor dd;
+	uint32_t device_count = 0;
+	ssize_t cnt;
+
+	libusb_init(&ctx);
+
+	cnt = libusb_get_device_list(ctx, &list);
+
+	for (i = 0; i < cnt; i++) {
+		libusb_get_device_descriptor(list[i], &dd);
+
+		if (find_known_device(dd.idVendor, dd.idProduct))
+			device_count++;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	libusb_exit(ctx);
+
+	return device_count;
+}
+
+const char *osmosdr_get_device_name(uint32_t index)
+{
+	int i;
+	libusb_context *ctx;
+	libusb_device **list;
+	struct libusb_device_descriptor dd;
+	osmosdr_dongle_t *device = NULL;
+	uint32_t device_count = 0;
+	ssize_t cnt;
+
+	libusb_init(&ctx);
+
+	cnt = libusb_get_device_list(ctx, &list);
+
+	for (i = 0; i < cnt; i++) {
+		libusb_get_device_descriptor(list[i], &dd);
+
+		device = find_known_device(dd.idVendor, dd.idProduct);
+
+		if (device) {
+			device_count++;
+
+			if (index == device_count - 1)
+				break;
+
+			device = NULL;
+		}
+	}
+
+	libusb_free_device_list(list, 1);
+
+	libusb_exit(ctx);
 
 	if (device)
 		return device->name;
@@ -691,6 +1810,21 @@ int osmosdr_get_device_usb_strings(uint32_t index, char *manufact,
 	return r;
 }
 
+/* bus and port numbers, 0 if libusb can't tell */
+static int _osmosdr_usb_path(libusb_device *device, uint8_t *path)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	int r;
+
+	path[0] = libusb_get_bus_number(device);
+
+	r = libusb_get_port_numbers(device, path + 1, USB_PATH_MAX - 1);
+	if (r > 0)
+		return r + 1;
+#endif
+	return 0;
+}
+
 int osmosdr_open(osmosdr_dev_t **out_dev, uint32_t index)
 {
 	int r;
@@ -700,6 +1834,7 @@ int osmosdr_open(osmosdr_dev_t **out_dev, uint32_t index)
 	libusb_device *device = NULL;
 	uint32_t device_count = 0;
 	struct libusb_device_descriptor dd;
+	struct osmosdr_command_status cmd_status;
 	ssize_t cnt;
 
 	dev = malloc(sizeof(osmosdr_dev_t));
@@ -738,6 +1873,8 @@ int osmosdr_open(osmosdr_dev_t **out_dev, uint32_t index)
 		goto err;
 	}
 
+	dev->usb_path_len = _osmosdr_usb_path(device, dev->usb_path);
+
 	libusb_free_device_list(list, 1);
 
 	r = libusb_claim_interface(dev->devh, 0);
@@ -746,7 +1883,18 @@ int osmosdr_open(osmosdr_dev_t **out_dev, uint32_t index)
 		goto err;
 	}
 
+	/* to find the device again if it drops off the bus */
+	osmosdr_get_usb_strings(dev, NULL, NULL, dev->serial);
+
 	dev->adc_clock = DEF_ADC_FREQ;
+	dev->gain_mode = -1;
+
+	dev->igain = IQ_CAL_UNITY_GAIN;
+	dev->qgain = IQ_CAL_UNITY_GAIN;
+
+	/* only report failures of our own control writes */
+	if (!osmosdr_get_command_status(dev, &cmd_status))
+		dev->cmd_errors = cmd_status.errors;
 
 	dev->tuner = &tuner; /* so far we have only one tuner */
 
@@ -773,10 +1921,22 @@ int osmosdr_close(osmosdr_dev_t *dev)
 	if (!dev)
 		return -1;
 
+	if (dev->sync_mode)
+		osmosdr_stop_sync(dev);
+
+	/* nobody else is going to handle the events for these */
+	if (dev->nonblocking) {
+		_osmosdr_cancel_transfers(dev);
+		dev->nonblocking = 0;
+		dev->async_status = OSMOSDR_INACTIVE;
+	}
+
 	/* block until all async operations have been completed (if any) */
 	while (OSMOSDR_INACTIVE != dev->async_status)
 		usleep(10);
 
+	_osmosdr_free_async_buffers(dev);
+
 	libusb_release_interface(dev->devh, 0);
 	libusb_close(dev->devh);
 
@@ -789,59 +1949,1660 @@ int osmosdr_close(osmosdr_dev_t *dev)
 
 int osmosdr_reset_buffer(osmosdr_dev_t *dev)
 {
+	unsigned char *buf;
+	int n_read, total = 0;
+	int r;
+
 	if (!dev)
 		return -1;
 
-	/* TODO: implement */
+	/* the endpoint can't be flushed under pending transfers */
+	if (atomic_get(&dev->xfer_active))
+		return -2;
 
-	return 0;
-}
+	r = libusb_clear_halt(dev->devh, 0x86);
+	if (r < 0)
+		return r;
 
-int osmosdr_read_sync(osmosdr_dev_t *dev, void *buf, int len, int *n_read)
-{
-	if (!dev)
-		return -1;
+	buf = malloc(DEFAULT_BUF_LENGTH);
+	if (!buf)
+		return -ENOMEM;
 
-	return libusb_bulk_transfer(dev->devh, 0x86, buf, len, n_read, BULK_TIMEOUT);
-}
+	/* discard whatever the device had queued before the halt was cleared */
+	while (total < FLUSH_LEN) {
+		r = libusb_bulk_transfer(dev->devh, 0x86, buf,
+					 DEFAULT_BUF_LENGTH, &n_read,
+					 FLUSH_TIMEOUT);
+		total += n_read;
 
-static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
-{
-	osmosdr_dev_t *dev = (osmosdr_dev_t *)xfer->user_data;
+		if (r < 0 || !n_read)
+			break;
+	}
 
-	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
-		if (dev->cb)
-			dev->cb(xfer->buffer, xfer->actual_length, dev->cb_ctx);
+	free(buf);
 
-		libusb_submit_transfer(xfer); /* resubmit transfer */
-	} else if (LIBUSB_TRANSFER_CANCELLED == xfer->status) {
-		/* nothing to do */
-	} else {
-		/*fprintf(stderr, "transfer status: %d\n", xfer->status);*/
-	}
+	if (r == LIBUSB_ERROR_TIMEOUT)
+		r = 0;
+
+	return r;
 }
 
-static int _osmosdr_alloc_async_buffers(osmosdr_dev_t *dev)
+static uint64_t _osmosdr_time_us(void)
 {
-	unsigned int i;
+#ifdef _WIN32
+	LARGE_INTEGER cnt, freq;
 
-	if (!dev)
-		return -1;
+	QueryPerformanceCounter(&cnt);
+	QueryPerformanceFrequency(&freq);
 
-	if (!dev->xfer) {
-		dev->xfer = malloc(dev->xfer_buf_num *
-				   sizeof(struct libusb_transfer *));
+	return (uint64_t)(cnt.QuadPart / freq.QuadPart) * 1000000 +
+	       (uint64_t)(cnt.QuadPart % freq.QuadPart) * 1000000 /
+	       freq.QuadPart;
+#else
+	struct timespec ts;
 
-		for(i = 0; i < dev->xfer_buf_num; ++i)
-			dev->xfer[i] = libusb_alloc_transfer(0);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static uint64_t _osmosdr_time_ms(void)
+{
+	return _osmosdr_time_us() / 1000;
+}
+
+/* poll until the device has executed all writes sent so far */
+static int _osmosdr_wait_idle(osmosdr_dev_t *dev, unsigned int timeout_ms,
+			      struct osmosdr_command_status *st)
+{
+	uint64_t deadline;
+	int r;
+
+	deadline = _osmosdr_time_ms() + timeout_ms;
+
+	for (;;) {
+		r = osmosdr_get_command_status(dev, st);
+		if (r < 0)
+			return r;
+
+		if (st->completed == st->submitted)
+			return 0;
+
+		if (_osmosdr_time_ms() >= deadline)
+			return -ETIMEDOUT;
+
+		usleep(CMD_POLL_US);
+	}
+}
+
+int osmosdr_wait_commands(osmosdr_dev_t *dev, unsigned int timeout_ms)
+{
+	struct osmosdr_command_status st;
+	int r;
+
+	if (!dev)
+		return -1;
+
+	r = _osmosdr_wait_idle(dev, timeout_ms, &st);
+	if (LIBUSB_ERROR_PIPE == r)
+		return 0; /* older firmware, writes ran synchronously */
+	if (r < 0)
+		return r;
+
+	if (st.errors != dev->cmd_errors) {
+		dev->cmd_errors = st.errors;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* Synchronous setters take a mark before their writes and only report a
+ * failure of their own request submitted after it. Hops, AGC steps and
+ * timed commands fail on their own time and are left to
+ * osmosdr_wait_commands(). The device keeps only the last failure, so one
+ * of somebody else right after ours hides it. */
+static void _osmosdr_cmd_mark(osmosdr_dev_t *dev,
+			      struct osmosdr_command_status *mark)
+{
+	if (osmosdr_get_command_status(dev, mark) < 0)
+		memset(mark, 0, sizeof(*mark));
+}
+
+static int _osmosdr_wait_own(osmosdr_dev_t *dev,
+			     const struct osmosdr_command_status *mark,
+			     uint16_t func)
+{
+	struct osmosdr_command_status st;
+	int r;
+
+	r = _osmosdr_wait_idle(dev, CMD_WAIT_TIMEOUT, &st);
+	if (LIBUSB_ERROR_PIPE == r)
+		return 0; /* older firmware, writes ran synchronously */
+	if (r < 0)
+		return r;
+
+	if (st.errors != mark->errors && st.last_err_func == func &&
+	    st.last_err_seq - mark->submitted < st.submitted - mark->submitted)
+		return -EIO;
+
+	return 0;
+}
+
+int osmosdr_power_sweep(osmosdr_dev_t *dev, uint32_t start, uint32_t step,
+			unsigned int count, uint32_t settle, uint32_t samples,
+			uint32_t *power)
+{
+	uint8_t buffer[SWEEP_READ_STEPS * 4];
+	struct osmosdr_command_status mark;
+	uint64_t deadline;
+	uint32_t rate, freq;
+	unsigned int i, j, n;
+	int r;
+
+	if (!dev || !power || !samples)
+		return -1;
+
+	if (!count || count > OSMOSDR_SWEEP_MAX_STEPS)
+		return -EINVAL;
+
+	/* the sweep leaves the tuner at its last step */
+	freq = dev->freq;
+
+	/* unknown rate: assume the highest decimation for the timeout */
+	rate = dev->rate ? dev->rate : dev->adc_clock / 64;
+
+	_osmosdr_cmd_mark(dev, &mark);
+
+	buffer[0] = (uint8_t)(settle >> 24);
+	buffer[1] = (uint8_t)(settle >> 16);
+	buffer[2] = (uint8_t)(settle >> 8);
+	buffer[3] = (uint8_t)(settle >> 0);
+	buffer[4] = (uint8_t)(samples >> 24);
+	buffer[5] = (uint8_t)(samples >> 16);
+	buffer[6] = (uint8_t)(samples >> 8);
+	buffer[7] = (uint8_t)(samples >> 0);
+
+	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0x07,
+				    FUNC(0, 0x05), 0,
+				    buffer, 8, CTRL_TIMEOUT);
+	if (r < 0)
+		return r;
+
+	buffer[0] = (uint8_t)(start >> 24);
+	buffer[1] = (uint8_t)(start >> 16);
+	buffer[2] = (uint8_t)(start >> 8);
+	buffer[3] = (uint8_t)(start >> 0);
+	buffer[4] = (uint8_t)(step >> 24);
+	buffer[5] = (uint8_t)(step >> 16);
+	buffer[6] = (uint8_t)(step >> 8);
+	buffer[7] = (uint8_t)(step >> 0);
+	buffer[8] = (uint8_t)(count >> 8);
+	buffer[9] = (uint8_t)(count >> 0);
+
+	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0x07,
+				    FUNC(0, 0x06), 0,
+				    buffer, 10, CTRL_TIMEOUT);
+	if (r < 0)
+		return r;
+
+	/* sweep_start() checks the step count */
+	r = _osmosdr_wait_own(dev, &mark, FUNC(0, 0x06));
+	if (r < 0)
+		return r;
+
+	deadline = _osmosdr_time_ms() + 1000 + count *
+		   ((uint64_t)(settle + samples) * 1000 / rate + SWEEP_STEP_MS);
+
+	for (;;) {
+		r = _osmosdr_ctrl_read(dev, FUNC(0, 0x02), 0, buffer, 16);
+		if (r < 0)
+			goto out;
+
+		if (_osmosdr_be32(buffer) == SWEEP_STATE_DONE)
+			break;
+
+		if (_osmosdr_time_ms() >= deadline) {
+			/* count 0 stops the sweep, samples go to USB again */
+			memset(buffer, 0, 10);
+			libusb_control_transfer(dev->devh, CTRL_OUT, 0x07,
+						FUNC(0, 0x06), 0,
+						buffer, 10, CTRL_TIMEOUT);
+			r = -ETIMEDOUT;
+			goto out;
+		}
+
+		usleep(SWEEP_POLL_US);
+	}
+
+	for (i = 0; i < count; i += n) {
+		n = min(count - i, SWEEP_READ_STEPS);
+
+		r = _osmosdr_ctrl_read(dev, FUNC(0, 0x03), i, buffer, n * 4);
+		if (r < 0)
+			goto out;
+
+		for (j = 0; j < n; j++)
+			power[i + j] = _osmosdr_be32(buffer + j * 4);
+	}
+
+	r = 0;
+out:
+	/* not tuned yet, nothing to go back to */
+	if (freq)
+		osmosdr_set_center_freq(dev, freq);
+
+	return r;
+}
+
+/* per buffer duration and total read-ahead of each profile, in us */
+static const struct {
+	uint32_t buf_time;
+	uint32_t queue_time;
+} _osmosdr_profiles[] = {
+	[OSMOSDR_PROFILE_LOW_LATENCY]	= {  2000,   40000 },
+	[OSMOSDR_PROFILE_BALANCED]	= { 10000,  250000 },
+	[OSMOSDR_PROFILE_THROUGHPUT]	= { 50000, 1000000 },
+};
+
+int osmosdr_get_profile_buffers(osmosdr_dev_t *dev,
+				enum osmosdr_buffer_profile profile,
+				uint32_t *buf_num, uint32_t *buf_len)
+{
+	uint64_t bps, len, num;
+
+	if (!dev)
+		return -1;
+
+	if (profile < OSMOSDR_PROFILE_LOW_LATENCY ||
+	    profile > OSMOSDR_PROFILE_THROUGHPUT)
+		return -EINVAL;
+
+	/* nothing to derive from yet */
+	if (!dev->rate)
+		return -2;
+
+	bps = (uint64_t)dev->rate * 2 * sizeof(int16_t);
+
+	len = bps * _osmosdr_profiles[profile].buf_time / 1000000;
+	len &= ~(uint64_t)511; /* len must be multiple of 512 */
+	if (len < 512)
+		len = 512;
+	if (len > MAX_BUF_LENGTH)
+		len = MAX_BUF_LENGTH;
+
+	num = bps * _osmosdr_profiles[profile].queue_time / 1000000;
+	num = (num + len - 1) / len;
+	if (num < MIN_BUF_NUMBER)
+		num = MIN_BUF_NUMBER;
+	if (num > MAX_BUF_NUMBER)
+		num = MAX_BUF_NUMBER;
+
+	if (buf_num)
+		*buf_num = (uint32_t)num;
+	if (buf_len)
+		*buf_len = (uint32_t)len;
+
+	return 0;
+}
+
+int osmosdr_set_buffer_profile(osmosdr_dev_t *dev,
+			       enum osmosdr_buffer_profile profile)
+{
+	if (!dev)
+		return -1;
+
+	if (profile < OSMOSDR_PROFILE_NONE ||
+	    profile > OSMOSDR_PROFILE_THROUGHPUT)
+		return -EINVAL;
+
+	dev->profile = profile;
+
+	return 0;
+}
+
+static void _osmosdr_latency_restart(osmosdr_dev_t *dev)
+{
+	struct latency_state *l = &dev->latency;
+
+	l->have_floor = 0;
+	l->bytes = 0;
+	l->n = 0;
+	l->sum = 0;
+	l->max = 0;
+}
+
+/*
+ * The time a sample was taken is unknown, but the sample clock is. Assume
+ * the fastest delivery seen so far had no transit delay at all, so what is
+ * measured is the delay of the first sample of each buffer on top of that:
+ * the buffer fill time plus any queueing in the device, USB and libusb.
+ */
+static void _osmosdr_latency_update(osmosdr_dev_t *dev, uint32_t len)
+{
+	struct latency_state *l = &dev->latency;
+	uint64_t bps = (uint64_t)dev->rate * 2 * sizeof(int16_t);
+	int64_t now = (int64_t)_osmosdr_time_us();
+	int64_t start, end, lat;
+
+	if (!bps)
+		return;
+
+	start = (int64_t)(l->bytes * 1000000 / bps);
+	l->bytes += len;
+	end = (int64_t)(l->bytes * 1000000 / bps);
+
+	if (!l->have_floor || now - end < l->floor) {
+		l->floor = now - end;
+		l->have_floor = 1;
+	}
+
+	lat = now - (l->floor + start);
+
+	l->n++;
+	l->sum += lat;
+	if (lat > l->max)
+		l->max = (uint32_t)lat;
+}
+
+static void _integrity_event(struct integrity_state *c, uint64_t pos,
+			     uint32_t lost)
+{
+	struct osmosdr_integrity_stats *st = &c->st;
+
+	st->discontinuities++;
+	st->dropped += lost;
+
+	st->events[st->num_events % OSMOSDR_INTEGRITY_EVENTS].pos = pos;
+	st->events[st->num_events % OSMOSDR_INTEGRITY_EVENTS].lost = lost;
+	st->num_events++;
+}
+
+/* scalar walk over a block known to contain a discontinuity */
+static void _integrity_scan(struct integrity_state *c, const uint16_t *iq,
+			    uint32_t n)
+{
+	uint16_t di, dq;
+	uint32_t k;
+
+	for (k = 0; k < n; k++, iq += 2) {
+		/* I counts down, Q counts up, both by one per sample */
+		di = c->last_i - iq[0];
+		dq = iq[1] - c->last_q;
+
+		/* a repeated pair, nothing was lost */
+		if (!di && !dq) {
+			c->st.corrupt++;
+			continue;
+		}
+
+		if (di != 1 || dq != 1) {
+			if (di == dq) {
+				_integrity_event(c, c->st.samples + k, di - 1);
+			} else {
+				/* keep following the sequence */
+				c->st.corrupt++;
+				c->last_i--;
+				c->last_q++;
+				continue;
+			}
+		}
+
+		c->last_i = iq[0];
+		c->last_q = iq[1];
+	}
+}
+
+/*
+ * Compare whole blocks against the expected counter values without
+ * branching, so the compiler can vectorize it. Only blocks that don't match
+ * are walked sample by sample to find and size the discontinuities.
+ */
+static void _osmosdr_integrity_process(osmosdr_dev_t *dev,
+				       const unsigned char *buf, uint32_t len)
+{
+	struct integrity_state *c = &dev->integrity;
+	const uint16_t *iq = (const uint16_t *)buf;
+	uint32_t n = len / (2 * sizeof(uint16_t));
+	uint32_t k, blk;
+	uint16_t bad;
+
+	if (!n)
+		return;
+
+	if (!c->have_last) {
+		c->last_i = iq[0] + 1;
+		c->last_q = iq[1] - 1;
+		c->have_last = 1;
+	}
+
+	while (n) {
+		blk = min(n, INTEGRITY_BLOCK);
+		bad = 0;
+
+		for (k = 0; k < blk; k++) {
+			bad |= iq[2 * k] ^ (uint16_t)(c->last_i - 1 - k);
+			bad |= iq[2 * k + 1] ^ (uint16_t)(c->last_q + 1 + k);
+		}
+
+		if (bad) {
+			_integrity_scan(c, iq, blk);
+		} else {
+			c->last_i = iq[2 * (blk - 1)];
+			c->last_q = iq[2 * (blk - 1) + 1];
+		}
+
+		c->st.samples += blk;
+		iq += 2 * blk;
+		n -= blk;
+	}
+}
+
+int osmosdr_set_integrity_check(osmosdr_dev_t *dev, int on)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+
+	r = osmosdr_set_fpga_reg(dev, INTEGRITY_REG, on ? 1 : 0);
+	if (r < 0)
+		return r;
+
+	memset(&dev->integrity, 0, sizeof(dev->integrity));
+	dev->integrity.enabled = on;
+
+	/* both would act on the counters instead of a signal */
+	if (on) {
+		dev->iq_cal.enabled = 0;
+		dev->agc.enabled = 0;
+	}
+
+	return 0;
+}
+
+int osmosdr_get_integrity_stats(osmosdr_dev_t *dev,
+				struct osmosdr_integrity_stats *stats)
+{
+	if (!dev || !stats)
+		return -1;
+
+	if (!dev->integrity.enabled)
+		return -2;
+
+	memcpy(stats, &dev->integrity.st, sizeof(*stats));
+
+	return 0;
+}
+
+int osmosdr_set_latency_measurement(osmosdr_dev_t *dev, int on)
+{
+	if (!dev)
+		return -1;
+
+	_osmosdr_latency_restart(dev);
+	dev->latency.enabled = on;
+
+	return 0;
+}
+
+int osmosdr_get_latency(osmosdr_dev_t *dev, uint32_t *avg_us, uint32_t *max_us)
+{
+	struct latency_state *l;
+
+	if (!dev)
+		return -1;
+
+	l = &dev->latency;
+	if (!l->enabled)
+		return -2;
+
+	if (avg_us)
+		*avg_us = l->n ? (uint32_t)(l->sum / l->n) : 0;
+	if (max_us)
+		*max_us = l->max;
+
+	return 0;
+}
+
+/*
+ * Fit a line through the arrival times of the last buffers. USB and the
+ * scheduler can only delay a buffer, never deliver it early, so the line
+ * is moved down onto the earliest arrival and the jitter is measured as
+ * the distance above it.
+ */
+static void _osmosdr_ts_update(osmosdr_dev_t *dev, uint64_t n_end, uint64_t t)
+{
+	struct ts_state *ts = &dev->ts;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	double x, y, d, a, b, res, min_res, sq = 0, max = 0;
+	uint32_t i, k, first;
+
+	if (ts->restart) {
+		ts->fill = 0;
+		ts->valid = 0;
+		ts->restart = 0;
+	}
+
+	ts->n[ts->head] = n_end;
+	ts->t[ts->head] = t;
+	ts->head = (ts->head + 1) % TS_WINDOW;
+	if (ts->fill < TS_WINDOW)
+		ts->fill++;
+
+	/* a few buffers are needed for a meaningful slope */
+	if (ts->fill < 4)
+		return;
+
+	first = (ts->head + TS_WINDOW - ts->fill) % TS_WINDOW;
+
+	for (k = 0; k < ts->fill; k++) {
+		i = (first + k) % TS_WINDOW;
+		x = (double)(ts->n[i] - ts->n[first]);
+		y = (double)(ts->t[i] - ts->t[first]);
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	d = ts->fill * sxx - sx * sx;
+	if (d <= 0)
+		return;
+
+	b = (ts->fill * sxy - sx * sy) / d;
+	a = (sy - b * sx) / ts->fill;
+
+	min_res = 0;
+	for (k = 0; k < ts->fill; k++) {
+		i = (first + k) % TS_WINDOW;
+		res = (double)(ts->t[i] - ts->t[first]) -
+		      (a + b * (double)(ts->n[i] - ts->n[first]));
+		if (!k || res < min_res)
+			min_res = res;
+	}
+
+	a += min_res;
+
+	for (k = 0; k < ts->fill; k++) {
+		i = (first + k) % TS_WINDOW;
+		res = (double)(ts->t[i] - ts->t[first]) -
+		      (a + b * (double)(ts->n[i] - ts->n[first]));
+		sq += res * res;
+		if (res > max)
+			max = res;
+	}
+
+	ts->n_ref = ts->n[first];
+	ts->t_ref = ts->t[first];
+	ts->a = a;
+	ts->b = b;
+	ts->jitter_rms = sqrt(sq / ts->fill);
+	ts->jitter_max = max;
+	ts->valid = 1;
+}
+
+static uint64_t _osmosdr_ts_time(struct ts_state *ts, uint64_t index)
+{
+	double dt = ts->a + ts->b * ((double)index - (double)ts->n_ref);
+
+	return (uint64_t)((double)ts->t_ref + dt);
+}
+
+int osmosdr_get_sample_time(osmosdr_dev_t *dev, uint64_t index,
+			    uint64_t *time_us)
+{
+	if (!dev || !time_us)
+		return -1;
+
+	if (!dev->ts.valid)
+		return -2;
+
+	*time_us = _osmosdr_ts_time(&dev->ts, index);
+
+	return 0;
+}
+
+int osmosdr_get_timing_stats(osmosdr_dev_t *dev,
+			     struct osmosdr_timing_stats *stats)
+{
+	struct ts_state *ts;
+
+	if (!dev || !stats)
+		return -1;
+
+	ts = &dev->ts;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->samples = ts->count;
+
+	if (!ts->valid)
+		return -2;
+
+	/* b is the measured sample period in us */
+	if (dev->rate)
+		stats->clock_ppm = (int32_t)((1e6 / (ts->b * dev->rate) - 1) *
+					     1e6);
+
+	stats->jitter_rms_us = (uint32_t)ts->jitter_rms;
+	stats->jitter_max_us = (uint32_t)ts->jitter_max;
+
+	return 0;
+}
+
+int osmosdr_get_read_position(osmosdr_dev_t *dev, uint64_t *index)
+{
+	if (!dev || !index)
+		return -1;
+
+	if (!dev->sync_mode)
+		return -2;
+
+	/* nothing buffered, the next sample read is the next to arrive */
+	if (!dev->sync_count) {
+		*index = dev->ts.count;
+		return 0;
+	}
+
+	*index = dev->xfer_index[_osmosdr_xfer_idx(dev,
+				 dev->sync_fifo[dev->sync_head])] +
+		 dev->sync_offset / (2 * sizeof(int16_t));
+
+	return 0;
+}
+
+static void _osmosdr_report(osmosdr_dev_t *dev, enum osmosdr_event_type type,
+			    uint64_t samples)
+{
+	if (dev->event_cb)
+		dev->event_cb(dev, type, samples, dev->event_ctx);
+}
+
+static int _osmosdr_framing_header(osmosdr_dev_t *dev)
+{
+	struct framing_state *f = &dev->framing;
+	const uint8_t *h = f->hdr;
+	uint16_t len = h[4] | (h[5] << 8);
+	uint16_t seq = h[6] | (h[7] << 8);
+	uint32_t ctr = h[8] | (h[9] << 8) | (h[10] << 16) | ((uint32_t)h[11] << 24);
+	uint32_t ovrun = h[12] | (h[13] << 8) | (h[14] << 16) | ((uint32_t)h[15] << 24);
+	uint32_t cmd_ctr = 0;
+	uint16_t cmd_tag = 0, cmd_seq = 0;
+	uint8_t hdr_len = h[2];
+	uint8_t flags = h[3];
+	uint32_t lost;
+
+	if ((h[0] | (h[1] << 8)) != FRAME_MAGIC || hdr_len < FRAME_HDR_MIN ||
+	    len <= hdr_len || (len - hdr_len) % 4)
+		return -1;
+
+	/* older firmware doesn't report timed commands */
+	if (hdr_len >= FRAME_HDR_LEN) {
+		cmd_ctr = h[16] | (h[17] << 8) | (h[18] << 16) |
+			  ((uint32_t)h[19] << 24);
+		cmd_tag = h[20] | (h[21] << 8);
+		cmd_seq = h[22] | (h[23] << 8);
+	}
+
+	f->st.frames++;
+
+	if (f->have_last) {
+		/* the sample counter is exact, the sequence number is only
+		 * kept for the statistics */
+		if (ctr != f->next_ctr) {
+			lost = ctr - f->next_ctr;
+			f->st.lost += lost;
+			dev->gap += lost;
+		}
+
+		if (seq != f->next_seq)
+			f->st.seq_errors += (uint16_t)(seq - f->next_seq);
+
+		if (flags & FRAME_F_RESTART) {
+			/* the firmware can't tell how much it missed */
+			f->st.restarts++;
+			dev->ts.restart = 1;
+			_osmosdr_report(dev, OSMOSDR_EVENT_DISCONTINUITY, 0);
+		}
+
+		if ((flags & FRAME_F_OVERRUN) && ovrun != f->last_ovrun) {
+			f->st.overruns += ovrun - f->last_ovrun;
+			_osmosdr_report(dev, OSMOSDR_EVENT_OVERRUN,
+					ovrun - f->last_ovrun);
+		}
+
+		/* 0 after a restart of the device side */
+		if (cmd_seq && cmd_seq != f->cmd_seq) {
+			f->cmd_tag = cmd_tag;
+			f->cmd_ctr = cmd_ctr;
+			_osmosdr_report(dev, OSMOSDR_EVENT_TIMED_COMMAND,
+					cmd_ctr);
+		}
+	}
+
+	f->cmd_seq = cmd_seq;
+
+	f->have_last = 1;
+	f->next_seq = seq + 1;
+	f->next_ctr = ctr + (len - hdr_len) / (2 * sizeof(int16_t));
+	f->last_ovrun = ovrun;
+	f->hdr_skip = hdr_len > FRAME_HDR_LEN ? hdr_len - FRAME_HDR_LEN : 0;
+	f->payload_left = len - hdr_len;
+
+	return 0;
+}
+
+/* Drop the frame headers by moving the samples down in place. Returns the
+ * number of sample bytes left in the buffer. */
+static uint32_t _osmosdr_framing_strip(osmosdr_dev_t *dev, unsigned char *buf,
+				       uint32_t len)
+{
+	struct framing_state *f = &dev->framing;
+	uint32_t in = 0, out = 0, n, want;
+
+	f->buf_ctr_valid = 0;
+
+	if (f->resync) {
+		f->resync = 0;
+		f->hdr_fill = 0;
+		f->hdr_skip = 0;
+		f->payload_left = 0;
+	}
+
+	while (in < len) {
+		if (f->hdr_skip) {
+			n = min(f->hdr_skip, len - in);
+			in += n;
+			f->hdr_skip -= n;
+			continue;
+		}
+
+		if (f->payload_left) {
+			if (!f->buf_ctr_valid) {
+				f->buf_ctr = f->next_ctr - f->payload_left /
+					     (2 * sizeof(int16_t));
+				f->buf_ctr_valid = 1;
+			}
+
+			n = min(f->payload_left, len - in);
+			if (out != in)
+				memmove(buf + out, buf + in, n);
+			out += n;
+			in += n;
+			f->payload_left -= n;
+			continue;
+		}
+
+		/* the fixed part tells how long the whole header is */
+		want = FRAME_HDR_MIN;
+		if (f->hdr_fill >= FRAME_HDR_MIN)
+			want = min(f->hdr[2], FRAME_HDR_LEN);
+
+		if (f->hdr_fill < want) {
+			n = min(want - f->hdr_fill, len - in);
+			memcpy(f->hdr + f->hdr_fill, buf + in, n);
+			f->hdr_fill += n;
+			in += n;
+
+			if (f->hdr_fill < want)
+				break;
+
+			if (want == FRAME_HDR_MIN && f->hdr[2] > FRAME_HDR_MIN)
+				continue;
+		}
+
+		f->hdr_fill = 0;
+
+		if (_osmosdr_framing_header(dev) < 0) {
+			/* the next good header tells what was lost */
+			f->st.resyncs++;
+			f->resync = 1;
+			break;
+		}
+	}
+
+	return out;
+}
+
+static void _osmosdr_framing_restart(osmosdr_dev_t *dev)
+{
+	dev->framing.resync = 1;
+	dev->framing.have_last = 0;
+}
+
+static void _osmosdr_device_lost(osmosdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (OSMOSDR_RECOVERY_LOST == dev->recovery)
+		return;
+
+	dev->recovery = OSMOSDR_RECOVERY_LOST;
+	dev->lost_at = _osmosdr_time_ms();
+	dev->reopen_at = dev->lost_at;
+	dev->reopen_tries = 0;
+
+	/* whatever is still in flight won't complete anymore */
+	for (i = 0; i < dev->xfer_buf_num; ++i) {
+		dev->xfer_retry[i] = 0;
+		libusb_cancel_transfer(dev->xfer[i]);
+	}
+
+	_osmosdr_report(dev, OSMOSDR_EVENT_DEVICE_LOST, 0);
+}
+
+/* park a failed transfer, _osmosdr_recover() submits it again later */
+static void _osmosdr_retry_later(osmosdr_dev_t *dev,
+				 struct libusb_transfer *xfer)
+{
+	unsigned int i, shift;
+
+	if (OSMOSDR_RECOVERY_LOST == dev->recovery)
+		return;
+
+	if (++dev->err_streak > RECOVERY_RETRY_MAX) {
+		/* not going to get better by itself, start over */
+		_osmosdr_device_lost(dev);
+		return;
+	}
+
+	for (i = 0; i < dev->xfer_buf_num; ++i) {
+		if (dev->xfer[i] != xfer)
+			continue;
+
+		shift = min(dev->err_streak - 1, 5);
+		dev->xfer_retry[i] = _osmosdr_time_ms() +
+				     (RECOVERY_RETRY_MS << shift);
+		dev->recovery = OSMOSDR_RECOVERY_RETRY;
+		break;
+	}
+}
+
+static void _osmosdr_resubmit(osmosdr_dev_t *dev, struct libusb_transfer *xfer)
+{
+	int r;
+
+	/* osmosdr_resume() will submit it again */
+	if (dev->paused)
+		return;
+
+	/* the buffers went away with a failed reopen */
+	if (OSMOSDR_RECOVERY_FAILED == dev->recovery)
+		return;
+
+	r = libusb_submit_transfer(xfer);
+	if (!r)
+		atomic_inc(&dev->xfer_active);
+	else if (LIBUSB_ERROR_NO_DEVICE == r)
+		_osmosdr_device_lost(dev);
+	else
+		_osmosdr_retry_later(dev, xfer);
+}
+
+static void _osmosdr_fill_transfers(osmosdr_dev_t *dev)
+{
+	unsigned int i;
+
+	for(i = 0; i < dev->xfer_buf_num; ++i) {
+		libusb_fill_bulk_transfer(dev->xfer[i],
+					  dev->devh,
+					  0x86,
+					  dev->xfer_buf[i],
+					  dev->xfer_buf_len,
+					  _libusb_callback,
+					  (void *)dev,
+					  BULK_TIMEOUT);
+	}
+}
+
+/* look for the device by its serial number and swap in the new handle */
+static int _osmosdr_reopen(osmosdr_dev_t *dev)
+{
+	libusb_device **list;
+	libusb_device_handle *devh = NULL;
+	struct libusb_device_descriptor dd;
+	struct osmosdr_command_status cmd_status;
+	struct agc_gains g;
+	char serial[256];
+	uint8_t path[USB_PATH_MAX];
+	uint8_t on = 1;
+	ssize_t cnt;
+	int i, n, r;
+
+	cnt = libusb_get_device_list(dev->ctx, &list);
+	if (cnt < 0)
+		return (int)cnt;
+
+	for (i = 0; i < cnt; i++) {
+		libusb_get_device_descriptor(list[i], &dd);
+
+		if (!find_known_device(dd.idVendor, dd.idProduct))
+			continue;
+
+		/* any other device without a serial would match as well,
+		 * only accept the one on the same port */
+		if (!dev->serial[0]) {
+			n = _osmosdr_usb_path(list[i], path);
+			if (!n || n != dev->usb_path_len ||
+			    memcmp(path, dev->usb_path, n))
+				continue;
+		}
+
+		if (libusb_open(list[i], &devh) < 0)
+			continue;
+
+		memset(serial, 0, sizeof(serial));
+		libusb_get_string_descriptor_ascii(devh, dd.iSerialNumber,
+						   (unsigned char *)serial,
+						   sizeof(serial));
+
+		if (!strcmp(serial, dev->serial) &&
+		    libusb_claim_interface(devh, 0) >= 0)
+			break;
+
+		libusb_close(devh);
+		devh = NULL;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	if (!devh)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	/* usbfs memory belongs to the old handle */
+	_osmosdr_free_pool(dev);
+
+	libusb_release_interface(dev->devh, 0);
+	libusb_close(dev->devh);
+	dev->devh = devh;
+
+	/* the counters may have started over along with the device */
+	if (!osmosdr_get_command_status(dev, &cmd_status))
+		dev->cmd_errors = cmd_status.errors;
+
+	if (dev->tuner && dev->tuner->init)
+		dev->tuner->init(dev);
+
+	/* bring the device back to where it was */
+	if (dev->rate)
+		osmosdr_set_sample_rate(dev, dev->rate);
+
+	if (dev->iq_swap)
+		osmosdr_set_fpga_iq_swap(dev, dev->iq_swap);
+
+	osmosdr_set_fpga_iq_gain(dev, dev->igain, dev->qgain);
+	osmosdr_set_fpga_iq_ofs(dev, dev->iofs, dev->qofs);
+
+	/* not through osmosdr_set_tuner_gain*(), they would turn the agc off */
+	if (dev->gain_mode >= 0 && dev->tuner->set_gain_mode)
+		dev->tuner->set_gain_mode(dev, dev->gain_mode);
+
+	if (dev->agc.enabled) {
+		/* all stages, so the ladder and the tuner agree again */
+		_agc_step_gains(dev->agc.idx, &g);
+		osmosdr_set_tuner_lna_gain(dev, g.lna);
+		osmosdr_set_tuner_mixer_gain(dev, g.mixer);
+		osmosdr_set_tuner_if_gain(dev, 2, g.if2);
+		osmosdr_set_tuner_if_gain(dev, 3, g.if3);
+	} else if (dev->gain_mode > 0 && dev->tuner->set_gain) {
+		dev->tuner->set_gain(dev, dev->gain);
+	}
+
+	dev->agc.pending = 0;
+
+	if (dev->freq)
+		osmosdr_set_center_freq(dev, dev->freq);
+
+	/* the counters may have started over, don't take that as a gap */
+	if (dev->framing.enabled) {
+		libusb_control_transfer(dev->devh, CTRL_OUT, 0x07,
+					FUNC(0, 0x03), 0,
+					&on, sizeof(on), CTRL_TIMEOUT);
+		_osmosdr_framing_restart(dev);
+	}
+
+	r = _osmosdr_alloc_pool(dev);
+	if (r < 0)
+		return r;
+
+	_osmosdr_fill_transfers(dev);
+
+	return 0;
+}
+
+/* called outside of the transfer callbacks, whenever events were handled */
+static void _osmosdr_recover(osmosdr_dev_t *dev)
+{
+	uint64_t now;
+	unsigned int i;
+	int waiting = 0;
+	int r;
+
+	if (OSMOSDR_RECOVERY_NONE == dev->recovery ||
+	    OSMOSDR_RECOVERY_FAILED == dev->recovery || dev->paused)
+		return;
+
+	now = _osmosdr_time_ms();
+
+	if (OSMOSDR_RECOVERY_RETRY == dev->recovery) {
+		if (dev->clear_halt) {
+			libusb_clear_halt(dev->devh, 0x86);
+			dev->clear_halt = 0;
+		}
+
+		for (i = 0; i < dev->xfer_buf_num; ++i) {
+			if (!dev->xfer_retry[i])
+				continue;
+
+			if (dev->xfer_retry[i] > now) {
+				waiting = 1;
+				continue;
+			}
+
+			dev->xfer_retry[i] = 0;
+			_osmosdr_resubmit(dev, dev->xfer[i]);
+
+			/* may have escalated meanwhile */
+			if (OSMOSDR_RECOVERY_RETRY != dev->recovery)
+				return;
+		}
+
+		if (!waiting)
+			dev->recovery = OSMOSDR_RECOVERY_NONE;
+
+		return;
+	}
+
+	/* device lost: wait for libusb to return all transfers first */
+	if (atomic_get(&dev->xfer_active) || now < dev->reopen_at)
+		return;
+
+	r = _osmosdr_reopen(dev);
+	if (r == -ENOMEM) {
+		/* the old pool is gone, the reader has to give up */
+		dev->recovery = OSMOSDR_RECOVERY_FAILED;
+		dev->sync_error = r;
+		return;
+	} else if (r < 0) {
+		dev->reopen_tries++;
+		dev->reopen_at = now + min(RECOVERY_REOPEN_MS <<
+					   min(dev->reopen_tries, 5),
+					   RECOVERY_REOPEN_MAX_MS);
+		return;
+	}
+
+	now = _osmosdr_time_ms();
+
+	dev->gap += (now - dev->lost_at) * dev->rate / 1000;
+	dev->recovery = OSMOSDR_RECOVERY_NONE;
+	dev->err_streak = 0;
+
+	/* what was queued in the read-ahead is from before the loss */
+	dev->sync_head = 0;
+	dev->sync_count = 0;
+	dev->sync_offset = 0;
+
+	dev->latency.bytes = 0;
+	dev->latency.have_floor = 0;
+
+	_osmosdr_report(dev, OSMOSDR_EVENT_DEVICE_RESTORED, 0);
+
+	for (i = 0; i < dev->xfer_buf_num; ++i)
+		_osmosdr_resubmit(dev, dev->xfer[i]);
+}
+
+/* finishes osmosdr_resume() once the cancelled transfers are back */
+static void _osmosdr_resume_process(osmosdr_dev_t *dev)
+{
+	unsigned int i;
+	int r;
+
+	if (!atomic_get(&dev->resume) || atomic_get(&dev->xfer_active))
+		return;
+
+	atomic_xchg(&dev->resume, 0);
+
+	if (OSMOSDR_RUNNING != dev->async_status || !dev->paused)
+		return;
+
+	/* stale samples are still better than not streaming at all */
+	r = osmosdr_reset_buffer(dev);
+	if (r < 0)
+		fprintf(stderr, "flushing the device buffer failed: %d\n", r);
+
+	dev->sync_head = 0;
+	dev->sync_count = 0;
+	dev->sync_offset = 0;
+	dev->sync_error = 0;
+	dev->paused = 0;
+
+	/* everything gets submitted below */
+	if (OSMOSDR_RECOVERY_RETRY == dev->recovery)
+		dev->recovery = OSMOSDR_RECOVERY_NONE;
+	memset(dev->xfer_retry, 0, dev->xfer_buf_num * sizeof(uint64_t));
+
+	/* samples were dropped, start a new timeline */
+	dev->latency.bytes = 0;
+	dev->latency.have_floor = 0;
+	_osmosdr_framing_restart(dev);
+
+	for (i = 0; i < dev->xfer_buf_num; ++i)
+		_osmosdr_resubmit(dev, dev->xfer[i]);
+}
+
+/* how long to wait for events before recovery needs attention again */
+static void _osmosdr_event_timeout(osmosdr_dev_t *dev, struct timeval *tv)
+{
+	if ((OSMOSDR_RECOVERY_NONE != dev->recovery ||
+	     atomic_get(&dev->resume)) &&
+	    (tv->tv_sec || tv->tv_usec > RECOVERY_POLL_MS * 1000)) {
+		tv->tv_sec = 0;
+		tv->tv_usec = RECOVERY_POLL_MS * 1000;
+	}
+}
+
+int osmosdr_set_event_callback(osmosdr_dev_t *dev, osmosdr_event_cb_t cb,
+			       void *ctx)
+{
+	if (!dev)
+		return -1;
+
+	dev->event_cb = cb;
+	dev->event_ctx = ctx;
+
+	return 0;
+}
+
+/* pull data out of the completed transfers queued by the read-ahead */
+static int _osmosdr_read_ring(osmosdr_dev_t *dev, unsigned char *buf, int len,
+			      int *n_read, unsigned int timeout)
+{
+	uint64_t deadline = timeout ? _osmosdr_time_ms() + timeout : 0;
+	int done = 0;
+	int r = 0;
+
+	while (done < len) {
+		struct libusb_transfer *xfer;
+		int chunk;
+
+		/* a requested resume flushes the queue first */
+		if (!dev->sync_count || dev->paused) {
+			struct timeval tv = { 0, 100000 };
+
+			if (dev->sync_error) {
+				r = dev->sync_error;
+				break;
+			}
+
+			if (deadline) {
+				uint64_t now = _osmosdr_time_ms();
+
+				if (now >= deadline) {
+					r = LIBUSB_ERROR_TIMEOUT;
+					break;
+				}
+
+				if (deadline - now < 100)
+					tv.tv_usec = (deadline - now) * 1000;
+			}
+
+			_osmosdr_event_timeout(dev, &tv);
+
+			r = libusb_handle_events_timeout(dev->ctx, &tv);
+			if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+				break;
+
+			_osmosdr_resume_process(dev);
+			_osmosdr_recover(dev);
+
+			r = 0;
+			continue;
+		}
+
+		xfer = dev->sync_fifo[dev->sync_head];
+		chunk = min(xfer->actual_length - (int)dev->sync_offset,
+			    len - done);
+
+		memcpy(buf + done, xfer->buffer + dev->sync_offset, chunk);
+		done += chunk;
+		dev->sync_offset += chunk;
+
+		/* hand the transfer back to libusb once it is drained */
+		if (dev->sync_offset >= (uint32_t)xfer->actual_length) {
+			dev->sync_offset = 0;
+			dev->sync_head = (dev->sync_head + 1) % dev->xfer_buf_num;
+			dev->sync_count--;
+			_osmosdr_resubmit(dev, xfer);
+		}
+	}
+
+	if (n_read)
+		*n_read = done;
+
+	return r;
+}
+
+int osmosdr_set_stream_framing(osmosdr_dev_t *dev, int on)
+{
+	uint8_t buffer[1];
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (atomic_get(&dev->xfer_active) || dev->sync_mode)
+		return -2;
+
+	buffer[0] = on ? 1 : 0;
+
+	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0x07,
+				    FUNC(0, 0x03), 0,
+				    buffer, sizeof(buffer), CTRL_TIMEOUT);
+	if (r < 0)
+		return r;
+
+	memset(&dev->framing, 0, sizeof(dev->framing));
+	dev->framing.enabled = on;
+	_osmosdr_framing_restart(dev);
+
+	return 0;
+}
+
+int osmosdr_get_framing_stats(osmosdr_dev_t *dev,
+			      struct osmosdr_framing_stats *stats)
+{
+	if (!dev || !stats)
+		return -1;
+
+	if (!dev->framing.enabled)
+		return -2;
+
+	memcpy(stats, &dev->framing.st, sizeof(*stats));
+
+	return 0;
+}
+
+int osmosdr_get_buffer_sample_ctr(osmosdr_dev_t *dev, uint32_t *ctr)
+{
+	if (!dev || !ctr)
+		return -1;
+
+	if (!dev->framing.enabled || !dev->framing.buf_ctr_valid)
+		return -2;
+
+	*ctr = dev->framing.buf_ctr;
+
+	return 0;
+}
+
+static int _osmosdr_schedule(osmosdr_dev_t *dev, uint32_t at, uint16_t tag,
+			     uint16_t func, const uint8_t *data, uint16_t len)
+{
+	uint8_t buffer[TIMED_CMD_LEN];
+
+	if (!dev)
+		return -1;
+
+	memset(buffer, 0, sizeof(buffer));
+	buffer[0] = (uint8_t)(at >> 24);
+	buffer[1] = (uint8_t)(at >> 16);
+	buffer[2] = (uint8_t)(at >> 8);
+	buffer[3] = (uint8_t)(at >> 0);
+	buffer[4] = (uint8_t)(tag >> 8);
+	buffer[5] = (uint8_t)(tag >> 0);
+	buffer[6] = (uint8_t)(func >> 8);
+	buffer[7] = (uint8_t)(func >> 0);
+	memcpy(buffer + 8, data, len);
+
+	/* usually called from the sample callback */
+	return _osmosdr_ctrl_write_async(dev, FUNC(0, 0x04), buffer,
+					 sizeof(buffer), NULL);
+}
+
+int osmosdr_schedule_center_freq(osmosdr_dev_t *dev, uint32_t at,
+				 uint32_t freq, uint16_t tag)
+{
+	uint8_t buffer[4];
+
+	buffer[0] = (uint8_t)(freq >> 24);
+	buffer[1] = (uint8_t)(freq >> 16);
+	buffer[2] = (uint8_t)(freq >> 8);
+	buffer[3] = (uint8_t)(freq >> 0);
+
+	return _osmosdr_schedule(dev, at, tag, FUNC(3, 0x05),
+				 buffer, sizeof(buffer));
+}
+
+int osmosdr_schedule_hop(osmosdr_dev_t *dev, uint32_t at, int index,
+			 uint16_t tag)
+{
+	uint16_t func_index = (OSMOSDR_HOP_NEXT == index) ? HOP_NEXT : index;
+	uint8_t buffer[2];
+
+	buffer[0] = (uint8_t)(func_index >> 8);
+	buffer[1] = (uint8_t)(func_index >> 0);
+
+	return _osmosdr_schedule(dev, at, tag, FUNC(3, 0x11),
+				 buffer, sizeof(buffer));
+}
+
+int osmosdr_schedule_tuner_lna_gain(osmosdr_dev_t *dev, uint32_t at,
+				    int gain, uint16_t tag)
+{
+	uint8_t buffer[4];
+
+	buffer[0] = (uint8_t)(gain >> 24);
+	buffer[1] = (uint8_t)(gain >> 16);
+	buffer[2] = (uint8_t)(gain >> 8);
+	buffer[3] = (uint8_t)(gain >> 0);
+
+	return _osmosdr_schedule(dev, at, tag, FUNC(3, 0x0b),
+				 buffer, sizeof(buffer));
+}
+
+int osmosdr_get_timed_command(osmosdr_dev_t *dev, uint16_t *tag,
+			      uint32_t *ctr)
+{
+	if (!dev)
+		return -1;
+
+	if (!dev->framing.enabled || !dev->framing.cmd_seq)
+		return -2;
+
+	if (tag)
+		*tag = dev->framing.cmd_tag;
+	if (ctr)
+		*ctr = dev->framing.cmd_ctr;
+
+	return 0;
+}
+
+int osmosdr_read_sync(osmosdr_dev_t *dev, void *buf, int len, int *n_read)
+{
+	return osmosdr_read_sync_timeout(dev, buf, len, n_read, BULK_TIMEOUT);
+}
+
+int osmosdr_read_sync_timeout(osmosdr_dev_t *dev, void *buf, int len,
+			      int *n_read, unsigned int timeout)
+{
+	int done = 0;
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (dev->paused && !atomic_get(&dev->resume))
+		return -2;
+
+	if (dev->sync_mode)
+		return _osmosdr_read_ring(dev, buf, len, n_read, timeout);
+
+	r = libusb_bulk_transfer(dev->devh, 0x86, buf, len, &done, timeout);
+
+	if (dev->framing.enabled)
+		done = _osmosdr_framing_strip(dev, buf, done);
+
+	if (n_read)
+		*n_read = done;
+
+	return r;
+}
+
+static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
+{
+	osmosdr_dev_t *dev = (osmosdr_dev_t *)xfer->user_data;
+	struct osmosdr_buffer_info info;
+	uint64_t now = _osmosdr_time_us();
+
+	atomic_dec(&dev->xfer_active);
+
+	/* anything arriving after osmosdr_pause() is stale */
+	if (dev->paused) {
+		dev->ts.restart = 1;
+		return;
+	}
+
+	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
+		dev->err_streak = 0;
+		info.flags = 0;
+
+		/* before anything looks at the samples */
+		if (dev->framing.enabled)
+			xfer->actual_length = _osmosdr_framing_strip(dev,
+						xfer->buffer,
+						xfer->actual_length);
+
+		/* tell the consumer before handing out data after a gap */
+		if (dev->gap) {
+			_osmosdr_report(dev, OSMOSDR_EVENT_DISCONTINUITY,
+					dev->gap);
+			dev->ts.count += dev->gap;
+			dev->ts.restart = 1;
+			dev->gap = 0;
+		}
+
+		if (dev->ts.restart)
+			info.flags |= OSMOSDR_BUF_DISCONTINUITY;
+
+		info.sample_index = dev->ts.count;
+		info.arrival_us = now;
+
+		dev->xfer_index[_osmosdr_xfer_idx(dev, xfer)] = dev->ts.count;
+		dev->ts.count += xfer->actual_length / (2 * sizeof(int16_t));
+		_osmosdr_ts_update(dev, dev->ts.count, now);
+
+		info.sample_time_us = dev->ts.valid ?
+				      _osmosdr_ts_time(&dev->ts,
+						       info.sample_index) : 0;
+
+		if (dev->latency.enabled)
+			_osmosdr_latency_update(dev, xfer->actual_length);
+
+		if (dev->integrity.enabled)
+			_osmosdr_integrity_process(dev, xfer->buffer,
+						   xfer->actual_length);
+
+		if (dev->iq_cal.enabled)
+			_osmosdr_iq_cal_process(dev, xfer->buffer,
+						xfer->actual_length);
+
+		if (dev->agc.enabled)
+			_osmosdr_agc_process(dev, xfer->buffer,
+					     xfer->actual_length);
+
+		if (dev->sync_mode) {
+			/* queue for osmosdr_read_sync(), which resubmits */
+			dev->sync_fifo[(dev->sync_head + dev->sync_count) %
+				       dev->xfer_buf_num] = xfer;
+			dev->sync_count++;
+			return;
+		}
+
+		if (dev->ext_cb)
+			dev->ext_cb(xfer->buffer, xfer->actual_length, &info,
+				    dev->cb_ctx);
+		else if (dev->cb)
+			dev->cb(xfer->buffer, xfer->actual_length, dev->cb_ctx);
+
+		_osmosdr_resubmit(dev, xfer); /* resubmit transfer */
+	} else if (LIBUSB_TRANSFER_CANCELLED == xfer->status) {
+		/* nothing to do */
+	} else if (LIBUSB_TRANSFER_NO_DEVICE == xfer->status) {
+		dev->ts.restart = 1;
+		_osmosdr_device_lost(dev);
+	} else {
+		/*fprintf(stderr, "transfer status: %d\n", xfer->status);*/
+		if (LIBUSB_TRANSFER_STALL == xfer->status)
+			dev->clear_halt = 1;
+
+		/* whatever made it into the buffer is discarded, with framing
+		 * the next header tells how much exactly */
+		if (dev->framing.enabled)
+			dev->framing.resync = 1;
+		else
+			dev->gap += xfer->actual_length / (2 * sizeof(int16_t));
+
+		_osmosdr_retry_later(dev, xfer);
+	}
+}
+
+/*
+ * All sample buffers live in one region. The buffer length is a multiple of
+ * 512, so each one is followed by a cache line of padding to keep the starts
+ * of consecutive buffers out of the same cache sets.
+ */
+static size_t _osmosdr_pool_offset(osmosdr_dev_t *dev, unsigned int i)
+{
+	return (size_t)i * (dev->xfer_buf_len + POOL_CACHE_LINE);
+}
+
+/* which transfer a buffer belongs to, going by its place in the pool */
+static unsigned int _osmosdr_xfer_idx(osmosdr_dev_t *dev,
+				      struct libusb_transfer *xfer)
+{
+	return (xfer->buffer - dev->xfer_pool) /
+	       (dev->xfer_buf_len + POOL_CACHE_LINE);
+}
+
+static int _osmosdr_alloc_pool(osmosdr_dev_t *dev)
+{
+	size_t len = _osmosdr_pool_offset(dev, dev->xfer_buf_num);
+	unsigned char *pool = NULL;
+	unsigned int i;
+
+	len = (len + POOL_PAGE_SIZE - 1) & ~(size_t)(POOL_PAGE_SIZE - 1);
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	/* fails if the kernel can't map usbfs memory or usbfs_memory_mb
+	 * is exhausted, the transfers then go through a bounce buffer */
+	pool = libusb_dev_mem_alloc(dev->devh, len);
+	if (pool)
+		dev->xfer_pool_type = OSMOSDR_POOL_DEVMEM;
+#endif
+
+#if defined(_WIN32)
+	if (!pool) {
+		pool = VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE,
+				    PAGE_READWRITE);
+		if (pool)
+			dev->xfer_pool_type = OSMOSDR_POOL_MMAP;
+	}
+#elif defined(MAP_ANONYMOUS)
+	if (!pool) {
+		/* round up so the region can be backed by huge pages */
+		if (len >= POOL_HUGE_SIZE)
+			len = (len + POOL_HUGE_SIZE - 1) &
+			      ~(size_t)(POOL_HUGE_SIZE - 1);
+
+		pool = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pool == MAP_FAILED) {
+			pool = NULL;
+		} else {
+#ifdef MADV_HUGEPAGE
+			madvise(pool, len, MADV_HUGEPAGE);
+#endif
+			dev->xfer_pool_type = OSMOSDR_POOL_MMAP;
+		}
+	}
+#endif
+
+	if (!pool) {
+		pool = malloc(len);
+		if (!pool)
+			return -ENOMEM;
+
+		dev->xfer_pool_type = OSMOSDR_POOL_HEAP;
+	}
+
+	dev->xfer_pool = pool;
+	dev->xfer_pool_len = len;
+
+	for (i = 0; i < dev->xfer_buf_num; ++i)
+		dev->xfer_buf[i] = pool + _osmosdr_pool_offset(dev, i);
+
+	return 0;
+}
+
+static void _osmosdr_free_pool(osmosdr_dev_t *dev)
+{
+	switch (dev->xfer_pool_type) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	case OSMOSDR_POOL_DEVMEM:
+		libusb_dev_mem_free(dev->devh, dev->xfer_pool,
+				    dev->xfer_pool_len);
+		break;
+#endif
+#if defined(_WIN32)
+	case OSMOSDR_POOL_MMAP:
+		VirtualFree(dev->xfer_pool, 0, MEM_RELEASE);
+		break;
+#elif defined(MAP_ANONYMOUS)
+	case OSMOSDR_POOL_MMAP:
+		munmap(dev->xfer_pool, dev->xfer_pool_len);
+		break;
+#endif
+	case OSMOSDR_POOL_HEAP:
+		free(dev->xfer_pool);
+		break;
+	default:
+		break;
+	}
+
+	dev->xfer_pool = NULL;
+	dev->xfer_pool_len = 0;
+	dev->xfer_pool_type = OSMOSDR_POOL_NONE;
+}
+
+static int _osmosdr_alloc_async_buffers(osmosdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev)
+		return -1;
+
+	if (!dev->xfer) {
+		dev->xfer = calloc(dev->xfer_buf_num,
+				   sizeof(struct libusb_transfer *));
+		if (!dev->xfer)
+			return -ENOMEM;
+
+		for(i = 0; i < dev->xfer_buf_num; ++i) {
+			dev->xfer[i] = libusb_alloc_transfer(0);
+			if (!dev->xfer[i])
+				return -ENOMEM;
+		}
 	}
 
 	if (!dev->xfer_buf) {
-		dev->xfer_buf = malloc(dev->xfer_buf_num *
-					   sizeof(unsigned char *));
+		dev->xfer_buf = calloc(dev->xfer_buf_num,
+				       sizeof(unsigned char *));
+		if (!dev->xfer_buf)
+			return -ENOMEM;
+	}
+
+	/* may be gone after a failed recovery */
+	if (!dev->xfer_pool && _osmosdr_alloc_pool(dev) < 0)
+		return -ENOMEM;
+
+	if (!dev->xfer_retry) {
+		dev->xfer_retry = calloc(dev->xfer_buf_num, sizeof(uint64_t));
+		if (!dev->xfer_retry)
+			return -ENOMEM;
+	}
+
+	if (!dev->xfer_index) {
+		dev->xfer_index = calloc(dev->xfer_buf_num, sizeof(uint64_t));
+		if (!dev->xfer_index)
+			return -ENOMEM;
+	}
 
-		for(i = 0; i < dev->xfer_buf_num; ++i)
-			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
+	if (!dev->sync_fifo) {
+		dev->sync_fifo = malloc(dev->xfer_buf_num *
+					sizeof(struct libusb_transfer *));
+		if (!dev->sync_fifo)
+			return -ENOMEM;
 	}
 
 	return 0;
@@ -865,26 +3626,97 @@ static int _osmosdr_free_async_buffers(osmosdr_dev_t *dev)
 		dev->xfer = NULL;
 	}
 
-	if (dev->xfer_buf) {
-		for(i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i])
-				free(dev->xfer_buf[i]);
-		}
+	_osmosdr_free_pool(dev);
 
-		free(dev->xfer_buf);
-		dev->xfer_buf = NULL;
-	}
+	free(dev->xfer_buf);
+	dev->xfer_buf = NULL;
+
+	free(dev->xfer_retry);
+	dev->xfer_retry = NULL;
+
+	free(dev->xfer_index);
+	dev->xfer_index = NULL;
+
+	free(dev->sync_fifo);
+	dev->sync_fifo = NULL;
 
 	return 0;
 }
 
-int osmosdr_read_async(osmosdr_dev_t *dev, osmosdr_read_async_cb_t cb, void *ctx,
-		       uint32_t buf_num, uint32_t buf_len)
+/* cancel everything in flight and wait for libusb to hand it back */
+static void _osmosdr_cancel_transfers(osmosdr_dev_t *dev)
 {
+	struct timeval tv = { 0, 10000 };
 	unsigned int i;
-	int r = 0;
-	struct timeval tv = { 1, 0 };
-	enum osmosdr_async_status next_status = OSMOSDR_INACTIVE;
+	int r;
+
+	if (!dev->xfer)
+		return;
+
+	for (i = 0; i < dev->xfer_buf_num; ++i)
+		libusb_cancel_transfer(dev->xfer[i]);
+
+	while (atomic_get(&dev->xfer_active) > 0) {
+		r = libusb_handle_events_timeout(dev->ctx, &tv);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			break;
+	}
+}
+
+static int _osmosdr_start_transfers(osmosdr_dev_t *dev, uint32_t buf_num,
+				    uint32_t buf_len)
+{
+	uint32_t prof_num = DEFAULT_BUF_NUMBER, prof_len = DEFAULT_BUF_LENGTH;
+	unsigned int i;
+	int r;
+
+	if (dev->profile != OSMOSDR_PROFILE_NONE)
+		osmosdr_get_profile_buffers(dev, dev->profile,
+					    &prof_num, &prof_len);
+
+	if (!buf_num)
+		buf_num = prof_num;
+
+	if (!buf_len || buf_len % 512) /* len must be multiple of 512 */
+		buf_len = prof_len;
+
+	/* the pool survives between sessions unless its geometry changes */
+	if (dev->xfer_buf_num != buf_num || dev->xfer_buf_len != buf_len)
+		_osmosdr_free_async_buffers(dev);
+
+	dev->xfer_buf_num = buf_num;
+	dev->xfer_buf_len = buf_len;
+	dev->paused = 0;
+
+	if (dev->latency.enabled)
+		_osmosdr_latency_restart(dev);
+
+	memset(&dev->ts, 0, sizeof(dev->ts));
+	_osmosdr_framing_restart(dev);
+
+	r = _osmosdr_alloc_async_buffers(dev);
+	if (r < 0) {
+		_osmosdr_free_async_buffers(dev);
+		return r;
+	}
+
+	dev->recovery = OSMOSDR_RECOVERY_NONE;
+	dev->err_streak = 0;
+	dev->clear_halt = 0;
+	dev->gap = 0;
+	memset(dev->xfer_retry, 0, dev->xfer_buf_num * sizeof(uint64_t));
+
+	_osmosdr_fill_transfers(dev);
+
+	for(i = 0; i < dev->xfer_buf_num; ++i)
+		_osmosdr_resubmit(dev, dev->xfer[i]);
+
+	return 0;
+}
+
+int osmosdr_start_sync(osmosdr_dev_t *dev, uint32_t buf_num, uint32_t buf_len)
+{
+	int r;
 
 	if (!dev)
 		return -1;
@@ -892,37 +3724,130 @@ int osmosdr_read_async(osmosdr_dev_t *dev, osmosdr_read_async_cb_t cb, void *ctx
 	if (OSMOSDR_INACTIVE != dev->async_status)
 		return -2;
 
+	dev->cb = NULL;
+	dev->ext_cb = NULL;
+
+	dev->sync_head = 0;
+	dev->sync_count = 0;
+	dev->sync_offset = 0;
+	dev->sync_error = 0;
+
+	r = _osmosdr_start_transfers(dev, buf_num, buf_len);
+	if (r < 0)
+		return r;
+
 	dev->async_status = OSMOSDR_RUNNING;
+	dev->sync_mode = 1;
 
-	dev->cb = cb;
-	dev->cb_ctx = ctx;
+	return 0;
+}
 
-	if (buf_num > 0)
-		dev->xfer_buf_num = buf_num;
-	else
-		dev->xfer_buf_num = DEFAULT_BUF_NUMBER;
+int osmosdr_stop_sync(osmosdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
 
-	if (buf_len > 0 && buf_len % 512 == 0) /* len must be multiple of 512 */
-		dev->xfer_buf_len = buf_len;
-	else
-		dev->xfer_buf_len = DEFAULT_BUF_LENGTH;
+	if (!dev->sync_mode)
+		return -2;
 
-	_osmosdr_alloc_async_buffers(dev);
+	/* transfers waiting in the queue are not submitted, so this only
+	 * affects the ones still in flight */
+	_osmosdr_cancel_transfers(dev);
 
-	for(i = 0; i < dev->xfer_buf_num; ++i) {
-		libusb_fill_bulk_transfer(dev->xfer[i],
-					  dev->devh,
-					  0x86,
-					  dev->xfer_buf[i],
-					  dev->xfer_buf_len,
-					  _libusb_callback,
-					  (void *)dev,
-					  BULK_TIMEOUT);
+	dev->sync_mode = 0;
+	dev->paused = 0;
+	dev->resume = 0;
 
-		libusb_submit_transfer(dev->xfer[i]);
-	}
+	dev->async_status = OSMOSDR_INACTIVE;
+
+	return 0;
+}
+
+int osmosdr_pause(osmosdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (!dev)
+		return -1;
+
+	if (OSMOSDR_RUNNING != dev->async_status || dev->paused)
+		return -2;
+
+	dev->paused = 1;
+
+	/* may be called from the callback, so don't wait for them here */
+	for (i = 0; i < dev->xfer_buf_num; ++i)
+		libusb_cancel_transfer(dev->xfer[i]);
+
+	return 0;
+}
+
+int osmosdr_resume(osmosdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	if (OSMOSDR_RUNNING != dev->async_status || !dev->paused)
+		return -2;
+
+	/* the thread handling the events picks this up, a second event
+	 * loop here would race the one in osmosdr_read_async() */
+	atomic_xchg(&dev->resume, 1);
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	libusb_interrupt_event_handler(dev->ctx);
+#endif
+
+	return 0;
+}
+
+/* returns 1 once a cancel request has been completed */
+static int _osmosdr_check_cancel(osmosdr_dev_t *dev)
+{
+	unsigned int i;
+
+	if (OSMOSDR_CANCELING != dev->async_status)
+		return 0;
+
+	/* the transfers are reused by the next session, so their status
+	 * is not reliable, count them instead */
+	if (!atomic_get(&dev->xfer_active))
+		return 1;
+
+	for(i = 0; i < dev->xfer_buf_num; ++i)
+		libusb_cancel_transfer(dev->xfer[i]);
+
+	return 0;
+}
+
+static int _osmosdr_read_async(osmosdr_dev_t *dev, osmosdr_read_async_cb_t cb,
+			       osmosdr_read_async_ext_cb_t ext_cb, void *ctx,
+			       uint32_t buf_num, uint32_t buf_len)
+{
+	int r = 0;
+	struct timeval tv = { 1, 0 };
+
+	if (!dev)
+		return -1;
+
+	if (OSMOSDR_INACTIVE != dev->async_status)
+		return -2;
+
+	dev->cb = cb;
+	dev->ext_cb = ext_cb;
+	dev->cb_ctx = ctx;
+
+	r = _osmosdr_start_transfers(dev, buf_num, buf_len);
+	if (r < 0)
+		return r;
+
+	dev->async_status = OSMOSDR_RUNNING;
 
 	while (OSMOSDR_INACTIVE != dev->async_status) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		_osmosdr_event_timeout(dev, &tv);
+
 		r = libusb_handle_events_timeout(dev->ctx, &tv);
 		if (r < 0) {
 			/*fprintf(stderr, "handle_events returned: %d\n", r);*/
@@ -931,33 +3856,192 @@ int osmosdr_read_async(osmosdr_dev_t *dev, osmosdr_read_async_cb_t cb, void *ctx
 			break;
 		}
 
-		if (OSMOSDR_CANCELING == dev->async_status) {
-			next_status = OSMOSDR_INACTIVE;
+		if (_osmosdr_check_cancel(dev))
+			break;
 
-			if (!dev->xfer)
-				break;
+		_osmosdr_resume_process(dev);
+		_osmosdr_recover(dev);
 
-			for(i = 0; i < dev->xfer_buf_num; ++i) {
-				if (!dev->xfer[i])
-					continue;
+		if (OSMOSDR_RECOVERY_FAILED == dev->recovery) {
+			r = dev->sync_error;
+			break;
+		}
+	}
 
-				if (LIBUSB_TRANSFER_CANCELLED !=
-						dev->xfer[i]->status) {
-					libusb_cancel_transfer(dev->xfer[i]);
-					next_status = OSMOSDR_CANCELING;
-				}
-			}
+	/* keep the buffers for the next session, but never leave a transfer
+	 * behind that still points at them */
+	if (atomic_get(&dev->xfer_active))
+		_osmosdr_cancel_transfers(dev);
 
-			if (OSMOSDR_INACTIVE == next_status)
-				break;
+	dev->paused = 0;
+	dev->resume = 0;
+	dev->async_status = OSMOSDR_INACTIVE;
+
+	return r;
+}
+
+int osmosdr_read_async(osmosdr_dev_t *dev, osmosdr_read_async_cb_t cb, void *ctx,
+		       uint32_t buf_num, uint32_t buf_len)
+{
+	return _osmosdr_read_async(dev, cb, NULL, ctx, buf_num, buf_len);
+}
+
+int osmosdr_read_async_ext(osmosdr_dev_t *dev, osmosdr_read_async_ext_cb_t cb,
+			   void *ctx, uint32_t buf_num, uint32_t buf_len)
+{
+	return _osmosdr_read_async(dev, NULL, cb, ctx, buf_num, buf_len);
+}
+
+static int _osmosdr_start_async(osmosdr_dev_t *dev, osmosdr_read_async_cb_t cb,
+				osmosdr_read_async_ext_cb_t ext_cb, void *ctx,
+				uint32_t buf_num, uint32_t buf_len)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (OSMOSDR_INACTIVE != dev->async_status)
+		return -2;
+
+	dev->cb = cb;
+	dev->ext_cb = ext_cb;
+	dev->cb_ctx = ctx;
+
+	r = _osmosdr_start_transfers(dev, buf_num, buf_len);
+	if (r < 0)
+		return r;
+
+	dev->nonblocking = 1;
+	dev->async_status = OSMOSDR_RUNNING;
+
+	return 0;
+}
+
+int osmosdr_start_async(osmosdr_dev_t *dev, osmosdr_read_async_cb_t cb,
+			void *ctx, uint32_t buf_num, uint32_t buf_len)
+{
+	return _osmosdr_start_async(dev, cb, NULL, ctx, buf_num, buf_len);
+}
+
+int osmosdr_start_async_ext(osmosdr_dev_t *dev, osmosdr_read_async_ext_cb_t cb,
+			    void *ctx, uint32_t buf_num, uint32_t buf_len)
+{
+	return _osmosdr_start_async(dev, NULL, cb, ctx, buf_num, buf_len);
+}
+
+int osmosdr_get_pollfds(osmosdr_dev_t *dev, osmosdr_pollfd_t *fds, int max,
+			int *timeout)
+{
+	const struct libusb_pollfd **pollfds;
+	struct timeval tv;
+	int i, n;
+
+	if (!dev)
+		return -1;
+
+	pollfds = libusb_get_pollfds(dev->ctx);
+	if (!pollfds)
+		return -ENOTSUP; /* e.g. on Windows */
+
+	for (n = 0; pollfds[n]; n++) {
+		if (fds && n < max) {
+			fds[n].fd = pollfds[n]->fd;
+			fds[n].events = pollfds[n]->events;
 		}
 	}
 
-	_osmosdr_free_async_buffers(dev);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000104)
+	libusb_free_pollfds(pollfds);
+#else
+	free(pollfds);
+#endif
 
-	dev->async_status = next_status;
+	if (timeout) {
+		i = libusb_get_next_timeout(dev->ctx, &tv);
+		if (i > 0)
+			*timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		else
+			*timeout = -1; /* no libusb timer pending */
+
+		/* stream recovery runs from the event handling as well */
+		if (OSMOSDR_RECOVERY_NONE != dev->recovery &&
+		    (*timeout < 0 || *timeout > RECOVERY_POLL_MS))
+			*timeout = RECOVERY_POLL_MS;
+	}
 
-	return r;
+	return n;
+}
+
+static void LIBUSB_CALL _osmosdr_pollfd_added(int fd, short events, void *ctx)
+{
+	osmosdr_dev_t *dev = (osmosdr_dev_t *)ctx;
+
+	if (dev->pollfd_added)
+		dev->pollfd_added(fd, events, dev->pollfd_ctx);
+}
+
+static void LIBUSB_CALL _osmosdr_pollfd_removed(int fd, void *ctx)
+{
+	osmosdr_dev_t *dev = (osmosdr_dev_t *)ctx;
+
+	if (dev->pollfd_removed)
+		dev->pollfd_removed(fd, dev->pollfd_ctx);
+}
+
+int osmosdr_set_pollfd_notifiers(osmosdr_dev_t *dev,
+				 osmosdr_pollfd_added_cb_t added,
+				 osmosdr_pollfd_removed_cb_t removed,
+				 void *ctx)
+{
+	if (!dev)
+		return -1;
+
+	dev->pollfd_added = added;
+	dev->pollfd_removed = removed;
+	dev->pollfd_ctx = ctx;
+
+	if (added || removed)
+		libusb_set_pollfd_notifiers(dev->ctx, _osmosdr_pollfd_added,
+					    _osmosdr_pollfd_removed, dev);
+	else
+		libusb_set_pollfd_notifiers(dev->ctx, NULL, NULL, NULL);
+
+	return 0;
+}
+
+int osmosdr_handle_events_nonblocking(osmosdr_dev_t *dev)
+{
+	struct timeval tv = { 0, 0 };
+	int r;
+
+	if (!dev)
+		return -1;
+
+	r = libusb_handle_events_timeout_completed(dev->ctx, &tv, NULL);
+	if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+		return r;
+
+	if (dev->nonblocking && _osmosdr_check_cancel(dev)) {
+		dev->nonblocking = 0;
+		dev->paused = 0;
+		dev->resume = 0;
+		dev->async_status = OSMOSDR_INACTIVE;
+		return 0;
+	}
+
+	_osmosdr_resume_process(dev);
+	_osmosdr_recover(dev);
+
+	if (dev->nonblocking && OSMOSDR_RECOVERY_FAILED == dev->recovery) {
+		dev->nonblocking = 0;
+		dev->paused = 0;
+		dev->resume = 0;
+		dev->async_status = OSMOSDR_INACTIVE;
+		return dev->sync_error;
+	}
+
+	return 0;
 }
 
 int osmosdr_cancel_async(osmosdr_dev_t *dev)
@@ -965,6 +4049,10 @@ int osmosdr_cancel_async(osmosdr_dev_t *dev)
 	if (!dev)
 		return -1;
 
+	/* the read-ahead is stopped with osmosdr_stop_sync() */
+	if (dev->sync_mode)
+		return -2;
+
 	/* if streaming, try to cancel gracefully */
 	if (OSMOSDR_RUNNING == dev->async_status) {
 		dev->async_status = OSMOSDR_CANCELING;
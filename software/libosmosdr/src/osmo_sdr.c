@@ -54,6 +54,8 @@ void usage(void)
 		"\t[-g gain (default: 0 for auto)]\n"
 		"\t[-b output_block_size (default: 16 * 16384)]\n"
 		"\t[-S force sync output (default: async)]\n"
+		"\t[-P buffer profile (1: low latency, 2: balanced, 3: throughput)]\n"
+		"\t[-L report the delivery latency on exit]\n"
 		"\tfilename (a '-' dumps samples to stdout)\n\n");
 #endif
 	exit(1);
@@ -100,6 +102,10 @@ int main(int argc, char **argv)
 	int r, opt;
 	int i, gain = 0;
 	int sync_mode = 0;
+	int profile = OSMOSDR_PROFILE_NONE;
+	int measure_latency = 0;
+	uint32_t buf_num = DEFAULT_ASYNC_BUF_NUMBER;
+	uint32_t lat_avg, lat_max;
 	FILE *file;
 	uint8_t *buffer;
 	uint32_t dev_index = 0;
@@ -113,7 +119,7 @@ int main(int argc, char **argv)
 	uint32_t rates[100];
 
 #ifndef _WIN32
-	while ((opt = getopt(argc, argv, "d:f:g:s:b:S::")) != -1) {
+	while ((opt = getopt(argc, argv, "d:f:g:s:b:P:LS::")) != -1) {
 		switch (opt) {
 		case 'd':
 			dev_index = atoi(optarg);
@@ -133,6 +139,12 @@ int main(int argc, char **argv)
 		case 'S':
 			sync_mode = 1;
 			break;
+		case 'P':
+			profile = atoi(optarg);
+			break;
+		case 'L':
+			measure_latency = 1;
+			break;
 		default:
 			usage();
 			break;
@@ -265,6 +277,27 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (profile != OSMOSDR_PROFILE_NONE) {
+		r = osmosdr_get_profile_buffers(dev, profile, &buf_num,
+						&out_block_size);
+		if (r < 0) {
+			fprintf(stderr, "WARNING: Failed to apply buffer profile.\n");
+		} else {
+			fprintf(stderr, "Using %u buffers of %u bytes.\n",
+				buf_num, out_block_size);
+			free(buffer);
+			buffer = malloc(out_block_size * sizeof(uint8_t));
+			if (!buffer) {
+				fprintf(stderr, "Failed to allocate the sample buffer.\n");
+				r = -1;
+				goto close;
+			}
+		}
+	}
+
+	if (measure_latency)
+		osmosdr_set_latency_measurement(dev, 1);
+
 	/* Reset endpoint before we start reading from it (mandatory) */
 	r = osmosdr_reset_buffer(dev);
 	if (r < 0)
@@ -272,6 +305,11 @@ int main(int argc, char **argv)
 
 	if (sync_mode) {
 		fprintf(stderr, "Reading samples in sync mode...\n");
+
+		r = osmosdr_start_sync(dev, buf_num, out_block_size);
+		if (r < 0)
+			fprintf(stderr, "WARNING: Failed to start read-ahead.\n");
+
 		while (!do_exit) {
 			r = osmosdr_read_sync(dev, buffer, out_block_size, &n_read);
 			if (r < 0) {
@@ -289,17 +327,24 @@ int main(int argc, char **argv)
 				break;
 			}
 		}
+
+		osmosdr_stop_sync(dev);
 	} else {
 		fprintf(stderr, "Reading samples in async mode...\n");
 		r = osmosdr_read_async(dev, osmosdr_callback, (void *)file,
-				      DEFAULT_ASYNC_BUF_NUMBER, out_block_size);
+				      buf_num, out_block_size);
 	}
 
+	if (measure_latency && !osmosdr_get_latency(dev, &lat_avg, &lat_max))
+		fprintf(stderr, "Latency: %.1f ms average, %.1f ms max\n",
+			lat_avg / 1000.0, lat_max / 1000.0);
+
 	if (do_exit)
 		fprintf(stderr, "\nUser cancel, exiting...\n");
 	else
 		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);
 
+close:
 	if (file != stdout)
 		fclose(file);
 
@@ -1,86 +1,555 @@
-/* utility to check a recorded WAV file in fgpa.test_mode=1 for
- * discontinuities in the counter increment/decrements */
+/* utility to check a capture made in fgpa.test_mode=1 for
+ * discontinuities in the counter increment/decrements
+ *
+ * The capture may be a WAV file, raw interleaved 16bit I/Q samples or a
+ * stream on stdin. Files are split across several threads, each one
+ * reading large chunks, and a histogram of the gap sizes and positions is
+ * printed at the end. */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 
-#define STEP 1
+#define STEP		1
+#define CHUNK_SIZE	(4 * 1024 * 1024)	/* bytes per read */
+#define BLOCK		64	/* I/Q pairs compared at once */
+#define MAX_THREADS	64
+#define SIZE_BINS	17	/* 1, 2-3, 4-7, ... 32768-65535 */
+#define POS_BINS	20
+#define MAX_EVENTS	16	/* discontinuities printed individually */
 
-static int check_continuity(uint16_t *samples, uint32_t size)
-{
-	uint16_t *end = samples + size/sizeof(uint16_t);
-	uint16_t *cur;
-	int inited = 0;
+struct gap {
+	uint64_t pos;	/* I/Q pairs from the start of the data */
+	uint32_t lost;
+};
+
+struct check_state {
+	/* counter tracking */
+	int inited;			/* last_i/q confirmed by a second pair */
+	uint16_t first_i, first_q;	/* what the first pair should have been */
 	uint16_t last_i, last_q;
+	uint64_t pos;
 
-	for (cur = samples; cur < end; cur += 2) {
-		if (!inited) {
-			last_i = cur[0];
-			last_q = cur[1];
-			printf("initial I=%04x, Q=%04x\n",
-				last_i, last_q);
-			inited = 1;
-			continue;
+	/* pairs held back until two in a row agree */
+	uint16_t pend[2 * BLOCK];
+	unsigned int num_pend;
+	uint64_t skipped;		/* given up on, counted as corrupt */
+
+	/* results */
+	uint64_t gaps, dropped, corrupt;
+	uint64_t size_hist[SIZE_BINS];
+	uint64_t pos_hist[POS_BINS];
+	struct gap events[MAX_EVENTS];
+	unsigned int num_events;
+};
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	off_t start;		/* byte offset in the file */
+	uint64_t pairs;		/* I/Q pairs to check */
+	uint64_t first_pair;	/* index of the first one */
+	uint64_t total_pairs;	/* in the whole capture, for the positions */
+	int err;
+	struct check_state st;
+};
+
+static unsigned int size_bin(uint32_t lost)
+{
+	unsigned int bin = 0;
+
+	while (lost > 1 && bin < SIZE_BINS - 1) {
+		lost >>= 1;
+		bin++;
+	}
+
+	return bin;
+}
+
+static void record_gap(struct check_state *st, uint64_t total, uint64_t pos,
+		       uint32_t lost)
+{
+	st->gaps++;
+	st->dropped += lost;
+	st->size_hist[size_bin(lost)]++;
+
+	if (total)
+		st->pos_hist[pos * POS_BINS / total]++;
+
+	/* workers are merged in order, so keeping the first ones per worker
+	 * is enough to end up with the first ones overall */
+	if (st->num_events < MAX_EVENTS) {
+		st->events[st->num_events].pos = pos;
+		st->events[st->num_events].lost = lost;
+		st->num_events++;
+	}
+}
+
+/* compare one pair against the last one */
+static void check_pair(struct check_state *st, uint64_t total,
+		       uint16_t i, uint16_t q)
+{
+	uint16_t di = st->last_i - i;
+	uint16_t dq = q - st->last_q;
+
+	/* a repeated pair, nothing was lost */
+	if (!di && !dq) {
+		st->corrupt++;
+		st->pos++;
+		return;
+	}
+
+	if (di != STEP || dq != STEP) {
+		if (di == dq) {
+			/* exact modulo 65536 */
+			record_gap(st, total, st->pos, di / STEP - 1);
+		} else {
+			/* keep following the sequence */
+			st->corrupt++;
+			st->last_i -= STEP;
+			st->last_q += STEP;
+			st->pos++;
+			return;
 		}
+	}
+
+	st->last_i = i;
+	st->last_q = q;
+	st->pos++;
+}
+
+/* take pending pair n - 1 as the reference, the ones before it have to
+ * lead up to it */
+static void sync_to(struct check_state *st, unsigned int n)
+{
+	uint16_t *p = st->pend;
+	uint16_t i = p[2 * (n - 1)], q = p[2 * (n - 1) + 1];
+	uint64_t ahead = st->skipped + n - 1;
+	unsigned int k;
+
+	st->first_i = i + STEP * ahead;
+	st->first_q = q - STEP * ahead;
 
-		if (cur[0] != (uint16_t)(last_i - STEP) ||
-		    cur[1] != (uint16_t)(last_q + STEP)) {
-			fprintf(stderr, "Disocntinuity at %u: "
-				"I=%04x/%04x Q=%04x/%04x\n",
-				cur - samples, last_i, cur[0],
-				last_q, cur[1]);
+	for (k = 0; k + 1 < n; k++) {
+		if (p[2 * k] != (uint16_t)(i + STEP * (n - 1 - k)) ||
+		    p[2 * k + 1] != (uint16_t)(q - STEP * (n - 1 - k)))
+			st->corrupt++;
+	}
+
+	st->last_i = i;
+	st->last_q = q;
+	st->inited = 1;
+	st->num_pend = 0;
+}
+
+/* the first pair may be corrupt itself, so comparing only starts once a
+ * pair is followed by the next one in the sequence */
+static void sync_pair(struct check_state *st, uint64_t total,
+		      uint16_t i, uint16_t q)
+{
+	uint16_t *p = st->pend;
+	unsigned int n = st->num_pend;
+
+	if (n && (uint16_t)(p[2 * (n - 1)] - i) == STEP &&
+	    (uint16_t)(q - p[2 * (n - 1) + 1]) == STEP) {
+		sync_to(st, n);
+		check_pair(st, total, i, q);
+		return;
+	}
+
+	/* nothing consistent so far, give up on the oldest one */
+	if (n == BLOCK) {
+		memmove(p, p + 2, 2 * (n - 1) * sizeof(*p));
+		st->corrupt++;
+		st->skipped++;
+		n--;
+	}
+
+	p[2 * n] = i;
+	p[2 * n + 1] = q;
+	st->num_pend = n + 1;
+	st->pos++;
+}
+
+/* end of the data, go by the last pair if none were confirmed */
+static void check_finish(struct check_state *st)
+{
+	if (!st->inited && st->num_pend)
+		sync_to(st, st->num_pend);
+}
+
+/* the common case of no discontinuity is checked without branches, which
+ * lets the compiler vectorize it, bad blocks are walked pair by pair */
+static void check_continuity(struct check_state *st, uint64_t total,
+			     const uint16_t *iq, uint64_t n)
+{
+	uint64_t k, blk;
+	uint16_t bad;
+
+	if (!n)
+		return;
+
+	while (n && !st->inited) {
+		sync_pair(st, total, iq[0], iq[1]);
+		iq += 2;
+		n--;
+	}
+
+	while (n) {
+		blk = n < BLOCK ? n : BLOCK;
+		bad = 0;
+
+		for (k = 0; k < blk; k++) {
+			bad |= iq[2 * k] ^ (uint16_t)(st->last_i - STEP * (k + 1));
+			bad |= iq[2 * k + 1] ^ (uint16_t)(st->last_q + STEP * (k + 1));
 		}
 
-		last_i = cur[0];
-		last_q = cur[1];
+		if (bad) {
+			for (k = 0; k < blk; k++)
+				check_pair(st, total, iq[2 * k], iq[2 * k + 1]);
+		} else {
+			st->last_i = iq[2 * (blk - 1)];
+			st->last_q = iq[2 * (blk - 1) + 1];
+			st->pos += blk;
+		}
+
+		iq += 2 * blk;
+		n -= blk;
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	uint16_t *buf;
+	uint64_t done = 0;
+	size_t want;
+	ssize_t rc;
+
+	buf = malloc(CHUNK_SIZE);
+	if (!buf) {
+		w->err = 1;
+		return NULL;
 	}
 
-	return 0;
+	w->st.pos = w->first_pair;
+
+	while (done < w->pairs) {
+		want = CHUNK_SIZE / 4;
+		if (want > w->pairs - done)
+			want = w->pairs - done;
+
+		rc = pread(w->fd, buf, want * 4, w->start + done * 4);
+		if (rc <= 0) {
+			w->err = 1;
+			break;
+		}
+
+		want = rc / 4;
+		check_continuity(&w->st, w->total_pairs, buf, want);
+		done += want;
+	}
+
+	check_finish(&w->st);
+
+	free(buf);
+
+	return NULL;
 }
 
-int main(int argc, char **argv)
+/* find the sample data of a WAV file, returns its offset or -1 */
+static long wav_data_offset(const uint8_t *hdr, size_t len, uint64_t *size)
 {
-	struct stat st;
-	int fd;
-	void *map;
-	uint16_t *samples;
+	size_t off = 12;
+	uint32_t clen;
+
+	if (len < 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4))
+		return -1;
+
+	while (off + 8 <= len) {
+		clen = hdr[off + 4] | (hdr[off + 5] << 8) |
+		       (hdr[off + 6] << 16) | ((uint32_t)hdr[off + 7] << 24);
+
+		if (!memcmp(hdr + off, "data", 4)) {
+			*size = clen;
+			return off + 8;
+		}
+
+		off += 8 + clen + (clen & 1);
+	}
+
+	return -1;
+}
 
-	if (argc < 2) {
-		fprintf(stderr, "You have to specify a wave file name\n");
-		exit(2);
+static void merge(struct check_state *dst, struct check_state *src)
+{
+	unsigned int i;
+
+	dst->gaps += src->gaps;
+	dst->dropped += src->dropped;
+	dst->corrupt += src->corrupt;
+
+	for (i = 0; i < SIZE_BINS; i++)
+		dst->size_hist[i] += src->size_hist[i];
+	for (i = 0; i < POS_BINS; i++)
+		dst->pos_hist[i] += src->pos_hist[i];
+
+	for (i = 0; i < src->num_events && dst->num_events < MAX_EVENTS; i++)
+		dst->events[dst->num_events++] = src->events[i];
+}
+
+static void print_summary(struct check_state *st, uint64_t total)
+{
+	unsigned int i;
+
+	printf("checked %" PRIu64 " I/Q pairs: %" PRIu64 " discontinuities, "
+	       "%" PRIu64 " pairs lost, %" PRIu64 " corrupt\n",
+	       st->pos, st->gaps, st->dropped, st->corrupt);
+
+	if (!st->gaps)
+		return;
+
+	printf("\nfirst discontinuities:\n");
+	for (i = 0; i < st->num_events; i++)
+		printf("  at %12" PRIu64 ": %u pairs lost\n",
+		       st->events[i].pos, st->events[i].lost);
+
+	printf("\ngap sizes:\n");
+	for (i = 0; i < SIZE_BINS; i++) {
+		if (!st->size_hist[i])
+			continue;
+		printf("  %6u - %6u: %" PRIu64 "\n",
+		       1u << i, (2u << i) - 1, st->size_hist[i]);
+	}
+
+	if (!total)
+		return;
+
+	printf("\ngap positions:\n");
+	for (i = 0; i < POS_BINS; i++)
+		printf("  %3u%% - %3u%%: %" PRIu64 "\n", i * 100 / POS_BINS,
+		       (i + 1) * 100 / POS_BINS, st->pos_hist[i]);
+}
+
+/* a stream can only be checked in order */
+static int check_stream(int fd, int raw, struct check_state *st)
+{
+	uint8_t *buf;
+	size_t have = 0;
+	ssize_t rc;
+	long skip = 0;
+	uint64_t size;
+	int first = 1;
+
+	buf = malloc(CHUNK_SIZE);
+	if (!buf) {
+		perror("malloc");
+		return -1;
 	}
 
-	fd = open(argv[1], O_RDONLY);
-	if (fd < 0) {
-		perror("opening file");
-		exit(2);
+	while ((rc = read(fd, buf + have, CHUNK_SIZE - have)) > 0) {
+		have += rc;
+
+		if (first) {
+			/* the WAV header has to be in the first chunk */
+			if (!raw && have < 64)
+				continue;
+
+			if (!raw)
+				skip = wav_data_offset(buf, have, &size);
+			if (skip < 0)
+				skip = 0;
+
+			memmove(buf, buf + skip, have - skip);
+			have -= skip;
+			first = 0;
+		}
+
+		check_continuity(st, 0, (uint16_t *)buf, have / 4);
+
+		/* keep an incomplete pair for the next round */
+		memmove(buf, buf + (have & ~3), have & 3);
+		have &= 3;
 	}
 
-	if (fstat(fd, &st) < 0) {
+	if (rc < 0)
+		perror("read");
+
+	check_finish(st);
+
+	free(buf);
+
+	return rc < 0 ? -1 : 0;
+}
+
+static int check_file(int fd, int raw, unsigned int threads,
+		      struct check_state *st, uint64_t *total)
+{
+	struct worker w[MAX_THREADS];
+	struct stat sb;
+	uint8_t hdr[4096];
+	uint64_t size, pairs, per;
+	long offset = 0;
+	ssize_t rc;
+	unsigned int t;
+	int err = 0;
+
+	if (fstat(fd, &sb) < 0) {
 		perror("stat");
-		exit(1);
+		return -1;
 	}
 
-	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (!map) {
-		perror("mmap");
-		exit(1);
+	size = sb.st_size;
+
+	if (!raw) {
+		rc = pread(fd, hdr, sizeof(hdr), 0);
+		offset = wav_data_offset(hdr, rc > 0 ? rc : 0, &size);
+		if (offset < 0) {
+			/* not a WAV file, treat it as raw samples */
+			offset = 0;
+			size = sb.st_size;
+		} else if (size > (uint64_t)sb.st_size - offset) {
+			/* unfinished recording */
+			size = sb.st_size - offset;
+		}
 	}
 
-	if (memcmp(map, "RIFF", 4)) {
-		fprintf(stderr, "Doeesn't look like a WAV file\n");
-		exit(1);
+	pairs = size / 4;
+	*total = pairs;
+
+	if (threads > pairs / BLOCK + 1)
+		threads = pairs / BLOCK + 1;
+
+	per = pairs / threads;
+
+	memset(w, 0, sizeof(w));
+
+	for (t = 0; t < threads; t++) {
+		w[t].fd = fd;
+		w[t].first_pair = t * per;
+		w[t].pairs = t == threads - 1 ? pairs - t * per : per;
+		w[t].start = offset + w[t].first_pair * 4;
+		w[t].total_pairs = pairs;
+
+		if (pthread_create(&w[t].thread, NULL, worker_main, &w[t])) {
+			perror("pthread_create");
+			threads = t;
+			err = -1;
+			break;
+		}
 	}
 
-	samples = (uint16_t *)(map + 0x44);
-	check_continuity(samples, st.st_size-0x44);
+	for (t = 0; t < threads; t++) {
+		pthread_join(w[t].thread, NULL);
+		if (w[t].err)
+			err = -1;
+	}
+
+	for (t = 0; t < threads; t++) {
+		/* check where the previous worker left off */
+		if (t && w[t].st.inited) {
+			st->pos = w[t].first_pair;
+			check_pair(st, pairs, w[t].st.first_i, w[t].st.first_q);
+		}
+
+		merge(st, &w[t].st);
+
+		if (w[t].st.inited) {
+			if (!st->inited) {
+				st->first_i = w[t].st.first_i;
+				st->first_q = w[t].st.first_q;
+			}
+			st->inited = 1;
+			st->last_i = w[t].st.last_i;
+			st->last_q = w[t].st.last_q;
+		}
+	}
+
+	st->pos = pairs;
+
+	return err;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: check_ctr [-r] [-t threads] file\n"
+		"\t-r\tinput is raw I/Q, don't look for a WAV header\n"
+		"\t-t\tnumber of threads for files (default: one per CPU)\n"
+		"\tfile\tcapture to check, '-' reads from stdin\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct check_state st;
+	uint64_t total = 0;
+	long ncpu;
+	unsigned int threads;
+	int raw = 0;
+	int fd, opt, rc;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = ncpu > 0 ? ncpu : 1;
+
+	while ((opt = getopt(argc, argv, "rt:")) != -1) {
+		switch (opt) {
+		case 'r':
+			raw = 1;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc)
+		usage();
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	memset(&st, 0, sizeof(st));
+
+	if (!strcmp(argv[optind], "-")) {
+		rc = check_stream(STDIN_FILENO, raw, &st);
+	} else {
+		fd = open(argv[optind], O_RDONLY);
+		if (fd < 0) {
+			perror("opening file");
+			exit(2);
+		}
+
+		/* pipes and fifos can't be split up */
+		if (lseek(fd, 0, SEEK_END) < 0)
+			rc = check_stream(fd, raw, &st);
+		else
+			rc = check_file(fd, raw, threads, &st, &total);
+
+		close(fd);
+	}
+
+	if (st.inited)
+		printf("initial I=%04x, Q=%04x\n", st.first_i, st.first_q);
+
+	print_summary(&st, total);
+
+	if (rc < 0)
+		exit(1);
 
-	exit(0);
+	exit(st.gaps || st.corrupt ? 1 : 0);
 }
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <math.h>
+#include "fft.h"
+
+// in-place radix-2 decimation in time, output in natural order
+
+struct FFT {
+	int size;
+	int* reverse;
+	float* cosTab;
+	float* sinTab;
+};
+
+struct FFT* fftCreate(int log2Size)
+{
+	struct FFT* fft;
+	int i;
+	int j;
+	int r;
+
+	if((log2Size < 1) || (log2Size > 20))
+		return NULL;
+
+	if((fft = calloc(1, sizeof(struct FFT))) == NULL)
+		return NULL;
+	fft->size = 1 << log2Size;
+	fft->reverse = malloc(fft->size * sizeof(int));
+	fft->cosTab = malloc(fft->size / 2 * sizeof(float));
+	fft->sinTab = malloc(fft->size / 2 * sizeof(float));
+	if((fft->reverse == NULL) || (fft->cosTab == NULL) || (fft->sinTab == NULL)) {
+		fftDestroy(fft);
+		return NULL;
+	}
+
+	for(i = 0; i < fft->size; i++) {
+		r = 0;
+		for(j = 0; j < log2Size; j++)
+			r |= ((i >> j) & 1) << (log2Size - 1 - j);
+		fft->reverse[i] = r;
+	}
+
+	for(i = 0; i < fft->size / 2; i++) {
+		fft->cosTab[i] = cos(2.0 * M_PI * i / fft->size);
+		fft->sinTab[i] = -sin(2.0 * M_PI * i / fft->size);
+	}
+
+	return fft;
+}
+
+void fftDestroy(struct FFT* fft)
+{
+	if(fft == NULL)
+		return;
+	free(fft->reverse);
+	free(fft->cosTab);
+	free(fft->sinTab);
+	free(fft);
+}
+
+int fftSize(const struct FFT* fft)
+{
+	return fft->size;
+}
+
+void fftRun(const struct FFT* fft, float* re, float* im)
+{
+	int n = fft->size;
+	int i;
+	int j;
+	int k;
+	int half;
+	int step;
+	float t;
+	float tr;
+	float ti;
+	float wr;
+	float wi;
+
+	for(i = 0; i < n; i++) {
+		j = fft->reverse[i];
+		if(j > i) {
+			t = re[i];
+			re[i] = re[j];
+			re[j] = t;
+			t = im[i];
+			im[i] = im[j];
+			im[j] = t;
+		}
+	}
+
+	for(half = 1; half < n; half <<= 1) {
+		step = n / (half * 2);
+		for(i = 0; i < n; i += half * 2) {
+			for(k = 0; k < half; k++) {
+				wr = fft->cosTab[k * step];
+				wi = fft->sinTab[k * step];
+				j = i + k + half;
+				tr = re[j] * wr - im[j] * wi;
+				ti = re[j] * wi + im[j] * wr;
+				re[j] = re[i + k] - tr;
+				im[j] = im[i + k] - ti;
+				re[i + k] += tr;
+				im[i + k] += ti;
+			}
+		}
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef INCLUDE_FFT_H
+#define INCLUDE_FFT_H
+
+struct FFT;
+
+struct FFT* fftCreate(int log2Size);
+void fftDestroy(struct FFT* fft);
+int fftSize(const struct FFT* fft);
+void fftRun(const struct FFT* fft, float* re, float* im);
+
+#endif // INCLUDE_FFT_H
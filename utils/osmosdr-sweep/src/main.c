@@ -2,233 +2,482 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
 #include <math.h>
-#include <portaudio.h>
-#include "serial.h"
+#include <osmosdr.h>
+#include "fft.h"
 #include "utils.h"
 
+#define DEFAULT_SAMPLE_RATE 1000000
+#define DEFAULT_FFT_LOG2 10
+#define DEFAULT_AVERAGES 16
+#define DEFAULT_KEEP 0.75
+#define DEFAULT_SETTLE 4096
+
+#define BUF_NUM 32
+#define BUF_LENGTH 16384
+
 struct SweepState {
-	int serialFd;
-	int settleTime;
-	int sampleTime;
-	uint64_t freq;
-	double acc;
-	double num;
+	osmosdr_dev_t* dev;
+	struct FFT* fft;
+
+	// plan
+	uint32_t sampleRate;
 	double start;
-	double stop;
+	double binWidth;
+	int fftLen;
+	int keep;
+	int averages;
+	uint32_t settle;
+	int numHops;
+
+	// current hop, its window [from, from + averages * fftLen) in device
+	// samples is only known once the device reported the retune
+	int hop;
+	int started;
+	int haveWindow;
+	uint32_t from;
+	uint32_t end;
+	uint32_t waitSince;
+	int ffts;
+
+	// the retune scheduled last and its reported completion
+	uint16_t tuneTag;
+	int tuneDone;
+	uint32_t tunedFrom;
+
+	int fill;
+	float* window;
+	float* re;
+	float* im;
+	double* acc;
+	float* power;
+
+	int failed;
+	int done;
 };
 
+static struct SweepState* g_state;
+
 static int printSyntax()
 {
 	fprintf(stderr, "Error: Invalid command line!\n\n"
-		"syntax: sdr-sweep /dev/ttyUSB0 start stop"
+		"syntax: osdr-sweep [options] start stop\n"
 		"  - start = start frequency in MHz, e.g 88.5\n"
 		"  - stop = stop frequency in MHz, e.g. 108\n"
-		"frequency range of OsmoSDR is 64MHz - 1700MHz\n");
+		"frequency range of OsmoSDR is 64MHz - 1700MHz\n\n"
+		"options:\n"
+		"  -d device index (default: 0)\n"
+		"  -s sample rate in Hz (default: %u)\n"
+		"  -g gain in dB (default: 0 for auto)\n"
+		"  -n log2 of the FFT size (default: %u)\n"
+		"  -a FFTs averaged per hop (default: %u)\n"
+		"  -k fraction of the passband kept per hop (default: %.2f)\n"
+		"  -S samples skipped after each retune (default: %u)\n"
+		"  -b binary output: double first bin in Hz, double bin width in Hz,\n"
+		"     uint32 number of bins, then a float dBFS per bin, host byte order\n"
+		"  -o output file (default: stdout, CSV of Hz,dBFS)\n",
+		DEFAULT_SAMPLE_RATE, DEFAULT_FFT_LOG2, DEFAULT_AVERAGES,
+		DEFAULT_KEEP, DEFAULT_SETTLE);
 
 	return EXIT_FAILURE;
 }
 
-static void setFreq(int fd, uint64_t freq)
+static void sighandler(int signum)
 {
-	char str[128];
-	char* c;
-	char str2[2] = { '\0', '\0' };
-
-	while(serialGetS(fd, str, sizeof(str), 1) >= 0)
-		;
-
-	sprintf(str, "tuner.freq=%llu\r", freq);
-
-	for(c = str; *c != '\0'; c++) {
-		serialPutC(fd, *c);
-		if(*c == '\r')
-			str2[0] = '\n';
-		else str2[0] = *c;
-		if(serialExpect(fd, str2, 1) < 0) {
-			serialPutC(fd, *c);
-			if(serialExpect(fd, str2, 1) < 0) {
-				fprintf(stderr, "serial port broken (%d = %c)\n", *c, *c);
-				return;
-			}
-		}
-	}
+	fprintf(stderr, "Signal caught, exiting!\n");
+	g_state->done = 1;
+	osmosdr_cancel_async(g_state->dev);
+}
+
+static uint32_t hopFreq(const struct SweepState* state, int hop)
+{
+	// the center of the kept bins, so that the hops line up bin by bin
+	return state->start + ((double)hop * state->keep + state->keep / 2) * state->binWidth + 0.5;
 }
 
-static int audioCallback(const void* inputBuffer, void* outputBuffer,
-	unsigned long framesPerBuffer,
-	const PaStreamCallbackTimeInfo* timeInfo,
-	PaStreamCallbackFlags statusFlags,
-	void* userData)
+// retune to the hop following the current one once the window is through
+static void scheduleNext(struct SweepState* state, uint32_t at)
+{
+	int next = state->hop + 1;
+
+	state->tuneDone = 0;
+	if(next >= state->numHops)
+		return;
+
+	state->tuneTag = next & 0xffff;
+	if(osmosdr_schedule_center_freq(state->dev, at, hopFreq(state, next), state->tuneTag) < 0)
+		fprintf(stderr, "failed to schedule retune to %u Hz\n", hopFreq(state, next));
+}
+
+// completions are reported in-band, samples already passed can't be used
+static void startWindow(struct SweepState* state, uint32_t from, uint32_t now)
+{
+	if((int32_t)(from - now) < 0)
+		from = now;
+
+	state->from = from;
+	state->end = from + state->averages * state->fftLen;
+	state->haveWindow = 1;
+	state->ffts = 0;
+	state->fill = 0;
+	memset(state->acc, 0x00, state->fftLen * sizeof(double));
+
+	scheduleNext(state, state->end);
+}
+
+static void processBlock(struct SweepState* state)
 {
-	struct SweepState* state = (struct SweepState*)userData;
 	int i;
-	const int16_t* input = (const int16_t*)inputBuffer;
-	uint8_t c;
-	double v;
-	int max;
-
-	//fprintf(stderr, "block %lu\n", framesPerBuffer);
-
-	while(serialGetC(state->serialFd, &c, 0) >= 0)
-		//fprintf(stderr, "%c", c);
-		;
-
-	if(state->settleTime > 0) {
-		state->settleTime -= framesPerBuffer;
-		if(state->settleTime <= 0) {
-			state->sampleTime = 100000;
-			state->acc = 0.0;
-			state->num = 0.0;
-		}
-		return 0;
-	}
 
-	if(state->sampleTime > 0) {
-		max = 0;
-		for(i = 0; i < framesPerBuffer; i++) {
-			if(abs(*input) > max)
-				max = abs(*input);
-			v = *input / 32768.0;
-			state->acc += v * v;
-			input++;
-			if(abs(*input) > max)
-				max = abs(*input);
-			v = *input / 32768.0;
-			state->acc += v * v;
-			input++;
-			state->num += 2;
-		}
-		//fprintf(stderr, "-> %d\n", max);
-
-		state->sampleTime -= framesPerBuffer;
-		if(state->sampleTime <= 0) {
-			printf("%.1f\t%.1f\n", state->freq / 1000000.0, 20.0 * log10(sqrt(state->acc / state->num)));
-			fflush(stdout);
-			state->freq += 100000;
-			setFreq(state->serialFd, state->freq);
-			state->settleTime = 500000;
-		}
-	}
+	fftRun(state->fft, state->re, state->im);
 
-	return 0;
+	for(i = 0; i < state->fftLen; i++)
+		state->acc[i] += (double)state->re[i] * state->re[i] + (double)state->im[i] * state->im[i];
+
+	state->ffts++;
+	state->fill = 0;
 }
 
-static PaStream* audioOpen(struct SweepState* state)
+// keep the central bins of the averaged spectrum
+static void finishHop(struct SweepState* state)
 {
-	int numDevices;
-	const PaDeviceInfo* deviceInfo;
-	PaError err;
+	float* out = state->power + state->hop * state->keep;
+	double norm = 0.0;
+	double p;
+	int n = state->fftLen;
+	int first = n / 2 - state->keep / 2;
 	int i;
-	int dev = -1;
-	PaStream* stream = NULL;
-	PaStreamParameters inputParameters;
-
-	err = Pa_Initialize();
-	if(err != paNoError)
-		goto error_noinit;
-
-	numDevices = Pa_GetDeviceCount();
-	if(numDevices < 0) {
-		err = numDevices;
-		goto error;
-	}
+	int bin;
+
+	for(i = 0; i < n; i++)
+		norm += state->window[i];
+	// full scale complex tone at 0 dBFS
+	norm = norm * norm * state->ffts;
+
+	for(i = 0; i < state->keep; i++) {
+		if(state->ffts == 0) {
+			out[i] = NAN;
+			continue;
+		}
 
-	for(i = 0; i < numDevices; i++) {
-		deviceInfo = Pa_GetDeviceInfo(i);
-		fprintf(stderr, "#%02d -> [%s]\n", i, deviceInfo->name);
-		if(strncmp(deviceInfo->name, "OsmoSDR", 7) == 0)
-			dev = i;
+		// the spectrum is centered on bin n / 2
+		bin = (first + i + n / 2) % n;
+		if((bin <= 1) || (bin == n - 1)) {
+			// DC offset and LO leakage, spread by the window, interpolate
+			p = (state->acc[2] + state->acc[n - 2]) / 2.0;
+		} else {
+			p = state->acc[bin];
+		}
+		out[i] = 10.0 * log10(p / norm + 1e-20);
 	}
-	if(dev < 0) {
-		fprintf(stderr, "OsmoSDR not found!\n");
-		Pa_Terminate();
-		return NULL;
+
+	if(state->ffts < state->averages) {
+		fprintf(stderr, "hop %u Hz: %d of %d FFTs\n", hopFreq(state, state->hop), state->ffts, state->averages);
+		state->failed++;
 	}
+}
 
-	fprintf(stderr, "Using device #%02d (sample rate %.0f Hz)\n", dev, Pa_GetDeviceInfo(dev)->defaultSampleRate);
+static void nextHop(struct SweepState* state, uint32_t ctr)
+{
+	finishHop(state);
 
-	bzero(&inputParameters, sizeof(inputParameters));
-	inputParameters.channelCount = 2;
-	inputParameters.device = dev;
-	inputParameters.hostApiSpecificStreamInfo = NULL;
-	inputParameters.sampleFormat = paInt16;
-	inputParameters.suggestedLatency = Pa_GetDeviceInfo(dev)->defaultHighInputLatency ;
-	inputParameters.hostApiSpecificStreamInfo = NULL;
+	state->hop++;
+	state->haveWindow = 0;
+	state->waitSince = ctr;
 
-	err = Pa_OpenStream(&stream, &inputParameters, NULL, Pa_GetDeviceInfo(dev)->defaultSampleRate, 20000,
-		paClipOff | paDitherOff, audioCallback, state);
-	if(err != paNoError)
-		goto error_noinit;
+	if(state->hop >= state->numHops) {
+		state->done = 1;
+		osmosdr_cancel_async(state->dev);
+		return;
+	}
 
-	err = Pa_StartStream(stream);
-	if(err != paNoError)
-		goto error_noinit;
+	if(state->tuneDone)
+		startWindow(state, state->tunedFrom, ctr);
+}
 
-	return stream;
+static void eventCallback(osmosdr_dev_t* dev, enum osmosdr_event_type type, uint64_t samples, void* ctx)
+{
+	struct SweepState* state = (struct SweepState*)ctx;
+	uint16_t tag;
+	uint32_t ctr;
+
+	switch(type) {
+		case OSMOSDR_EVENT_TIMED_COMMAND:
+			if(osmosdr_get_timed_command(dev, &tag, &ctr) < 0)
+				break;
+			if(tag != state->tuneTag)
+				break;
+			state->tuneDone = 1;
+			state->tunedFrom = ctr + state->settle;
+			break;
 
-error:
-	Pa_Terminate();
+		case OSMOSDR_EVENT_DISCONTINUITY:
+			// the partial block isn't contiguous anymore
+			state->fill = 0;
+			break;
 
-error_noinit:
-	fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
-	return NULL;
+		default:
+			break;
+	}
 }
 
-static void audioClose(PaStream* stream)
+static void sampleCallback(unsigned char* buf, uint32_t len, const struct osmosdr_buffer_info* info, void* ctx)
 {
-	PaError err;
+	struct SweepState* state = (struct SweepState*)ctx;
+	const int16_t* samples = (const int16_t*)buf;
+	uint32_t num = len / 4;
+	uint32_t ctr;
+	uint32_t i;
+	uint32_t stop;
+	int32_t ofs;
+
+	if(state->done)
+		return;
+
+	if(osmosdr_get_buffer_sample_ctr(state->dev, &ctr) < 0)
+		return;
+
+	// the first hop was tuned before streaming
+	if(!state->started) {
+		state->started = 1;
+		startWindow(state, ctr + state->settle, ctr);
+	}
+
+	i = 0;
+	while(i < num) {
+		if(!state->haveWindow) {
+			if(state->tuneDone) {
+				startWindow(state, state->tunedFrom, ctr + i);
+				continue;
+			}
+			// a retune that never completes, skip the hop
+			if((int32_t)(ctr + num - state->waitSince) > (int32_t)state->sampleRate) {
+				fprintf(stderr, "no retune to %u Hz\n", hopFreq(state, state->hop));
+				state->ffts = 0;
+				scheduleNext(state, ctr + num);
+				nextHop(state, ctr + num);
+			}
+			return;
+		}
+
+		ofs = (int32_t)(state->from - (ctr + i));
+		if(ofs > 0) {
+			if((uint32_t)ofs >= num - i)
+				return;
+			i += ofs;
+		}
 
-	err = Pa_StopStream(stream);
-	if(err != paNoError)
-		fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
+		stop = num;
+		ofs = (int32_t)(state->end - ctr);
+		if(ofs <= 0) {
+			nextHop(state, ctr + i);
+			if(state->done)
+				return;
+			continue;
+		}
+		if((uint32_t)ofs < stop)
+			stop = ofs;
+
+		for(; i < stop; i++) {
+			state->re[state->fill] = samples[i * 2] / 32768.0f * state->window[state->fill];
+			state->im[state->fill] = samples[i * 2 + 1] / 32768.0f * state->window[state->fill];
+			if(++state->fill == state->fftLen)
+				processBlock(state);
+		}
+
+		if(stop < num) {
+			nextHop(state, ctr + stop);
+			if(state->done)
+				return;
+		}
+	}
+}
 
-	err = Pa_CloseStream(stream);
-	if(err != paNoError)
-		fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
+static int writeMap(struct SweepState* state, FILE* out, int binary)
+{
+	uint32_t bins = state->numHops * state->keep;
+	uint32_t i;
+
+	if(binary) {
+		if((fwrite(&state->start, sizeof(double), 1, out) != 1) ||
+			(fwrite(&state->binWidth, sizeof(double), 1, out) != 1) ||
+			(fwrite(&bins, sizeof(uint32_t), 1, out) != 1) ||
+			(fwrite(state->power, sizeof(float), bins, out) != bins))
+			return -1;
+		return 0;
+	}
 
-	err = Pa_Terminate();
-	if(err != paNoError)
-		fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
+	for(i = 0; i < bins; i++) {
+		if(fprintf(out, "%.1f,%.2f\n", state->start + i * state->binWidth, state->power[i]) < 0)
+			return -1;
+	}
+	return 0;
 }
 
 int main(int argc, char* argv[])
 {
-	HANDLE fd;
-	PaStream* stream;
 	struct SweepState state;
+	struct sigaction sigact;
+	FILE* out = stdout;
+	const char* outName = NULL;
+	uint32_t devIndex = 0;
+	uint32_t sampleRate = DEFAULT_SAMPLE_RATE;
+	int log2Size = DEFAULT_FFT_LOG2;
+	double keep = DEFAULT_KEEP;
+	double stop;
+	int gain = 0;
+	int binary = 0;
+	int opt;
+	int i;
+	int r;
+	uint64_t t;
 
-	if(argc < 4)
+	memset(&state, 0x00, sizeof(struct SweepState));
+	state.averages = DEFAULT_AVERAGES;
+	state.settle = DEFAULT_SETTLE;
+
+	while((opt = getopt(argc, argv, "d:s:g:n:a:k:S:bo:")) != -1) {
+		switch(opt) {
+			case 'd':
+				devIndex = atoi(optarg);
+				break;
+			case 's':
+				sampleRate = (uint32_t)atof(optarg);
+				break;
+			case 'g':
+				gain = (int)(atof(optarg) * 10); // tenths of a dB
+				break;
+			case 'n':
+				log2Size = atoi(optarg);
+				break;
+			case 'a':
+				state.averages = atoi(optarg);
+				break;
+			case 'k':
+				keep = atof(optarg);
+				break;
+			case 'S':
+				state.settle = (uint32_t)atof(optarg);
+				break;
+			case 'b':
+				binary = 1;
+				break;
+			case 'o':
+				outName = optarg;
+				break;
+			default:
+				return printSyntax();
+		}
+	}
+
+	if(argc - optind < 2)
+		return printSyntax();
+	if((keep <= 0.0) || (keep > 1.0) || (state.averages < 1))
+		return printSyntax();
+
+	if((state.fft = fftCreate(log2Size)) == NULL)
 		return printSyntax();
+	state.fftLen = fftSize(state.fft);
 
-	if((fd = serialOpen(argv[1])) == INVALID_HANDLE_VALUE)
+	if(osmosdr_open(&state.dev, devIndex) < 0) {
+		fprintf(stderr, "failed to open OsmoSDR #%u\n", devIndex);
 		return EXIT_FAILURE;
+	}
+	g_state = &state;
+
+	if(osmosdr_set_sample_rate(state.dev, sampleRate) < 0)
+		fprintf(stderr, "failed to set sample rate\n");
+	state.sampleRate = osmosdr_get_sample_rate(state.dev);
+
+	if(gain == 0) {
+		osmosdr_set_tuner_gain_mode(state.dev, 0);
+	} else {
+		osmosdr_set_tuner_gain_mode(state.dev, 1);
+		if(osmosdr_set_tuner_gain(state.dev, gain) < 0)
+			fprintf(stderr, "failed to set tuner gain\n");
+	}
 
-	memset(&state, 0x00, sizeof(struct SweepState));
-	state.serialFd = fd;
-	state.settleTime = 100000;
-	state.start = atof(argv[2]);
-	state.stop = atof(argv[3]);
-	state.freq = state.start * 1000000.0;
-	serialPutS(fd, "\r\r\rtuner.init!\r\r\r");
-	setFreq(fd, state.freq);
-
-	if((stream = audioOpen(&state)) == NULL) {
-		serialClose(fd);
+	// an even number of bins around the center of each hop
+	state.keep = (int)(state.fftLen * keep) & ~1;
+	if(state.keep < 2)
+		state.keep = 2;
+	state.binWidth = (double)state.sampleRate / state.fftLen;
+	state.start = atof(argv[optind]) * 1000000.0;
+	stop = atof(argv[optind + 1]) * 1000000.0;
+	state.numHops = ceil((stop - state.start) / (state.keep * state.binWidth));
+	if(state.numHops < 1)
+		state.numHops = 1;
+
+	state.window = malloc(state.fftLen * sizeof(float));
+	state.re = malloc(state.fftLen * sizeof(float));
+	state.im = malloc(state.fftLen * sizeof(float));
+	state.acc = malloc(state.fftLen * sizeof(double));
+	state.power = malloc(state.numHops * state.keep * sizeof(float));
+	if((state.window == NULL) || (state.re == NULL) || (state.im == NULL) || (state.acc == NULL) || (state.power == NULL)) {
+		fprintf(stderr, "out of memory\n");
 		return EXIT_FAILURE;
 	}
 
-	fprintf(stderr, "sweep running...\n");
+	// Hann
+	for(i = 0; i < state.fftLen; i++)
+		state.window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / state.fftLen);
 
-	while(1) {
-		sleep(1);
-		if(state.freq > state.stop * 1000000.0)
-			break;
-		fprintf(stderr, "...%.1f MHz...\n", state.freq / 1000000.0);
+	if(outName != NULL) {
+		if((out = fopen(outName, binary ? "wb" : "w")) == NULL) {
+			fprintf(stderr, "could not open %s\n", outName);
+			return EXIT_FAILURE;
+		}
 	}
 
-	audioClose(stream);
-	serialClose(fd);
+	fprintf(stderr, "%d hops of %d bins at %.1f Hz, %u Hz sample rate\n",
+		state.numHops, state.keep, state.binWidth, state.sampleRate);
 
-	return EXIT_FAILURE;
+	sigact.sa_handler = sighandler;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = 0;
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+
+	// retuning is scheduled against the device sample counter
+	if(osmosdr_set_stream_framing(state.dev, 1) < 0) {
+		fprintf(stderr, "firmware doesn't support stream framing\n");
+		osmosdr_close(state.dev);
+		return EXIT_FAILURE;
+	}
+	osmosdr_set_event_callback(state.dev, eventCallback, &state);
+
+	if(osmosdr_set_center_freq(state.dev, hopFreq(&state, 0)) < 0)
+		fprintf(stderr, "failed to set center freq\n");
+
+	osmosdr_reset_buffer(state.dev);
+
+	fprintf(stderr, "sweep running...\n");
+	t = getTickCount();
+
+	r = osmosdr_read_async_ext(state.dev, sampleCallback, &state, BUF_NUM, BUF_LENGTH);
+
+	if(state.hop < state.numHops) {
+		fprintf(stderr, "sweep aborted at %u Hz\n", hopFreq(&state, state.hop));
+		r = -1;
+	} else {
+		fprintf(stderr, "sweep done in %u ms, %d incomplete hops\n", (unsigned int)(getTickCount() - t), state.failed);
+		if(writeMap(&state, out, binary) < 0) {
+			fprintf(stderr, "write failed\n");
+			r = -1;
+		}
+	}
+
+	if(out != stdout)
+		fclose(out);
+
+	osmosdr_close(state.dev);
+	fftDestroy(state.fft);
+	free(state.window);
+	free(state.re);
+	free(state.im);
+	free(state.acc);
+	free(state.power);
+
+	return (r < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
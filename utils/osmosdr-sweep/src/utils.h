@@ -5,7 +5,4 @@
 
 uint64_t getTickCount();
 
-typedef int HANDLE;
-#define INVALID_HANDLE_VALUE (-1)
-
 #endif // INCLUDE_UTILS_H